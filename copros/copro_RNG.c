@@ -17,15 +17,13 @@
 
 #include <stdint.h>
 #include <stdlib.h>
-#include <time.h>
+#include <assert.h>
 
 #include <vm/lib8051.h>
 #include <vm/lib8051coprocessors.h>
 
 #include "copro_RNG.h"
 
-#define RNG_INDEX 0
-
 #define RNG_CTRL vm->_sfr[0xC0 ^ 0x80]
 #define RNG_RND  vm->_sfr[0xC1 ^ 0x80]
 
@@ -34,9 +32,32 @@
 
 struct copro_RNG
 {
+  unsigned int copro;           /* number given by add_coprocessor */
   uint32_t cycles_start;
+  uint64_t state;               /* PCG32 generator, one per vm */
 };
 
+/* PCG-XSH-RR, see http://www.pcg-random.org/ */
+static uint32_t next_random (struct copro_RNG *rng)
+{
+  uint64_t state = rng->state;
+  uint32_t xorshifted, rot;
+
+  rng->state = state * UINT64_C (6364136223846793005)
+    + UINT64_C (1442695040888963407);
+  xorshifted = (uint32_t) (((state >> 18) ^ state) >> 27);
+  rot = (uint32_t) (state >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static void seed_random (struct copro_RNG *rng, uint64_t seed)
+{
+  rng->state = 0;
+  next_random (rng);
+  rng->state += seed;
+  next_random (rng);
+}
+
 void print_copro_RNG (struct vm8051 *vm, void *copro)
 {
   struct copro_RNG *rng = copro;
@@ -61,7 +82,10 @@ void operate_copro_RNG (struct vm8051 *vm, void *copro)
 
   /* launch operation */
   if ((RNG_CTRL & RNG_CTRL_RUN_MASK) && !rng->cycles_start)
-    rng->cycles_start = vm->cycles;
+    {
+      rng->cycles_start = vm->cycles;
+      wake_coprocessor (vm, rng->copro, vm->cycles + RNG_DURATION);
+    }
 
   /* currently running */
   if (rng->cycles_start)
@@ -69,7 +93,7 @@ void operate_copro_RNG (struct vm8051 *vm, void *copro)
       /* random generated */
       if (vm->cycles - rng->cycles_start >= RNG_DURATION)
         {
-          RNG_RND = (uint8_t) rand ();
+          RNG_RND = (uint8_t) (next_random (rng) >> 24);
           rng->cycles_start = 0;
         }
     }
@@ -79,16 +103,24 @@ void operate_copro_RNG (struct vm8051 *vm, void *copro)
     RNG_CTRL &= ~RNG_CTRL_RUN_MASK;
 }
 
-void add_copro_RNG (struct vm8051 *vm)
+const struct copro_type8051 copro_RNG_type =
+  {
+    "RNG",
+    operate_copro_RNG,
+    print_copro_RNG,
+    sizeof (struct copro_RNG),
+  };
+
+/* the same seed gives the same random numbers */
+void add_copro_RNG (struct vm8051 *vm, uint64_t seed)
 {
   struct copro_RNG *rng;
 
-  srand (time (NULL));
-
   rng = malloc (sizeof (struct copro_RNG));
+  assert (rng != NULL);
   rng->cycles_start = 0;
+  seed_random (rng, seed);
 
-  operate_copro_table[RNG_INDEX] = &operate_copro_RNG;
-  print_copro_table[RNG_INDEX] = &print_copro_RNG;
-  add_coprocessor (vm, rng, RNG_INDEX);
+  rng->copro = add_coprocessor (vm, &copro_RNG_type, rng);
+  add_coprocessor_trigger (vm, rng->copro, 0xC0);
 }
@@ -18,9 +18,14 @@
 #ifndef COPRO_RNG_H
 #define COPRO_RNG_H
 
+#include <stdint.h>
+
 #include <vm/lib8051.h>
+#include <vm/lib8051coprocessors.h>
+
+extern const struct copro_type8051 copro_RNG_type;
 
-extern void add_copro_RNG (struct vm8051 *vm);
+extern void add_copro_RNG (struct vm8051 *vm, uint64_t seed);
 extern void operate_copro_RNG (struct vm8051 *vm, void *copro);
 extern void print_copro_RNG (struct vm8051 *vm, void *copro);
 
@@ -20,9 +20,6 @@
 
 #include "lib8051print.h"
 
-static int32_t PC;
-
-
 /* fprint primitives */
 
 /* add A, Rn              1       1 */
@@ -598,7 +595,7 @@ static void fprint_pop (FILE *stream, uint8_t direct)
 }
 
 /* jz rel                 2       2 */
-static void fprint_jz (FILE *stream, uint8_t rel)
+static void fprint_jz (FILE *stream, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JZ    ($ + 2) + % 4d            ",
@@ -609,7 +606,7 @@ static void fprint_jz (FILE *stream, uint8_t rel)
 }
 
 /* jnz rel                2       2 */
-static void fprint_jnz (FILE *stream, uint8_t rel)
+static void fprint_jnz (FILE *stream, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JNZ   ($ + 2) + % 4d            ",
@@ -620,7 +617,7 @@ static void fprint_jnz (FILE *stream, uint8_t rel)
 }
 
 /* jc rel                 2       2 */
-static void fprint_jc (FILE *stream, uint8_t rel)
+static void fprint_jc (FILE *stream, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JC    ($ + 2) + % 4d            ",
@@ -631,7 +628,7 @@ static void fprint_jc (FILE *stream, uint8_t rel)
 }
 
 /* jnc rel                2       2 */
-static void fprint_jnc (FILE *stream, uint8_t rel)
+static void fprint_jnc (FILE *stream, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JNC   ($ + 2) + % 4d            ",
@@ -642,7 +639,7 @@ static void fprint_jnc (FILE *stream, uint8_t rel)
 }
 
 /* jb bit, rel            3       2 */
-static void fprint_jb (FILE *stream, uint8_t bit, uint8_t rel)
+static void fprint_jb (FILE *stream, uint8_t bit, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JB    " FORMAT_BYTE ".%X, ($ + 3) + % 4d    ",
@@ -655,7 +652,7 @@ static void fprint_jb (FILE *stream, uint8_t bit, uint8_t rel)
 }
 
 /* jnb bit, rel           3       2 */
-static void fprint_jnb (FILE *stream, uint8_t bit, uint8_t rel)
+static void fprint_jnb (FILE *stream, uint8_t bit, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JNB   " FORMAT_BYTE ".%X, ($ + 3) + % 4d    ",
@@ -668,7 +665,7 @@ static void fprint_jnb (FILE *stream, uint8_t bit, uint8_t rel)
 }
 
 /* jbc bit, rel           3       2 */
-static void fprint_jbc (FILE *stream, uint8_t bit, uint8_t rel)
+static void fprint_jbc (FILE *stream, uint8_t bit, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "JBC   " FORMAT_BYTE ".%X, ($ + 3) + % 4d    ",
@@ -681,7 +678,7 @@ static void fprint_jbc (FILE *stream, uint8_t bit, uint8_t rel)
 }
 
 /* cjne A, direct, rel    3       2 */
-static void fprint_cjne_direct (FILE *stream, uint8_t direct, uint8_t rel)
+static void fprint_cjne_direct (FILE *stream, uint8_t direct, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "CJNE  A, " FORMAT_BYTE ", ($ + 3) + % 4d   ",
@@ -692,7 +689,7 @@ static void fprint_cjne_direct (FILE *stream, uint8_t direct, uint8_t rel)
 }
 
 /* cjne A, #data, rel     3       2 */
-static void fprint_cjne_data (FILE *stream, uint8_t data, uint8_t rel)
+static void fprint_cjne_data (FILE *stream, uint8_t data, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "CJNE  A, #" FORMAT_BYTE ", ($ + 3) + % 4d  ",
@@ -703,7 +700,7 @@ static void fprint_cjne_data (FILE *stream, uint8_t data, uint8_t rel)
 }
 
 /* cjne Rn, #data, rel    3       2 */
-static void fprint_cjne_data_with_Rn (FILE *stream, unsigned char n, uint8_t data, uint8_t rel)
+static void fprint_cjne_data_with_Rn (FILE *stream, unsigned char n, uint8_t data, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "CJNE  R%X, #" FORMAT_BYTE ", ($+3) + % 4d   ",
@@ -714,7 +711,7 @@ static void fprint_cjne_data_with_Rn (FILE *stream, unsigned char n, uint8_t dat
 }
 
 /* cjne @Ri, #data, rel   3       2 */
-static void fprint_cjne_data_with_atRi (FILE *stream, unsigned char i, uint8_t data, uint8_t rel)
+static void fprint_cjne_data_with_atRi (FILE *stream, unsigned char i, uint8_t data, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "CJNE  @R%X, #" FORMAT_BYTE ", ($ + 3) + % 4d",
@@ -725,7 +722,7 @@ static void fprint_cjne_data_with_atRi (FILE *stream, unsigned char i, uint8_t d
 }
 
 /* djnz Rn, rel           2       2 */
-static void fprint_djnz_Rn (FILE *stream, unsigned char n, uint8_t rel)
+static void fprint_djnz_Rn (FILE *stream, unsigned char n, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "DJNZ  R%X, ($ + 2) + % 4d        ",
@@ -736,7 +733,7 @@ static void fprint_djnz_Rn (FILE *stream, unsigned char n, uint8_t rel)
 }
 
 /* djnz direct, rel       3       2 */
-static void fprint_djnz_direct (FILE *stream, uint8_t direct, uint8_t rel)
+static void fprint_djnz_direct (FILE *stream, uint8_t direct, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "DJNZ  " FORMAT_BYTE ", ($ + 3) + % 4d      ",
@@ -747,7 +744,7 @@ static void fprint_djnz_direct (FILE *stream, uint8_t direct, uint8_t rel)
 }
 
 /* ajmp addr11            2       2 */
-static void fprint_ajmp (FILE *stream, unsigned char prefix, uint8_t addr11)
+static void fprint_ajmp (FILE *stream, unsigned char prefix, uint8_t addr11, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "AJMP  ($ & " FORMAT_WORD ") | " FORMAT_WORD "     ",
@@ -765,7 +762,7 @@ static void fprint_ljmp (FILE *stream, uint8_t addr16_high, uint8_t addr16_low)
 }
 
 /* sjmp rel               2       2 */
-static void fprint_sjmp (FILE *stream, uint8_t rel)
+static void fprint_sjmp (FILE *stream, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "SJMP  ($ + 2) + % 4d            ",
@@ -788,7 +785,7 @@ static void fprint_nop (FILE *stream)
 }
 
 /* acall addr11           2       2 */
-static void fprint_acall (FILE *stream, unsigned char prefix, uint8_t addr11)
+static void fprint_acall (FILE *stream, unsigned char prefix, uint8_t addr11, int32_t PC)
 {
   if (PC == -1)
     fprintf (stream, "ACALL ($ & " FORMAT_WORD ") | " FORMAT_WORD "     ",
@@ -831,8 +828,6 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
 {
   unsigned char n;
 
-  PC = current_PC;
-
   /* opcodes with register argument */
   if (IR[0] & 0x08)
     {
@@ -873,13 +868,13 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
           fprint_mov_direct_to_Rn (stream, n, IR[1]);
           break;
         case 0xB0:
-          fprint_cjne_data_with_Rn (stream, n, IR[1], IR[2]);
+          fprint_cjne_data_with_Rn (stream, n, IR[1], IR[2], current_PC);
           break;
         case 0xC0:
           fprint_xch_Rn (stream, n);
           break;
         case 0xD0:
-          fprint_djnz_Rn (stream, n, IR[1]);
+          fprint_djnz_Rn (stream, n, IR[1], current_PC);
           break;
         case 0xE0:
           fprint_mov_Rn (stream, n);
@@ -929,7 +924,7 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
           fprint_mov_direct_to_atRi (stream, n, IR[1]);
           break;
         case 0xB0:
-          fprint_cjne_data_with_atRi (stream, n, IR[1], IR[2]);
+          fprint_cjne_data_with_atRi (stream, n, IR[1], IR[2], current_PC);
           break;
         case 0xC0:
           fprint_xch_atRi (stream, n);
@@ -949,9 +944,9 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
     {
       n = (IR[0] & 0xE0) >> 5;
       if (IR[0] & 0x10)
-        fprint_acall (stream, n, IR[1]);
+        fprint_acall (stream, n, IR[1], current_PC);
       else
-        fprint_ajmp (stream, n, IR[1]);
+        fprint_ajmp (stream, n, IR[1], current_PC);
     }
   else if ((IR[0] & 0xEE) == 0xE2)
     {
@@ -969,28 +964,28 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
           fprint_nop (stream);
           break;
         case 0x10:
-          fprint_jbc (stream, IR[1], IR[2]);
+          fprint_jbc (stream, IR[1], IR[2], current_PC);
           break;
         case 0x20:
-          fprint_jb (stream, IR[1], IR[2]);
+          fprint_jb (stream, IR[1], IR[2], current_PC);
           break;
         case 0x30:
-          fprint_jnb (stream, IR[1], IR[2]);
+          fprint_jnb (stream, IR[1], IR[2], current_PC);
           break;
         case 0x40:
-          fprint_jc (stream, IR[1]);
+          fprint_jc (stream, IR[1], current_PC);
           break;
         case 0x50:
-          fprint_jnc (stream, IR[1]);
+          fprint_jnc (stream, IR[1], current_PC);
           break;
         case 0x60:
-          fprint_jz (stream, IR[1]);
+          fprint_jz (stream, IR[1], current_PC);
           break;
         case 0x70:
-          fprint_jnz (stream, IR[1]);
+          fprint_jnz (stream, IR[1], current_PC);
           break;
         case 0x80:
-          fprint_sjmp (stream, IR[1]);
+          fprint_sjmp (stream, IR[1], current_PC);
           break;
         case 0x90:
           fprint_mov_to_DPTR (stream, IR[1], IR[2]);
@@ -1131,7 +1126,7 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
           fprint_mul (stream);
           break;
         case 0xB4:
-          fprint_cjne_data (stream, IR[1], IR[2]);
+          fprint_cjne_data (stream, IR[1], IR[2], current_PC);
           break;
         case 0xC4:
           fprint_swap (stream);
@@ -1177,13 +1172,13 @@ void fprint_op (FILE *stream, uint8_t *IR, int32_t current_PC)
           fprint_subb_direct (stream, IR[1]);
           break;
         case 0xB5:
-          fprint_cjne_direct (stream, IR[1], IR[2]);
+          fprint_cjne_direct (stream, IR[1], IR[2], current_PC);
           break;
         case 0xC5:
           fprint_xch_direct (stream, IR[1]);
           break;
         case 0xD5:
-          fprint_djnz_direct (stream, IR[1], IR[2]);
+          fprint_djnz_direct (stream, IR[1], IR[2], current_PC);
           break;
         case 0xE5:
           fprint_mov_direct (stream, IR[1]);
@@ -1771,7 +1766,7 @@ static void sprint_pop (char *str, uint8_t direct)
 }
 
 /* jz rel                 2       2 */
-static void sprint_jz (char *str, uint8_t rel)
+static void sprint_jz (char *str, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JZ    ($ + 2) + % 4d            ",
@@ -1782,7 +1777,7 @@ static void sprint_jz (char *str, uint8_t rel)
 }
 
 /* jnz rel                2       2 */
-static void sprint_jnz (char *str, uint8_t rel)
+static void sprint_jnz (char *str, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JNZ   ($ + 2) + % 4d            ",
@@ -1793,7 +1788,7 @@ static void sprint_jnz (char *str, uint8_t rel)
 }
 
 /* jc rel                 2       2 */
-static void sprint_jc (char *str, uint8_t rel)
+static void sprint_jc (char *str, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JC    ($ + 2) + % 4d            ",
@@ -1804,7 +1799,7 @@ static void sprint_jc (char *str, uint8_t rel)
 }
 
 /* jnc rel                2       2 */
-static void sprint_jnc (char *str, uint8_t rel)
+static void sprint_jnc (char *str, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JNC   ($ + 2) + % 4d            ",
@@ -1815,7 +1810,7 @@ static void sprint_jnc (char *str, uint8_t rel)
 }
 
 /* jb bit, rel            3       2 */
-static void sprint_jb (char *str, uint8_t bit, uint8_t rel)
+static void sprint_jb (char *str, uint8_t bit, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JB    " FORMAT_BYTE ".%X, ($ + 3) + % 4d    ",
@@ -1828,7 +1823,7 @@ static void sprint_jb (char *str, uint8_t bit, uint8_t rel)
 }
 
 /* jnb bit, rel           3       2 */
-static void sprint_jnb (char *str, uint8_t bit, uint8_t rel)
+static void sprint_jnb (char *str, uint8_t bit, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JNB   " FORMAT_BYTE ".%X, ($ + 3) + % 4d    ",
@@ -1841,7 +1836,7 @@ static void sprint_jnb (char *str, uint8_t bit, uint8_t rel)
 }
 
 /* jbc bit, rel           3       2 */
-static void sprint_jbc (char *str, uint8_t bit, uint8_t rel)
+static void sprint_jbc (char *str, uint8_t bit, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "JBC   " FORMAT_BYTE ".%X, ($ + 3) + % 4d    ",
@@ -1854,7 +1849,7 @@ static void sprint_jbc (char *str, uint8_t bit, uint8_t rel)
 }
 
 /* cjne A, direct, rel    3       2 */
-static void sprint_cjne_direct (char *str, uint8_t direct, uint8_t rel)
+static void sprint_cjne_direct (char *str, uint8_t direct, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "CJNE  A, " FORMAT_BYTE ", ($ + 3) + % 4d   ",
@@ -1865,7 +1860,7 @@ static void sprint_cjne_direct (char *str, uint8_t direct, uint8_t rel)
 }
 
 /* cjne A, #data, rel     3       2 */
-static void sprint_cjne_data (char *str, uint8_t data, uint8_t rel)
+static void sprint_cjne_data (char *str, uint8_t data, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "CJNE  A, #" FORMAT_BYTE ", ($ + 3) + % 4d  ",
@@ -1876,7 +1871,7 @@ static void sprint_cjne_data (char *str, uint8_t data, uint8_t rel)
 }
 
 /* cjne Rn, #data, rel    3       2 */
-static void sprint_cjne_data_with_Rn (char *str, unsigned char n, uint8_t data, uint8_t rel)
+static void sprint_cjne_data_with_Rn (char *str, unsigned char n, uint8_t data, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "CJNE  R%X, #" FORMAT_BYTE ", ($+3) + % 4d   ",
@@ -1887,7 +1882,7 @@ static void sprint_cjne_data_with_Rn (char *str, unsigned char n, uint8_t data,
 }
 
 /* cjne @Ri, #data, rel   3       2 */
-static void sprint_cjne_data_with_atRi (char *str, unsigned char i, uint8_t data, uint8_t rel)
+static void sprint_cjne_data_with_atRi (char *str, unsigned char i, uint8_t data, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "CJNE  @R%X, #" FORMAT_BYTE ", ($ + 3) + % 4d",
@@ -1898,7 +1893,7 @@ static void sprint_cjne_data_with_atRi (char *str, unsigned char i, uint8_t data
 }
 
 /* djnz Rn, rel           2       2 */
-static void sprint_djnz_Rn (char *str, unsigned char n, uint8_t rel)
+static void sprint_djnz_Rn (char *str, unsigned char n, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "DJNZ  R%X, ($ + 2) + % 4d        ",
@@ -1909,7 +1904,7 @@ static void sprint_djnz_Rn (char *str, unsigned char n, uint8_t rel)
 }
 
 /* djnz direct, rel       3       2 */
-static void sprint_djnz_direct (char *str, uint8_t direct, uint8_t rel)
+static void sprint_djnz_direct (char *str, uint8_t direct, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "DJNZ  " FORMAT_BYTE ", ($ + 3) + % 4d      ",
@@ -1920,7 +1915,7 @@ static void sprint_djnz_direct (char *str, uint8_t direct, uint8_t rel)
 }
 
 /* ajmp addr11            2       2 */
-static void sprint_ajmp (char *str, unsigned char prefix, uint8_t addr11)
+static void sprint_ajmp (char *str, unsigned char prefix, uint8_t addr11, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "AJMP  ($ & " FORMAT_WORD ") | " FORMAT_WORD "     ",
@@ -1938,7 +1933,7 @@ static void sprint_ljmp (char *str, uint8_t addr16_high, uint8_t addr16_low)
 }
 
 /* sjmp rel               2       2 */
-static void sprint_sjmp (char *str, uint8_t rel)
+static void sprint_sjmp (char *str, uint8_t rel, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "SJMP  ($ + 2) + % 4d            ",
@@ -1961,7 +1956,7 @@ static void sprint_nop (char *str)
 }
 
 /* acall addr11           2       2 */
-static void sprint_acall (char *str, unsigned char prefix, uint8_t addr11)
+static void sprint_acall (char *str, unsigned char prefix, uint8_t addr11, int32_t PC)
 {
   if (PC == -1)
     sprintf (str, "ACALL ($ & " FORMAT_WORD ") | " FORMAT_WORD "     ",
@@ -2004,8 +1999,6 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
 {
   unsigned char n;
 
-  PC = current_PC;
-
   /* opcodes with register argument */
   if (IR[0] & 0x08)
     {
@@ -2046,13 +2039,13 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
           sprint_mov_direct_to_Rn (str, n, IR[1]);
           break;
         case 0xB0:
-          sprint_cjne_data_with_Rn (str, n, IR[1], IR[2]);
+          sprint_cjne_data_with_Rn (str, n, IR[1], IR[2], current_PC);
           break;
         case 0xC0:
           sprint_xch_Rn (str, n);
           break;
         case 0xD0:
-          sprint_djnz_Rn (str, n, IR[1]);
+          sprint_djnz_Rn (str, n, IR[1], current_PC);
           break;
         case 0xE0:
           sprint_mov_Rn (str, n);
@@ -2102,7 +2095,7 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
           sprint_mov_direct_to_atRi (str, n, IR[1]);
           break;
         case 0xB0:
-          sprint_cjne_data_with_atRi (str, n, IR[1], IR[2]);
+          sprint_cjne_data_with_atRi (str, n, IR[1], IR[2], current_PC);
           break;
         case 0xC0:
           sprint_xch_atRi (str, n);
@@ -2122,9 +2115,9 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
     {
       n = (IR[0] & 0xE0) >> 5;
       if (IR[0] & 0x10)
-        sprint_acall (str, n, IR[1]);
+        sprint_acall (str, n, IR[1], current_PC);
       else
-        sprint_ajmp (str, n, IR[1]);
+        sprint_ajmp (str, n, IR[1], current_PC);
     }
   else if ((IR[0] & 0xEE) == 0xE2)
     {
@@ -2142,28 +2135,28 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
           sprint_nop (str);
           break;
         case 0x10:
-          sprint_jbc (str, IR[1], IR[2]);
+          sprint_jbc (str, IR[1], IR[2], current_PC);
           break;
         case 0x20:
-          sprint_jb (str, IR[1], IR[2]);
+          sprint_jb (str, IR[1], IR[2], current_PC);
           break;
         case 0x30:
-          sprint_jnb (str, IR[1], IR[2]);
+          sprint_jnb (str, IR[1], IR[2], current_PC);
           break;
         case 0x40:
-          sprint_jc (str, IR[1]);
+          sprint_jc (str, IR[1], current_PC);
           break;
         case 0x50:
-          sprint_jnc (str, IR[1]);
+          sprint_jnc (str, IR[1], current_PC);
           break;
         case 0x60:
-          sprint_jz (str, IR[1]);
+          sprint_jz (str, IR[1], current_PC);
           break;
         case 0x70:
-          sprint_jnz (str, IR[1]);
+          sprint_jnz (str, IR[1], current_PC);
           break;
         case 0x80:
-          sprint_sjmp (str, IR[1]);
+          sprint_sjmp (str, IR[1], current_PC);
           break;
         case 0x90:
           sprint_mov_to_DPTR (str, IR[1], IR[2]);
@@ -2304,7 +2297,7 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
           sprint_mul (str);
           break;
         case 0xB4:
-          sprint_cjne_data (str, IR[1], IR[2]);
+          sprint_cjne_data (str, IR[1], IR[2], current_PC);
           break;
         case 0xC4:
           sprint_swap (str);
@@ -2350,13 +2343,13 @@ void sprint_op (char *str, uint8_t *IR, int32_t current_PC)
           sprint_subb_direct (str, IR[1]);
           break;
         case 0xB5:
-          sprint_cjne_direct (str, IR[1], IR[2]);
+          sprint_cjne_direct (str, IR[1], IR[2], current_PC);
           break;
         case 0xC5:
           sprint_xch_direct (str, IR[1]);
           break;
         case 0xD5:
-          sprint_djnz_direct (str, IR[1], IR[2]);
+          sprint_djnz_direct (str, IR[1], IR[2], current_PC);
           break;
         case 0xE5:
           sprint_mov_direct (str, IR[1]);
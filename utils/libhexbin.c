@@ -16,9 +16,15 @@
    along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "libhexbin.h"
 
@@ -38,47 +44,356 @@ static void fprint_line (FILE *stream, uint16_t nb, int i, uint8_t *line)
   fprintf (stream, "%02X\n", ck);
 }
 
-static uint8_t get_nibble (char c)
+/* value of the hexadecimal digit c, -1 if not one */
+static int get_nibble (char c)
 {
-  uint8_t nibble;
   if (('0' <= c) && (c <= '9'))
-    nibble = c - '0';
-  else if (('A' <= c) && (c <= 'F'))
-    nibble = 10 + (c - 'A');
+    return c - '0';
+  if (('A' <= c) && (c <= 'F'))
+    return 10 + (c - 'A');
+  if (('a' <= c) && (c <= 'f'))
+    return 10 + (c - 'a');
+  return -1;
+}
+
+/* value of the two hexadecimal digits at buf, -1 if not digits */
+static int get_byte (const char *buf)
+{
+  int high = get_nibble (buf[0]);
+  int low = get_nibble (buf[1]);
+
+  if (high < 0 || low < 0)
+    return -1;
+  return (high << 4) | low;
+}
+
+/* append len bytes at address, extending the last range if they follow
+   it */
+static void add_range (struct hex_image *image, uint32_t address,
+                       const uint8_t *bytes, uint32_t len)
+{
+  struct hex_range *last = NULL;
+
+  if (len == 0)
+    return;
+  memcpy (image->data + image->len, bytes, len);
+  if (image->nranges)
+    last = &image->ranges[image->nranges - 1];
+  if (last && last->address + last->len == address)
+    last->len += len;
   else
-    assert (0);
-  return nibble;
+    {
+      /* the capacity doubles each time nranges is a power of 2 */
+      if ((image->nranges & (image->nranges - 1)) == 0)
+        {
+          image->ranges = realloc (image->ranges, 2 * (image->nranges + 1)
+                                   * sizeof (struct hex_range));
+          assert (image->ranges != NULL);
+        }
+      last = &image->ranges[image->nranges++];
+      last->address = address;
+      last->len = len;
+      last->offset = image->len;
+    }
+  image->len += len;
 }
 
-static uint8_t get_byte (char *buf)
+static int fail_hex (struct hex_image *image, int error)
 {
-  return (get_nibble (buf[0]) << 4) + (get_nibble (buf[1]));
+  free_hex (image);
+  return error;
 }
 
-size_t read_hex (uint8_t *code, FILE *stream)
+/* parse the len characters of text, stopping at the end of file record;
+   on error, image->line tells where */
+int parse_hex (struct hex_image *image, const char *text, size_t len)
 {
-  size_t i, nb = 0;
-  char buffer[80];
+  const char *end = text + len;
+  uint8_t record[4 + 255 + 1];  /* length, address, type, data, checksum */
+  uint32_t base = 0;
+  size_t i, n;
+  uint16_t address;
+  uint8_t sum;
+  int byte;
 
-  for (i = 0; i < MAX_LEN; i++)
-    code[i] = 0;
+  memset (image, 0, sizeof (struct hex_image));
+  image->line = 1;
+  /* two characters at least per byte of data */
+  image->data = malloc (len / 2 + 1);
+  assert (image->data != NULL);
+
+  while (text < end)
+    {
+      if (*text == '\n')
+        image->line++;
+      if (*text == '\n' || *text == '\r' || *text == ' ' || *text == '\t')
+        {
+          text++;
+          continue;
+        }
+      if (*text != ':' || end - text < 11
+          || (byte = get_byte (text + 1)) < 0)
+        return fail_hex (image, HEX_ESYNTAX);
+      text++;
+      n = 4 + byte + 1;
+      if ((size_t) (end - text) < 2 * n)
+        return fail_hex (image, HEX_ESYNTAX);
+      sum = 0;
+      for (i = 0; i < n; i++)
+        {
+          if ((byte = get_byte (text + 2 * i)) < 0)
+            return fail_hex (image, HEX_ESYNTAX);
+          record[i] = byte;
+          sum += byte;
+        }
+      if (sum != 0)
+        return fail_hex (image, HEX_ECHECKSUM);
+      text += 2 * n;
+      n = record[0];
+      address = (record[1] << 8) | record[2];
+
+      switch (record[3])
+        {
+        case 0x00:              /* data */
+          add_range (image, base + address, record + 4, n);
+          break;
+        case 0x01:              /* end of file */
+          if (n != 0)
+            return fail_hex (image, HEX_ERECORD);
+          return HEX_OK;
+        case 0x02:              /* extended segment address */
+        case 0x04:              /* extended linear address */
+          if (n != 2)
+            return fail_hex (image, HEX_ERECORD);
+          base = (uint32_t) ((record[4] << 8) | record[5])
+            << (record[3] == 0x02 ? 4 : 16);
+          break;
+        case 0x03:              /* start segment address (CS:IP) */
+        case 0x05:              /* start linear address */
+          if (n != 4)
+            return fail_hex (image, HEX_ERECORD);
+          if (record[3] == 0x03)
+            image->start = ((uint32_t) ((record[4] << 8) | record[5]) << 4)
+              + ((record[6] << 8) | record[7]);
+          else
+            image->start = ((uint32_t) record[4] << 24)
+              | ((uint32_t) record[5] << 16) | (record[6] << 8) | record[7];
+          image->has_start = 1;
+          break;
+        default:
+          return fail_hex (image, HEX_ERECORD);
+        }
+    }
+  return HEX_OK;
+}
+
+/* the whole file, from a mapping when possible */
+int map_hex (struct hex_text *text, const char *path)
+{
+  struct stat st;
+  char *copy = NULL;
+  size_t size = 0;
+  ssize_t n;
+  int fd;
+
+  text->text = NULL;
+  text->len = 0;
+  text->mapped = 0;
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return HEX_EOPEN;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0)
+    {
+      copy = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (copy != MAP_FAILED)
+        {
+          text->text = copy;
+          text->len = st.st_size;
+          text->mapped = 1;
+          close (fd);
+          return HEX_OK;
+        }
+      copy = NULL;
+    }
+  /* a pipe or an empty file */
+  do
+    {
+      if (text->len == size)
+        {
+          size = size ? 2 * size : 4096;
+          copy = realloc (copy, size);
+          assert (copy != NULL);
+        }
+      n = read (fd, copy + text->len, size - text->len);
+      if (n > 0)
+        text->len += n;
+    }
+  while (n > 0);
+  close (fd);
+  if (n < 0)
+    {
+      free (copy);
+      text->len = 0;
+      return HEX_EOPEN;
+    }
+  text->text = copy;
+  return HEX_OK;
+}
+
+void unmap_hex (struct hex_text *text)
+{
+  if (text->mapped)
+    munmap ((char *) text->text, text->len);
+  else
+    free ((char *) text->text);
+  text->text = NULL;
+  text->len = 0;
+}
+
+int load_hex (struct hex_image *image, const char *path)
+{
+  struct hex_text text;
+  int ret;
+
+  memset (image, 0, sizeof (struct hex_image));
+  ret = map_hex (&text, path);
+  if (ret != HEX_OK)
+    return ret;
+  ret = parse_hex (image, text.text, text.len);
+  unmap_hex (&text);
+  return ret;
+}
 
-  while (fgets (buffer, 80, stream))
+/* write the ranges of the image below size to code, return how many bytes
+   were written; the rest of code is left as is */
+size_t place_hex (const struct hex_image *image, uint8_t *code, size_t size)
+{
+  size_t i, n, nb = 0;
+
+  for (i = 0; i < image->nranges; i++)
+    {
+      const struct hex_range *range = &image->ranges[i];
+
+      if (range->address >= size)
+        continue;
+      n = size - range->address;
+      if (range->len < n)
+        n = range->len;
+      memcpy (code + range->address, image->data + range->offset, n);
+      nb += n;
+    }
+  return nb;
+}
+
+/* number of 64 KiB pages of addresses the image reaches, at most
+   MAX_BANKS */
+unsigned int count_banks (const struct hex_image *image)
+{
+  unsigned int nbanks = 1;
+  uint32_t last;
+  size_t i;
+
+  for (i = 0; i < image->nranges; i++)
+    {
+      last = image->ranges[i].address + (image->ranges[i].len - 1);
+      if (last < image->ranges[i].address)
+        last = UINT32_MAX;
+      if (last / MAX_LEN >= nbanks)
+        nbanks = last / MAX_LEN + 1;
+    }
+  return nbanks < MAX_BANKS ? nbanks : MAX_BANKS;
+}
+
+/* write the image to nbanks views of 64 KiB at code: view n is page n of
+   the addresses over a copy of page 0, which holds the common area; return
+   how many bytes were written */
+size_t place_banks (const struct hex_image *image, uint8_t *code,
+                    unsigned int nbanks)
+{
+  size_t i, nb, start, end, limit = (size_t) nbanks * MAX_LEN;
+  unsigned int n;
+
+  nb = place_hex (image, code, MAX_LEN);
+  for (n = 1; n < nbanks; n++)
+    memcpy (code + (size_t) n * MAX_LEN, code, MAX_LEN);
+  for (i = 0; i < image->nranges; i++)
+    {
+      const struct hex_range *range = &image->ranges[i];
+
+      start = range->address;
+      end = start + range->len;
+      if (start < MAX_LEN)
+        start = MAX_LEN;
+      if (end > limit)
+        end = limit;
+      if (start >= end)
+        continue;
+      memcpy (code + start,
+              image->data + range->offset + (start - range->address),
+              end - start);
+      nb += end - start;
+    }
+  return nb;
+}
+
+void free_hex (struct hex_image *image)
+{
+  free (image->data);
+  free (image->ranges);
+  image->data = NULL;
+  image->len = 0;
+  image->ranges = NULL;
+  image->nranges = 0;
+}
+
+const char *hex_strerror (int error)
+{
+  switch (error)
     {
-      size_t len;
-      uint16_t address;
-
-      assert (buffer[0] == ':');
-      len = get_byte (buffer+1);
-      address = (get_byte (buffer+3) << 8) + get_byte (buffer+5);
-      assert (buffer[7] == '0');
-      assert (buffer[8] == '0' || buffer[8] == '1');
-
-      for (i = 0; i < len; i++)
-        code[address+i] = get_byte (buffer+9+2*i);
-      nb += len;
+    case HEX_OK:
+      return "no error";
+    case HEX_EOPEN:
+      return strerror (errno);
+    case HEX_ESYNTAX:
+      return "invalid record";
+    case HEX_ECHECKSUM:
+      return "wrong checksum";
+    case HEX_ERECORD:
+      return "unsupported record";
     }
+  return "unknown error";
+}
 
+/* load a 64 KiB image from stream, return 0 if it is invalid or does not
+   fit */
+size_t read_hex (uint8_t *code, FILE *stream)
+{
+  struct hex_image image;
+  char *text = NULL;
+  size_t len = 0, size = 0, n, nb = 0;
+
+  do
+    {
+      if (len == size)
+        {
+          size = size ? 2 * size : 4096;
+          text = realloc (text, size);
+          assert (text != NULL);
+        }
+      n = fread (text + len, 1, size - len, stream);
+      len += n;
+    }
+  while (n > 0);
+
+  memset (code, 0, MAX_LEN);
+  if (parse_hex (&image, text, len) == HEX_OK)
+    {
+      nb = place_hex (&image, code, MAX_LEN);
+      if (nb != image.len)
+        nb = 0;
+      free_hex (&image);
+    }
+  free (text);
   return nb;
 }
 
@@ -22,6 +22,56 @@
 #include <stdint.h>
 
 #define MAX_LEN 65536
+#define MAX_BANKS 256
+
+/* errors of parse_hex and load_hex */
+#define HEX_OK 0
+#define HEX_EOPEN 1             /* see errno */
+#define HEX_ESYNTAX 2           /* not a record */
+#define HEX_ECHECKSUM 3
+#define HEX_ERECORD 4           /* unknown type or wrong length */
+
+/* bytes at consecutive addresses, stored at offset in the data */
+struct hex_range
+{
+  uint32_t address;
+  uint32_t len;
+  size_t offset;
+};
+
+/* the contents of a hex file: only the ranges given by data records,
+   in the order of the file, later ones overriding earlier ones */
+struct hex_image
+{
+  uint8_t *data;
+  size_t len;                   /* bytes in all the ranges */
+  struct hex_range *ranges;
+  size_t nranges;
+  uint32_t start;               /* from records 03 and 05 */
+  int has_start;
+  unsigned int line;            /* of the error */
+};
+
+/* the text of a hex file */
+struct hex_text
+{
+  const char *text;
+  size_t len;
+  int mapped;
+};
+
+extern int map_hex (struct hex_text *text, const char *path);
+extern void unmap_hex (struct hex_text *text);
+extern int parse_hex (struct hex_image *image, const char *text,
+                      size_t len);
+extern int load_hex (struct hex_image *image, const char *path);
+extern size_t place_hex (const struct hex_image *image, uint8_t *code,
+                         size_t size);
+extern unsigned int count_banks (const struct hex_image *image);
+extern size_t place_banks (const struct hex_image *image, uint8_t *code,
+                           unsigned int nbanks);
+extern void free_hex (struct hex_image *image);
+extern const char *hex_strerror (int error);
 
 extern size_t read_hex (uint8_t *code, FILE *stream);
 extern size_t write_hex (uint8_t *code, FILE *stream);
@@ -0,0 +1,340 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vm/lib8051.h>
+
+#include "libhexbin.h"
+#include "libimagecache.h"
+
+#define CACHE_MAGIC "VM8051C3"
+
+/* what a file of the cache directory starts with; the rest is the ranges,
+   the code and the decoded instructions, as in memory; the
+   superinstructions are found again on load, as they depend on the
+   build */
+struct cache_header
+{
+  char magic[8];
+  uint64_t hash;
+  uint64_t size;
+  uint64_t len;
+  uint64_t nbanks;
+  uint64_t nranges;
+  uint64_t insts;               /* sizeof of the decoded instructions */
+};
+
+/* 64-bit FNV-1a */
+static uint64_t hash_text (const char *text, size_t len)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      hash ^= (uint8_t) text[i];
+      hash *= 0x100000001B3ULL;
+    }
+  return hash;
+}
+
+/* name of the file of image in the cache directory, with suffix */
+static char *cache_path (struct image_cache *cache,
+                         const struct code_image *image, const char *suffix)
+{
+  char *path;
+  int len;
+
+  len = snprintf (NULL, 0, "%s/%016llx-%llx.img%s", cache->dir,
+                  (unsigned long long) image->hash,
+                  (unsigned long long) image->size, suffix);
+  path = malloc (len + 1);
+  assert (path != NULL);
+  snprintf (path, len + 1, "%s/%016llx-%llx.img%s", cache->dir,
+            (unsigned long long) image->hash,
+            (unsigned long long) image->size, suffix);
+  return path;
+}
+
+/* room for nbanks and nranges */
+static void alloc_image (struct code_image *image)
+{
+  image->code = calloc (image->nbanks, MAX_LEN);
+  assert (image->code != NULL);
+  image->ranges = malloc (image->nranges * sizeof (struct hex_range) + 1);
+  assert (image->ranges != NULL);
+  image->predecode = malloc (image->nbanks * sizeof (struct predecode8051));
+  assert (image->predecode != NULL);
+}
+
+/* whether the ranges of image are within its banks */
+static int valid_ranges (const struct code_image *image)
+{
+  uint64_t limit = (uint64_t) image->nbanks * MAX_LEN;
+  size_t i;
+
+  for (i = 0; i < image->nranges; i++)
+    if ((uint64_t) image->ranges[i].address + image->ranges[i].len > limit)
+      return 0;
+  return 1;
+}
+
+/* fill image from the cache directory, return 0 if it is not there */
+static int read_cached (struct image_cache *cache, struct code_image *image)
+{
+  struct cache_header header;
+  char *path;
+  FILE *stream;
+  unsigned int n;
+  int ok = 0;
+
+  path = cache_path (cache, image, "");
+  stream = fopen (path, "rb");
+  free (path);
+  if (stream == NULL)
+    return 0;
+  if (fread (&header, sizeof (header), 1, stream) == 1
+      && memcmp (header.magic, CACHE_MAGIC, 8) == 0
+      && header.hash == image->hash && header.size == image->size
+      && header.insts == sizeof (image->predecode->inst)
+      && header.nranges <= MAX_LEN
+      && header.nbanks > 0 && header.nbanks <= MAX_BANKS)
+    {
+      image->nbanks = header.nbanks;
+      image->nranges = header.nranges;
+      alloc_image (image);
+      ok = fread (image->ranges, sizeof (struct hex_range), header.nranges,
+                  stream) == header.nranges
+        && valid_ranges (image)
+        && fread (image->code, MAX_LEN, image->nbanks, stream)
+        == image->nbanks;
+      for (n = 0; ok && n < image->nbanks; n++)
+        ok = fread (image->predecode[n].inst,
+                    sizeof (image->predecode->inst), 1, stream) == 1;
+      if (ok)
+        {
+          for (n = 0; n < image->nbanks; n++)
+            fuse_table8051 (&image->predecode[n]);
+          image->len = header.len;
+        }
+    }
+  fclose (stream);
+  return ok;
+}
+
+/* save image in the cache directory, through a temporary file so that
+   concurrent runs see it whole or not at all */
+static void write_cached (struct image_cache *cache,
+                          const struct code_image *image)
+{
+  struct cache_header header;
+  char suffix[32];
+  char *path, *tmp;
+  FILE *stream;
+  unsigned int n;
+  int ok;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CACHE_MAGIC, 8);
+  header.hash = image->hash;
+  header.size = image->size;
+  header.len = image->len;
+  header.nbanks = image->nbanks;
+  header.nranges = image->nranges;
+  header.insts = sizeof (image->predecode->inst);
+
+  snprintf (suffix, sizeof (suffix), ".%ld", (long) getpid ());
+  tmp = cache_path (cache, image, suffix);
+  stream = fopen (tmp, "wb");
+  if (stream == NULL)
+    {
+      free (tmp);
+      return;
+    }
+  ok = fwrite (&header, sizeof (header), 1, stream) == 1
+    && fwrite (image->ranges, sizeof (struct hex_range), image->nranges,
+               stream) == image->nranges
+    && fwrite (image->code, MAX_LEN, image->nbanks, stream) == image->nbanks;
+  for (n = 0; ok && n < image->nbanks; n++)
+    ok = fwrite (image->predecode[n].inst, sizeof (image->predecode->inst),
+                 1, stream) == 1;
+  ok = fclose (stream) == 0 && ok;
+  path = cache_path (cache, image, "");
+  if (!ok || rename (tmp, path) != 0)
+    remove (tmp);
+  free (path);
+  free (tmp);
+}
+
+/* fill image from the hex text */
+static int parse_image (struct image_cache *cache, struct code_image *image,
+                        const struct hex_text *text)
+{
+  struct hex_image hex;
+  struct vm8051 *vm;
+  size_t i, limit;
+  unsigned int n;
+  int ret;
+
+  ret = parse_hex (&hex, text->text, text->len);
+  if (ret != HEX_OK)
+    {
+      cache->line = hex.line;
+      return ret;
+    }
+  image->nbanks = count_banks (&hex);
+  image->nranges = hex.nranges;
+  alloc_image (image);
+  image->nranges = 0;
+  image->len = place_banks (&hex, image->code, image->nbanks);
+  limit = (size_t) image->nbanks * MAX_LEN;
+  for (i = 0; i < hex.nranges; i++)
+    {
+      struct hex_range range = hex.ranges[i];
+
+      if (range.address >= limit)
+        continue;
+      if (range.len > limit - range.address)
+        range.len = limit - range.address;
+      range.offset = range.address;
+      image->ranges[image->nranges++] = range;
+    }
+  free_hex (&hex);
+
+  vm = calloc (1, sizeof (struct vm8051));
+  assert (vm != NULL);
+  for (n = 0; n < image->nbanks; n++)
+    {
+      vm->_code = image->code + (size_t) n * MAX_LEN;
+      vm->predecode = &image->predecode[n];
+      predecode8051 (vm);
+    }
+  free (vm);
+  return HEX_OK;
+}
+
+static void free_image (struct code_image *image)
+{
+  free (image->code);
+  free (image->ranges);
+  free (image->predecode);
+  free (image);
+}
+
+void init_image_cache (struct image_cache *cache, const char *dir)
+{
+  cache->images = NULL;
+  cache->dir = NULL;
+  cache->line = 0;
+  if (dir)
+    {
+      cache->dir = malloc (strlen (dir) + 1);
+      assert (cache->dir != NULL);
+      strcpy (cache->dir, dir);
+    }
+}
+
+/* the program in the hex file at path, to be given back with put_image;
+   on a parse error, cache->line tells where */
+int get_image (struct image_cache *cache, const char *path,
+               const struct code_image **result)
+{
+  struct hex_text text;
+  struct code_image *image;
+  uint64_t hash;
+  int ret;
+
+  *result = NULL;
+  ret = map_hex (&text, path);
+  if (ret != HEX_OK)
+    return ret;
+  hash = hash_text (text.text, text.len);
+  for (image = cache->images; image; image = image->next)
+    if (image->hash == hash && image->size == text.len)
+      {
+        unmap_hex (&text);
+        image->refs++;
+        *result = image;
+        return HEX_OK;
+      }
+
+  image = calloc (1, sizeof (struct code_image));
+  assert (image != NULL);
+  image->hash = hash;
+  image->size = text.len;
+  if (!cache->dir || !read_cached (cache, image))
+    {
+      /* what an invalid cache file left */
+      free (image->code);
+      free (image->ranges);
+      free (image->predecode);
+      image->code = NULL;
+      image->ranges = NULL;
+      image->predecode = NULL;
+      ret = parse_image (cache, image, &text);
+      if (ret != HEX_OK)
+        {
+          unmap_hex (&text);
+          free_image (image);
+          return ret;
+        }
+      if (cache->dir)
+        write_cached (cache, image);
+    }
+  unmap_hex (&text);
+  image->refs = 1;
+  image->next = cache->images;
+  cache->images = image;
+  *result = image;
+  return HEX_OK;
+}
+
+/* the image stays in the cache for the next get_image */
+void put_image (struct image_cache *cache, const struct code_image *image)
+{
+  struct code_image *i;
+
+  for (i = cache->images; i; i = i->next)
+    if (i == image)
+      {
+        assert (i->refs > 0);
+        i->refs--;
+        return;
+      }
+  assert (0);
+}
+
+void free_image_cache (struct image_cache *cache)
+{
+  struct code_image *image, *next;
+
+  for (image = cache->images; image; image = next)
+    {
+      next = image->next;
+      assert (image->refs == 0);
+      free_image (image);
+    }
+  cache->images = NULL;
+  free (cache->dir);
+  cache->dir = NULL;
+}
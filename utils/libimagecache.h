@@ -0,0 +1,60 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIBIMAGECACHE_H
+#define LIBIMAGECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utils/libhexbin.h>
+
+struct predecode8051;
+
+/* a loaded program, shared and never modified while in the cache */
+struct code_image
+{
+  uint64_t hash;                /* of the hex file */
+  uint64_t size;                /* of the hex file */
+  uint8_t *code;                /* nbanks views, as placed by place_banks */
+  unsigned int nbanks;
+  size_t len;                   /* bytes in the ranges */
+  struct hex_range *ranges;     /* offset is the address */
+  size_t nranges;
+  struct predecode8051 *predecode; /* of each bank */
+  unsigned int refs;
+  struct code_image *next;
+};
+
+/* The images are looked up by the hash of the contents of the file, then
+   in dir if there is one, where they are saved when first loaded.  The
+   cache must be used from one thread, the images it gives from any. */
+struct image_cache
+{
+  struct code_image *images;
+  char *dir;                    /* NULL for none */
+  unsigned int line;            /* of the last error */
+};
+
+extern void init_image_cache (struct image_cache *cache, const char *dir);
+extern int get_image (struct image_cache *cache, const char *path,
+                      const struct code_image **image);
+extern void put_image (struct image_cache *cache,
+                       const struct code_image *image);
+extern void free_image_cache (struct image_cache *cache);
+
+#endif  /* LIBIMAGECACHE_H */
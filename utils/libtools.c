@@ -0,0 +1,126 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vm/lib8051.h>
+#include <vm/lib8051coprocessors.h>
+#include <copros/copro_RNG.h>
+
+#include "libtools.h"
+
+/* a new vm running image, reset, with a serial port of uart_size bytes,
+   the code bank switched by the SFR at bank_sfr if not 0 and the RNG
+   coprocessor seeded with seed */
+struct vm8051 *new_vm_from_image (const struct code_image *image,
+                                  uint8_t bank_sfr, size_t uart_size,
+                                  uint64_t seed)
+{
+  struct vm8051 *vm;
+
+  vm = calloc (1, sizeof (struct vm8051));
+  assert (vm != NULL);
+  if (image->nbanks > 1)
+    {
+      add_banks (vm, image->nbanks, image->code, image->predecode);
+      if (bank_sfr)
+        select_bank (vm, bank_sfr, NULL);
+    }
+  else
+    {
+      vm->_code = image->code;
+      vm->predecode = image->predecode;
+    }
+  add_uart (vm, uart_size);
+#ifndef PURE_8051
+  add_copro_RNG (vm, seed);
+#else
+  (void) seed;
+#endif
+  reset8051 (vm);
+  return vm;
+}
+
+/* free vm with all it was given */
+void free_vm (struct vm8051 *vm)
+{
+  free_edges (vm);
+  free_coverage (vm);
+  free_profile (vm);
+#ifndef PURE_8051
+  free_coprocessors (vm);
+#endif
+  free_uart (vm);
+  free_banks (vm);
+  free_xdata (vm);
+  free (vm);
+}
+
+/* seconds from some fixed point, for timing */
+double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* read a whole file, return NULL if it cannot be read */
+uint8_t *read_file (const char *path, size_t *len)
+{
+  FILE *stream;
+  uint8_t *data = NULL;
+  size_t size = 0, n;
+
+  *len = 0;
+  stream = fopen (path, "rb");
+  if (stream == NULL)
+    return NULL;
+  do
+    {
+      if (*len == size)
+        {
+          size = size ? 2 * size : 4096;
+          data = realloc (data, size);
+          assert (data != NULL);
+        }
+      n = fread (data + *len, 1, size - *len, stream);
+      *len += n;
+    }
+  while (n > 0);
+  fclose (stream);
+  return data;
+}
+
+/* whether pattern is in the len bytes of data, ending after the first
+   from ones, which were already searched */
+int search (const uint8_t *data, size_t len, const char *pattern,
+            size_t from)
+{
+  size_t i, n = strlen (pattern);
+
+  from = from >= n ? from - n + 1 : 0;
+  for (i = from; i + n <= len; i++)
+    if (memcmp (data + i, pattern, n) == 0)
+      return 1;
+  return 0;
+}
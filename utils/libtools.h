@@ -0,0 +1,39 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIBTOOLS_H
+#define LIBTOOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utils/libimagecache.h>
+
+struct vm8051;
+
+/* shared by the programs which run images on a pool of threads */
+extern struct vm8051 *new_vm_from_image (const struct code_image *image,
+                                         uint8_t bank_sfr, size_t uart_size,
+                                         uint64_t seed);
+extern void free_vm (struct vm8051 *vm);
+
+extern double now (void);
+extern uint8_t *read_file (const char *path, size_t *len);
+extern int search (const uint8_t *data, size_t len, const char *pattern,
+                   size_t from);
+
+#endif  /* LIBTOOLS_H */
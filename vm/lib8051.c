@@ -16,7 +16,9 @@
    along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "lib8051.h"
@@ -25,9 +27,9 @@
 #include "lib8051globals.h"
 
 #ifndef PURE_8051
-extern void operate_coprocessors (struct vm8051 *vm);
+extern void reset_coprocessors (struct vm8051 *vm);
 #else
-#define operate_coprocessors(vm)
+#define reset_coprocessors(vm)
 #endif
 
 #define GO_ISR(I,E,P) ((E) && (I) && (!interrupted || (P)))
@@ -56,12 +58,258 @@ int32_t get_timer1 (struct vm8051 *vm)
   return -1;
 }
 
+/* set external interrupts from the levels on P3 */
+static void sample_interrupts (struct vm8051 *vm)
+{
+  if (!IT0)
+    {
+      if (P3 & (1<<2))
+        {
+          TCON &= ~IE0_MASK;
+          /* external interrupt */;
+        }
+      else
+        TCON |= IE0_MASK;
+    }
+  if (!IT1)
+    {
+      if (P3 & (1<<3))
+        {
+          TCON &= ~IE1_MASK;
+          /* external interrupt */;
+        }
+      else
+        TCON |= IE1_MASK;
+    }
+}
+
+/* count delta on a timer of width bits made of high and low, return the
+   number of overflows */
+static uint32_t count_timer (uint8_t *high, uint8_t *low, unsigned int shift,
+                             unsigned int bits, uint32_t delta)
+{
+  uint64_t timer;
+
+  timer = (uint64_t) ((*high << shift) + *low) + delta;
+  *low = timer & ((1 << shift) - 1);
+  *high = (timer >> shift) & 0xFF;
+  return timer >> bits;
+}
+
+/* count delta on an 8-bit timer reloaded from reload, return the number
+   of overflows */
+static uint32_t count_reload (uint8_t *timer, uint8_t reload, uint32_t delta)
+{
+  uint64_t count, period;
+
+  count = (uint64_t) *timer + delta;
+  if (count < 0x100)
+    {
+      *timer = count;
+      return 0;
+    }
+  count -= 0x100;
+  period = 0x100 - reload;
+  *timer = reload + count % period;
+  return 1 + count / period;
+}
+
+/* increment the running timer(s) by delta cycles */
+static void timers8051 (struct vm8051 *vm, uint32_t delta)
+{
+  uint32_t overflows = 0, count;
+
+  if (TR0)
+    {
+      /* an external event counter does not count cycles */
+      count = (TMOD & 0x04) ? 0 : delta;
+      switch (TMOD & 0x03)
+        {
+        case 0:
+          overflows = count_timer (&TH0, &TL0, 5, 13, count);
+          break;
+        case 1:
+          overflows = count_timer (&TH0, &TL0, 8, 16, count);
+          break;
+        case 2:
+          overflows = count_reload (&TL0, TH0, count);
+          break;
+        case 3:
+          overflows = count_reload (&TL0, 0, count);
+          break;
+        }
+      if (overflows)
+        TCON |= TF0_MASK;
+    }
+  if (((TMOD & 0x03) == 0x03) && TR1)
+    {
+      count = (TMOD & 0x40) ? 0 : delta;
+      if (count_reload (&TH0, 0, count))
+        TCON |= TF1_MASK;
+    }
+  if (((TMOD & 0x03) == 0x03) || TR1)
+    {
+      if ((TMOD & 0x03) != 0x03 && (TMOD & 0x40))
+        count = 0;
+      else
+        count = delta;
+      switch ((TMOD & 0x30) >> 4)
+        {
+        case 0:
+          overflows = count_timer (&TH1, &TL1, 5, 13, count);
+          break;
+        case 1:
+          overflows = count_timer (&TH1, &TL1, 8, 16, count);
+          break;
+        case 2:
+          overflows = count_reload (&TL1, TH1, count);
+          break;
+        case 3:
+          overflows = 0;
+          break;
+        }
+      if (overflows)
+        TCON |= TF1_MASK;
+      vm->sched.overflows1 += overflows;
+    }
+}
+
+/* number of cycles the running timer(s) can count before an overflow
+   which sets a flag not set yet */
+static uint32_t timers_headroom (struct vm8051 *vm)
+{
+  int32_t timer;
+  int32_t headroom = INT32_MAX;
+
+  if (TR0 && !(TMOD & 0x04) && !TF0)
+    {
+      switch (TMOD & 0x03)
+        {
+        case 0: timer = 0x2000 - ((TH0 << 5) + TL0); break;
+        case 1: timer = 0x10000 - ((TH0 << 8) + TL0); break;
+        default: timer = 0x100 - TL0; break;
+        }
+      if (timer < headroom)
+        headroom = timer;
+    }
+  if (((TMOD & 0x03) == 0x03) && TR1 && !(TMOD & 0x40) && !TF1)
+    {
+      timer = 0x100 - TH0;
+      if (timer < headroom)
+        headroom = timer;
+    }
+  if ((((TMOD & 0x03) == 0x03) || TR1) && !TF1)
+    {
+      if ((TMOD & 0x03) != 0x03 && (TMOD & 0x40))
+        timer = INT32_MAX;
+      else
+        switch ((TMOD & 0x30) >> 4)
+          {
+          case 0: timer = 0x2000 - ((TH1 << 5) + TL1); break;
+          case 1: timer = 0x10000 - ((TH1 << 8) + TL1); break;
+          case 2: timer = 0x100 - TL1; break;
+          default: timer = INT32_MAX; break;
+          }
+      if (timer < headroom)
+        headroom = timer;
+    }
+  return headroom > 0 ? (uint32_t) headroom : 0;
+}
+
+/* number of cycles before Timer1 overflows n more times, UINT32_MAX if it
+   does not count cycles; the timers must be up to date */
+uint32_t timer1_cycles (struct vm8051 *vm, uint32_t n)
+{
+  int64_t first, period;
+
+  if (((TMOD & 0x03) != 0x03 && !TR1)
+      || ((TMOD & 0x03) != 0x03 && (TMOD & 0x40)))
+    return UINT32_MAX;
+  switch ((TMOD & 0x30) >> 4)
+    {
+    case 0: first = 0x2000 - ((TH1 << 5) + TL1); period = 0x2000; break;
+    case 1: first = 0x10000 - ((TH1 << 8) + TL1); period = 0x10000; break;
+    case 2: first = 0x100 - TL1; period = 0x100 - TH1; break;
+    default: return UINT32_MAX;
+    }
+  if (!n)
+    return 0;
+  if (first < 1)
+    first = 1;
+  first += (int64_t) (n - 1) * period;
+  return first < INT32_MAX ? (uint32_t) first : INT32_MAX;
+}
+
+/* count the cycles elapsed since the timers were last brought up to date */
+void sync8051 (struct vm8051 *vm)
+{
+  if (cycles != vm->sched.timers)
+    {
+      timers8051 (vm, cycles - vm->sched.timers);
+      vm->sched.timers = cycles;
+    }
+}
+
+/* the timers were brought up to date by service8051, which re-arms them */
+static void fire_overflow (struct vm8051 *vm, struct event8051 *event)
+{
+  (void) event;
+  vm->sched.flags |= SCHED_TIMERS;
+}
+
+/* schedule the next timer overflow, the timers must be up to date */
+static void arm_timers (struct vm8051 *vm)
+{
+  uint32_t headroom;
+
+  headroom = timers_headroom (vm);
+  if (headroom >= INT32_MAX)
+    cancel8051 (vm, &vm->sched.overflow);
+  else
+    {
+      vm->sched.overflow.fire = fire_overflow;
+      schedule8051 (vm, &vm->sched.overflow,
+                    vm->sched.timers + (headroom ? headroom : 1));
+    }
+}
+
+/* return the vector of the interrupt to be serviced now, 0 if none */
+static uint8_t interrupt_vector (struct vm8051 *vm)
+{
+  uint8_t prioritary;
+
+  if (!EA || (interrupted & HIGH) || interrupts_blocked)
+    return 0;
+
+  prioritary = IE & IP &
+    (((RI|TI) << 4) | (TF1 << 3) | (IE1 << 2) | (TF0 << 1) | (IE0 << 0));
+
+  if (GO_ISR (IE0, EX0, PX0) && !(prioritary & 0x1E))
+    return 0x03;
+  if (GO_ISR (TF0, ET0, PT0) && !(prioritary & 0x1D))
+    return 0x0B;
+  if (GO_ISR (IE1, EX1, PX1) && !(prioritary & 0x1B))
+    return 0x13;
+  if (GO_ISR (TF1, ET1, PT1) && !(prioritary & 0x17))
+    return 0x1B;
+  if (GO_ISR (RI|TI, ES, PS) && !(prioritary & 0x0F))
+    return 0x23;
+  return 0;
+}
+
+/* is an enabled interrupt source waiting to be serviced */
+static int interrupt_pending (struct vm8051 *vm)
+{
+  return EA && (IE & (((RI|TI) << 4) | (TF1 << 3) | (IE1 << 2)
+                      | (TF0 << 1) | (IE0 << 0)));
+}
+
 /* get the instruction at addr in inst and return inst length */
 size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr)
 {
   size_t inst_len = 0;
 
-  inst[0] = _code[addr+inst_len++];
+  inst[0] = _code[(uint16_t) (addr + inst_len++)];
   /* opcodes with register argument */
   if (inst[0] & 0x08)
     {
@@ -71,11 +319,11 @@ size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr)
         case 0x80:
         case 0xA0:
         case 0xD0:
-          inst[1] = _code[addr+inst_len++];
+          inst[1] = _code[(uint16_t) (addr + inst_len++)];
           break;
         case 0xB0:
-          inst[1] = _code[addr+inst_len++];
-          inst[2] = _code[addr+inst_len++];
+          inst[1] = _code[(uint16_t) (addr + inst_len++)];
+          inst[2] = _code[(uint16_t) (addr + inst_len++)];
           break;
         }
     }
@@ -87,17 +335,17 @@ size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr)
         case 0x70:
         case 0x80:
         case 0xA0:
-          inst[1] = _code[addr+inst_len++];
+          inst[1] = _code[(uint16_t) (addr + inst_len++)];
           break;
         case 0xB0:
-          inst[1] = _code[addr+inst_len++];
-          inst[2] = _code[addr+inst_len++];
+          inst[1] = _code[(uint16_t) (addr + inst_len++)];
+          inst[2] = _code[(uint16_t) (addr + inst_len++)];
           break;
         }
     }
   else if ((inst[0] & 0x0F) == 0x01)
     {
-      inst[1] = _code[addr+inst_len++];
+      inst[1] = _code[(uint16_t) (addr + inst_len++)];
     }
   else
     {
@@ -117,8 +365,8 @@ size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr)
         case 0x85:
         case 0xB5:
         case 0xD5:
-          inst[1] = _code[addr+inst_len++];
-          inst[2] = _code[addr+inst_len++];
+          inst[1] = _code[(uint16_t) (addr + inst_len++)];
+          inst[2] = _code[(uint16_t) (addr + inst_len++)];
           break;
         case 0x40:
         case 0x50:
@@ -157,7 +405,7 @@ size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr)
         case 0xC5:
         case 0xE5:
         case 0xF5:
-          inst[1] = _code[addr+inst_len++];
+          inst[1] = _code[(uint16_t) (addr + inst_len++)];
           break;
         }
     }
@@ -168,6 +416,9 @@ size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr)
 /* fetch the next instruction */
 void fetch8051 (struct vm8051 *vm)
 {
+  /* no instruction is fetched in idle and power-down modes */
+  if (PCON & (IDL_MASK | PD_MASK))
+    return;
   PC += inst8051 (vm, IR, PC);
 }
 
@@ -192,43 +443,30 @@ void reset8051 (struct vm8051 *vm)
   P2 = 0xFF;
   P3 = 0xFF;
 
-  for (i = 0; i < 65536; i++)
-    _xdata[i] = 0;
+  reset_xdata (vm);
 
   interrupted = 0;
   interrupts_blocked = 0;
 
   cycles = 0;
+
+  /* scheduled events are dropped, the coprocessors get in sync again */
+  clear8051 (vm);
+  vm->sched.overflow.fire = fire_overflow;
+  vm->sched.timers = 0;
+  vm->sched.flags = 0;
+  vm->sched.stop = 0;
+  reset_uart (vm);
+  reset_banks (vm);
+  reset_coprocessors (vm);
+  assert (_code != NULL);
 }
 
-/* run the current instruction */
-void operate8051 (struct vm8051 *vm)
+/* execute the instruction in IR */
+static void execute8051 (struct vm8051 *vm)
 {
   uint8_t n;
-  int32_t timer;
-  uint32_t cycles_prev = cycles;
 
-  /* set external interrupts */
-  if (!IT0)
-    {
-      if (P3 & (1<<2))
-        {
-          TCON &= ~IE0_MASK;
-          /* external interrupt */;
-        }
-      else
-        TCON |= IE0_MASK;
-    }
-  if (!IT1)
-    {
-      if (P3 & (1<<3))
-        {
-          TCON &= ~IE1_MASK;
-          /* external interrupt */;
-        }
-      else
-        TCON |= IE1_MASK;
-    }
   /* opcodes with register argument */
   if (IR[0] & 0x08)
     {
@@ -592,143 +830,475 @@ void operate8051 (struct vm8051 *vm)
           break;
         }
     }
+}
 
-  /* ask the coprocessors to do their thing */
-  operate_coprocessors (vm);
+/* take over from the host, who may have changed anything since the last
+   instruction */
+static void enter8051 (struct vm8051 *vm)
+{
+  /* the clock was moved, the events move along */
+  if (cycles != vm->sched.timers)
+    {
+      shift8051 (vm, cycles - vm->sched.timers);
+      vm->sched.timers = cycles;
+    }
+  enter_uart (vm);
+  sample_interrupts (vm);
+  vm->sched.flags |= SCHED_INTERRUPTS;
+}
 
-  /* timer(s) increment */
-  if (TR0)
+/* count in the profile the instruction run from address since start,
+   and follow the calls */
+static void count8051 (struct vm8051 *vm, uint16_t address, uint32_t start)
+{
+  count_profile (vm, address, 1, cycles - start);
+  if (IR[0] == 0x12 || (IR[0] & 0x1F) == 0x11)
+    call_profile (vm, PC);
+  else if (IR[0] == 0x22 || IR[0] == 0x32)
+    return_profile (vm);
+}
+
+/* mark in the coverage the instruction run from address, which went to
+   the next one or, if jumped, elsewhere */
+static void cover8051 (struct vm8051 *vm, uint16_t address, int jumped)
+{
+  vm->coverage->bits[address >> 2] |= 1 << ((address & 3) * 2 + jumped);
+}
+
+/* count the edge from the last instruction to the one run from address */
+static void edge8051 (struct vm8051 *vm, uint16_t address)
+{
+  struct edges8051 *edges = vm->edges;
+
+  edges->hits[address ^ edges->prev]++;
+  edges->prev = address >> 1;
+}
+
+/* fire the due events and service interrupts at an instruction boundary */
+static void service8051 (struct vm8051 *vm)
+{
+  uint32_t start;
+  uint8_t vector;
+
+  sync8051 (vm);
+  advance8051 (vm, cycles);
+
+  /* interrupts handling */
+  vector = interrupt_vector (vm);
+  switch (vector)
     {
-      timer = TL0;
-      if ((TMOD & 0x04))
-        /* external event */;
-      else
-        timer += cycles - cycles_prev;
-      switch (TMOD & 0x03)
+    case 0x03:
+      if (IT0)
+        TCON &= ~IE0_MASK;
+      interrupted |= PX0 ? HIGH : LOW;
+      break;
+    case 0x0B:
+      TCON &= ~TF0_MASK;
+      interrupted |= PT0 ? HIGH : LOW;
+      break;
+    case 0x13:
+      if (IT1)
+        TCON &= ~IE1_MASK;
+      interrupted |= PX1 ? HIGH : LOW;
+      break;
+    case 0x1B:
+      TCON &= ~TF1_MASK;
+      interrupted |= PT1 ? HIGH : LOW;
+      break;
+    case 0x23:
+      interrupted |= PS ? HIGH : LOW;
+      break;
+    }
+  if (vector)
+    {
+      /* an interrupt terminates the power saving modes */
+      PCON &= ~(IDL_MASK | PD_MASK);
+      start = cycles;
+      inst_lcall (vm, 0x00, vector);
+      if (vm->profile)
         {
-        case 0:
-          timer += TH0 << 5;
-          TL0 = timer & 0x1F;
-          TH0 = (timer & 0x1FE0) >> 5;
-          if (timer & 0x2000)
-            TCON |= TF0_MASK;
-          break;
-        case 1:
-          timer += TH0 << 8;
-          TL0 = timer & 0xFF;
-          TH0 = (timer & 0xFF00) >> 8;
-          if (timer & 0x10000)
-            TCON |= TF0_MASK;
-          break;
-        case 2:
-          TL0 = timer & 0xFF;
-          if (timer & 0x100)
-            {
-              TL0 += TH0;
-              TCON |= TF0_MASK;
-            }
-          break;
-        case 3:
-          TL0 = timer & 0xFF;
-          if (timer & 0x100)
-            TCON |= TF0_MASK;
-          break;
+          call_profile (vm, vector);
+          count_profile (vm, vector, 0, cycles - start);
         }
+      /* the timers do not count the call to the vector */
+      vm->sched.timers = cycles;
+      vm->sched.flags |= SCHED_TIMERS;
     }
-  if (((TMOD & 0x03) == 0x03) && TR1)
+
+  if (vm->sched.flags & SCHED_TIMERS)
     {
-      timer = TH0;
-      if ((TMOD & 0x40))
-        /* external event */;
-      else
-        timer += cycles - cycles_prev;
-      TH0 = timer & 0xFF;
-      if (timer & 0x100)
-        TCON |= TF1_MASK;
+      arm_timers (vm);
+      retime_uart (vm);
     }
-  if (((TMOD & 0x03) == 0x03) || TR1)
+  sample_interrupts (vm);
+
+  /* keep looking while an interrupt waits */
+  vm->sched.flags = 0;
+  if (vector || interrupts_blocked || interrupt_pending (vm))
+    vm->sched.flags = SCHED_INTERRUPTS;
+  /* unblock interrupts for next cycle */
+  interrupts_blocked = 0;
+}
+
+/* run the instruction in IR, or a cycle of idle mode, and service what
+   it is due at the boundary */
+static void step8051 (struct vm8051 *vm)
+{
+  uint16_t address = PC - IR[3];
+  uint32_t start = cycles;
+  uint8_t vector;
+
+  /* power-down: the oscillator is stopped, only an external interrupt
+     can wake the CPU up */
+  if (PCON & PD_MASK)
     {
-      timer = TL1;
-      if ((TMOD & 0x03) != 0x03 && (TMOD & 0x40))
-        ;
-      else
-        timer += cycles - cycles_prev;
-      switch ((TMOD & 0x30) >> 4)
-        {
-        case 0:
-          timer += TH1 << 5;
-          TL1 = timer & 0x1F;
-          TH1 = (timer & 0x1FE0) >> 5;
-          if (timer & 0x2000)
-            TCON |= TF1_MASK;
-          break;
-        case 1:
-          timer += TH1 << 8;
-          TL1 = timer & 0xFF;
-          TH1 = (timer & 0xFF00) >> 8;
-          if (timer & 0x10000)
-            TCON |= TF1_MASK;
-          break;
-        case 2:
-          TL1 = timer & 0xFF;
-          if (timer & 0x100)
-            {
-              TL1 += TH1;
-              TCON |= TF1_MASK;
-            }
-          break;
-        case 3:
-          break;
-        }
+      vector = interrupt_vector (vm);
+      if (vector != 0x03 && vector != 0x13)
+        return;
+      vm->sched.flags |= SCHED_INTERRUPTS;
     }
-  /* interrupts handling */
-  if (EA && !(interrupted & HIGH) && !(interrupts_blocked))
+  /* idle: the CPU is stopped, the peripherals keep running */
+  else if (PCON & IDL_MASK)
     {
-      uint8_t prioritary = IE & IP &
-        (((RI|TI) << 4) | (TF1 << 3) | (IE1 << 2) | (TF0 << 1) | (IE0 << 0));
-        
-      if (GO_ISR (IE0, EX0, PX0) && !(prioritary & 0x1E))
-        {
-          if (IT0)
-            TCON &= ~IE0_MASK;
-          interrupted |= PX0 ? HIGH : LOW;
-          inst_lcall (vm, 0x00, 0x03);
-        }
-      else if (GO_ISR (TF0, ET0, PT0) && !(prioritary & 0x1D))
-        {
-          TCON &= ~TF0_MASK;
-          interrupted |= PT0 ? HIGH : LOW;
-          inst_lcall (vm, 0x00, 0x0B);
-        }
-      else if (GO_ISR (IE1, EX1, PX1) && !(prioritary & 0x1B))
-        {
-          if (IT1)
-            TCON &= ~IE1_MASK;
-          interrupted |= PX1 ? HIGH : LOW;
-          inst_lcall (vm, 0x00, 0x13);
-        }
-      else if (GO_ISR (TF1, ET1, PT1) && !(prioritary & 0x17))
-        {
-          TCON &= ~TF1_MASK;
-          interrupted |= PT1 ? HIGH : LOW;
-          inst_lcall (vm, 0x00, 0x1B);
-        }
-      else if (GO_ISR (RI|TI, ES, PS) && !(prioritary & 0x0F))
+      cycles += 1;
+      if (vm->profile)
+        count_profile (vm, PC, 0, 1);
+    }
+  else
+    {
+      execute8051 (vm);
+      if (vm->coverage)
+        cover8051 (vm, address, PC != (uint16_t) (address + IR[3]));
+      if (vm->edges)
+        edge8051 (vm, address);
+      if (vm->profile)
+        count8051 (vm, address, start);
+    }
+
+  if (vm->sched.flags || !BEFORE (cycles, vm->sched.next))
+    service8051 (vm);
+}
+
+/* run the current instruction */
+void operate8051 (struct vm8051 *vm)
+{
+  enter8051 (vm);
+  step8051 (vm);
+  sync8051 (vm);
+}
+
+/* fast-forward idle mode or the delay, idle or serial port loop at PC,
+   stopping short of address, ncy cycles, the next event and interrupts;
+   the timers are left behind */
+static uint32_t forward8051 (struct vm8051 *vm, int32_t address,
+                             uint32_t ncy)
+{
+  uint8_t inst[4];
+  uint8_t *counter = NULL;
+  uint32_t count = UINT32_MAX;
+  uint32_t period = 2;
+  uint32_t budget;
+  uint16_t inner = PC - 2;
+
+  if (PC == address || cycles >= ncy || (PCON & PD_MASK))
+    return 0;
+
+  inst8051 (vm, inst, PC);
+  /* idle mode */
+  if (PCON & IDL_MASK)
+    period = 1;
+  /* sjmp $ */
+  else if (inst[0] == 0x80 && inst[1] == 0xFE)
+    ;
+  /* jnb RI, $ or jnb TI, $: only the events of the serial port set them */
+  else if (inst[0] == 0x30 && inst[2] == 0xFD
+           && ((inst[1] == 0x98 && !RI) || (inst[1] == 0x99 && !TI)))
+    ;
+  /* djnz Rn, $ */
+  else if ((inst[0] & 0xF8) == 0xD8 && inst[1] == 0xFE)
+    counter = regs + (inst[0] & 0x07);
+  /* djnz direct, $ (idata only) */
+  else if (inst[0] == 0xD5 && !(inst[1] & 0x80) && inst[2] == 0xFD)
+    counter = _data + inst[1];
+  /* djnz Rm, $ followed by djnz Rn, $-2 with Rm exhausted */
+  else if ((inst[0] & 0xF8) == 0xD8 && inst[1] == 0xFC
+           && (_code[inner] & 0xF8) == 0xD8 && _code[inner] != inst[0]
+           && _code[(uint16_t) (inner + 1)] == 0xFE
+           && !regs[_code[inner] & 0x07] && inner != address)
+    {
+      counter = regs + (inst[0] & 0x07);
+      period = 2 + 256 * 2;
+    }
+  else
+    return 0;
+
+  /* the last iteration (falling through) is left to operate8051 */
+  if (counter)
+    count = (*counter ? *counter : 256) - 1;
+
+  if (interrupts_blocked || interrupt_vector (vm))
+    return 0;
+
+  budget = next8051 (vm);
+  if (ncy - cycles < budget)
+    budget = ncy - cycles;
+  if (!budget)
+    return 0;
+  if ((budget - 1) / period < count)
+    count = (budget - 1) / period;
+  if (!count)
+    return 0;
+
+  if (counter)
+    *counter -= count;
+  cycles += count * period;
+
+  /* the loop went back to itself, the inner one both ways */
+  if (vm->coverage && period > 1)
+    {
+      cover8051 (vm, PC, 1);
+      if (period > 2)
         {
-          interrupted |= PS ? HIGH : LOW;
-          inst_lcall (vm, 0x00, 0x23);
+          cover8051 (vm, inner, 0);
+          cover8051 (vm, inner, 1);
         }
     }
-  /* unblock interrupts for next cycle */
-  interrupts_blocked = 0;
+  if (vm->edges && period > 1)
+    {
+      if (period > 2)
+        edge8051 (vm, inner);
+      edge8051 (vm, PC);
+    }
+
+  if (vm->profile && period == 1)
+    count_profile (vm, PC, 0, count);
+  else if (vm->profile)
+    {
+      count_profile (vm, PC, count, count * 2);
+      /* the inner loop ran 256 times in each iteration */
+      if (period > 2)
+        count_profile (vm, inner, count * 256, count * (period - 2));
+    }
+
+  return count * period;
+}
+
+/* fast-forward idle mode or the delay, idle or serial port loop at PC,
+   stopping short of address, ncy cycles, timer overflows and interrupts;
+   return skipped cycles */
+uint32_t skip8051 (struct vm8051 *vm, uint16_t address, uint32_t ncy)
+{
+  uint32_t skipped;
+
+  enter8051 (vm);
+  arm_timers (vm);
+  skipped = forward8051 (vm, address, ncy);
+  sync8051 (vm);
+  return skipped;
+}
+
+/* superinstructions: opcode pairs which sim8051 runs in one dispatch */
+static const struct
+{
+  uint8_t first, first_mask;
+  uint8_t second, second_mask;
+} fusions[] =
+  {
+    { 0xE8, 0xF8, 0x24, 0xFF },   /* mov A, Rn        add A, #data */
+    { 0xE8, 0xF8, 0x34, 0xFF },   /* mov A, Rn        addc A, #data */
+    { 0x90, 0xFF, 0xE0, 0xFF },   /* mov DPTR, #data  movx A, @DPTR */
+    { 0x90, 0xFF, 0xF0, 0xFF },   /* mov DPTR, #data  movx @DPTR, A */
+    { 0xA3, 0xFF, 0xE0, 0xFF },   /* inc DPTR         movx A, @DPTR */
+    { 0xA3, 0xFF, 0xF0, 0xFF },   /* inc DPTR         movx @DPTR, A */
+    { 0xE0, 0xFF, 0xA3, 0xFF },   /* movx A, @DPTR    inc DPTR */
+    { 0xF0, 0xFF, 0xA3, 0xFF },   /* movx @DPTR, A    inc DPTR */
+    { 0xC3, 0xFF, 0x98, 0xF8 },   /* clr C            subb A, Rn */
+    { 0xC3, 0xFF, 0x94, 0xFF },   /* clr C            subb A, #data */
+    { 0xC3, 0xFF, 0x95, 0xFF },   /* clr C            subb A, direct */
+  };
+
+/* return the superinstruction made of the opcodes first and second, 0 if
+   none */
+unsigned int fuse8051 (uint8_t first, uint8_t second)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof (fusions) / sizeof (fusions[0]); i++)
+    if ((first & fusions[i].first_mask) == fusions[i].first
+        && (second & fusions[i].second_mask) == fusions[i].second)
+      return i + 1;
+  return 0;
+}
+
+/* decode the code memory for sim8051, again whenever it changes */
+void predecode8051 (struct vm8051 *vm)
+{
+  struct predecode8051 *table;
+  uint32_t addr;
+
+  if (!vm->predecode)
+    {
+      vm->predecode = malloc (sizeof (struct predecode8051));
+      assert (vm->predecode != NULL);
+    }
+  table = vm->predecode;
+  for (addr = 0; addr < 65536; addr++)
+    inst8051 (vm, table->inst[addr], addr);
+  fuse_table8051 (table);
+}
+
+/* find the superinstructions of the decoded instructions of table */
+void fuse_table8051 (struct predecode8051 *table)
+{
+  uint32_t addr;
+
+  for (addr = 0; addr < 65536; addr++)
+    table->fused[addr] =
+      fuse8051 (table->inst[addr][0],
+                table->inst[(uint16_t) (addr + table->inst[addr][3])][0]);
 }
 
-void sim8051 (struct vm8051 *vm, uint16_t address, unsigned int ncy)
+/* is there anything to do at the boundary before the next instruction */
+static int boundary8051 (struct vm8051 *vm, int32_t address, uint32_t ncy)
 {
+  return vm->sched.flags || !BEFORE (cycles, vm->sched.next)
+    || PC == address || cycles >= ncy;
+}
+
+/* run the predecoded instruction at PC, and the next one in the same
+   dispatch if they make a superinstruction and nothing happens at the
+   boundary between them */
+static void dispatch8051 (struct vm8051 *vm, int32_t address, uint32_t ncy)
+{
+  const struct predecode8051 *table = vm->predecode;
+  uint16_t from = PC;
+  uint32_t start = cycles;
+  uint8_t fused;
+
+  memcpy (IR, table->inst[PC], 4);
+  /* superinstructions would count as their first instruction */
+  fused = vm->profile ? 0 : table->fused[PC];
+  PC += IR[3];
+  switch (fused)
+    {
+    case 0:
+      execute8051 (vm);
+      if (vm->coverage)
+        cover8051 (vm, from, PC != (uint16_t) (from + IR[3]));
+      if (vm->edges)
+        edge8051 (vm, from);
+      if (vm->profile)
+        count8051 (vm, from, start);
+      break;
+    case 1:
+    case 2:
+      inst_mov_Rn (vm, IR[0] & 0x07);
+      if (boundary8051 (vm, address, ncy))
+        break;
+      memcpy (IR, table->inst[PC], 4);
+      PC += IR[3];
+      if (fused == 1)
+        inst_add_data (vm, IR[1]);
+      else
+        inst_addc_data (vm, IR[1]);
+      break;
+    case 3:
+    case 4:
+      inst_mov_to_DPTR (vm, IR[1], IR[2]);
+      if (boundary8051 (vm, address, ncy))
+        break;
+      memcpy (IR, table->inst[PC], 4);
+      PC += IR[3];
+      if (fused == 3)
+        inst_movx_atDPTR (vm);
+      else
+        inst_movx_to_atDPTR (vm);
+      break;
+    case 5:
+    case 6:
+      inst_inc_DPTR (vm);
+      if (boundary8051 (vm, address, ncy))
+        break;
+      memcpy (IR, table->inst[PC], 4);
+      PC += IR[3];
+      if (fused == 5)
+        inst_movx_atDPTR (vm);
+      else
+        inst_movx_to_atDPTR (vm);
+      break;
+    case 7:
+    case 8:
+      if (fused == 7)
+        inst_movx_atDPTR (vm);
+      else
+        inst_movx_to_atDPTR (vm);
+      if (boundary8051 (vm, address, ncy))
+        break;
+      memcpy (IR, table->inst[PC], 4);
+      PC += IR[3];
+      inst_inc_DPTR (vm);
+      break;
+    case 9:
+    case 10:
+    case 11:
+      inst_clr_C (vm);
+      if (boundary8051 (vm, address, ncy))
+        break;
+      memcpy (IR, table->inst[PC], 4);
+      PC += IR[3];
+      if (fused == 9)
+        inst_subb_Rn (vm, IR[0] & 0x07);
+      else if (fused == 10)
+        inst_subb_data (vm, IR[1]);
+      else
+        inst_subb_direct (vm, IR[1]);
+      break;
+    }
+  /* no superinstruction jumps */
+  if (fused && vm->coverage)
+    {
+      cover8051 (vm, from, 0);
+      if (PC != (uint16_t) (from + table->inst[from][3]))
+        cover8051 (vm, from + table->inst[from][3], 0);
+    }
+  if (fused && vm->edges)
+    {
+      edge8051 (vm, from);
+      if (PC != (uint16_t) (from + table->inst[from][3]))
+        edge8051 (vm, from + table->inst[from][3]);
+    }
+
+  if (vm->sched.flags || !BEFORE (cycles, vm->sched.next))
+    service8051 (vm);
+}
+
+/* run instructions until address (-1 for none) or ncy cycles are reached,
+   the CPU is powered down or an event stops the simulation; the peripherals
+   are only looked at when an event is due or the program touched them */
+void sim8051 (struct vm8051 *vm, int32_t address, unsigned int ncy)
+{
+  uint8_t opcode;
+
+  enter8051 (vm);
+  arm_timers (vm);
+  vm->sched.stop = 0;
   do
     {
-      fetch8051 (vm);
-      operate8051 (vm);
+      opcode = _code[PC];
+      if ((PCON & IDL_MASK) || opcode == 0x80 || opcode == 0xD5
+          || (opcode & 0xF8) == 0xD8
+          || (opcode == 0x30 && _code[(uint16_t) (PC + 2)] == 0xFD))
+        forward8051 (vm, address, ncy);
+      if (vm->predecode && !(PCON & (IDL_MASK | PD_MASK)))
+        dispatch8051 (vm, address, ncy);
+      else
+        {
+          if (!(PCON & (IDL_MASK | PD_MASK)))
+            PC += inst8051 (vm, IR, PC);
+          step8051 (vm);
+        }
     }
-  while (PC != address && cycles < ncy);
+  while (PC != address && cycles < ncy && !(PCON & PD_MASK)
+         && !vm->sched.stop);
+  sync8051 (vm);
 }
@@ -22,27 +22,62 @@
 #include <stdint.h>
 
 #include "lib8051defs.h"
+#include "lib8051sched.h"
+#include "lib8051uart.h"
+#include "lib8051banks.h"
+#include "lib8051xdata.h"
+#include "lib8051state.h"
+#include "lib8051undo.h"
+#include "lib8051profile.h"
+#include "lib8051coverage.h"
+
+/* code memory decoded once for sim8051 */
+struct predecode8051
+{
+  uint8_t inst[65536][4];       /* as returned by inst8051 */
+  uint8_t fused[65536];         /* superinstruction starting there, or 0 */
+};
 
-/* 8051 virtual machine */
+/* 8051 virtual machine, to be zeroed before first use */
 struct vm8051
 {
   uint32_t cycles;
   uint8_t _data[256];
   uint8_t _sfr[128];
-  uint8_t _xdata[65536];
-  uint8_t _code[65536];
+  uint8_t *_xdata;              /* 64 KiB, set before reset8051, or NULL
+                                   for pages allocated on first write and
+                                   freed by free_xdata */
+  uint8_t *xpages[256];         /* RAM of each XDATA page, NULL to go
+                                   through read_xdata and write_xdata */
+  const uint8_t *_code;         /* 64 KiB, to be set before reset8051 */
   uint8_t IR[4];
   uint16_t PC;
   uint8_t interrupted;
   uint8_t interrupts_blocked;
   void *coprocessors; /* to extend 8051 with coprocessors */
+  struct sched8051 sched;
+  struct predecode8051 *predecode; /* may be shared by vms with the same
+                                      code, freed by its owner */
+  struct uart8051 *uart;        /* serial port, NULL if not connected */
+  struct banks8051 *banks;      /* banked code, NULL if not banked */
+  struct xdata8051 *xdata;      /* XDATA peripherals, NULL if none */
+  struct profile8051 *profile;  /* NULL if not profiling */
+  struct coverage8051 *coverage; /* NULL if not recording it */
+  struct edges8051 *edges;      /* NULL if not counting them */
 };
 
 extern size_t inst8051 (struct vm8051 *vm, uint8_t *inst, uint16_t addr);
 extern void reset8051 (struct vm8051 *vm);
 extern void fetch8051 (struct vm8051 *vm);
 extern void operate8051 (struct vm8051 *vm);
-extern void sim8051 (struct vm8051 *vm, uint16_t address, unsigned int ncy);
+extern void sim8051 (struct vm8051 *vm, int32_t address, unsigned int ncy);
+/* loops revisit PC only, and PC - 2 for nested delay loops */
+extern uint32_t skip8051 (struct vm8051 *vm, uint16_t address, uint32_t ncy);
+extern void sync8051 (struct vm8051 *vm);
+extern uint32_t timer1_cycles (struct vm8051 *vm, uint32_t n);
+extern void predecode8051 (struct vm8051 *vm);
+extern void fuse_table8051 (struct predecode8051 *table);
+extern unsigned int fuse8051 (uint8_t first, uint8_t second);
 
 extern int32_t get_timer0 (struct vm8051 *vm);
 extern int32_t get_timer1 (struct vm8051 *vm);
@@ -0,0 +1,127 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051banks.h"
+
+/* simulate global variables for a struct vm8051 *vm */
+#include "lib8051globals.h"
+
+struct banks8051
+{
+  const uint8_t *code;          /* nbanks views of 64 KiB */
+  struct predecode8051 *predecode; /* nbanks tables, or NULL */
+  unsigned int nbanks;
+  unsigned int current;
+  uint8_t sfr;                  /* bank select register, 0 for none */
+  unsigned int (*select) (struct vm8051 *vm);
+};
+
+/* by default, the bank is the value of the register */
+static unsigned int select_sfr (struct vm8051 *vm)
+{
+  return _sfr[vm->banks->sfr ^ 0x80];
+}
+
+/* the code of the vm is bank 0 of code until switched */
+void add_banks (struct vm8051 *vm, unsigned int nbanks, const uint8_t *code,
+                struct predecode8051 *predecode)
+{
+  struct banks8051 *banks;
+
+  assert (vm->banks == NULL && nbanks > 0 && code != NULL);
+  banks = calloc (1, sizeof (struct banks8051));
+  assert (banks != NULL);
+  banks->code = code;
+  banks->predecode = predecode;
+  banks->nbanks = nbanks;
+  banks->select = select_sfr;
+  vm->banks = banks;
+  switch_bank (vm, 0);
+}
+
+/* switch to the bank select gives, modulo the number of banks, after each
+   write to sfr; NULL for the value of sfr */
+void select_bank (struct vm8051 *vm, uint8_t sfr,
+                  unsigned int (*select) (struct vm8051 *vm))
+{
+  assert (vm->banks != NULL && (sfr & 0x80));
+  vm->banks->sfr = sfr;
+  vm->banks->select = select ? select : select_sfr;
+}
+
+/* the next instruction is fetched from bank */
+void switch_bank (struct vm8051 *vm, unsigned int bank)
+{
+  struct banks8051 *banks = vm->banks;
+
+  assert (bank < banks->nbanks);
+  banks->current = bank;
+  _code = banks->code + (size_t) bank * 65536;
+  vm->predecode = banks->predecode ? &banks->predecode[bank] : NULL;
+  /* no superinstruction across the switch */
+  vm->sched.flags |= SCHED_CODE;
+}
+
+unsigned int current_bank (struct vm8051 *vm)
+{
+  return vm->banks ? vm->banks->current : 0;
+}
+
+void free_banks (struct vm8051 *vm)
+{
+  free (vm->banks);
+  vm->banks = NULL;
+}
+
+void notify_banks (struct vm8051 *vm, uint8_t sfr)
+{
+  struct banks8051 *banks = vm->banks;
+  unsigned int bank;
+
+  if (!banks || sfr != banks->sfr)
+    return;
+  bank = banks->select (vm) % banks->nbanks;
+  if (bank != banks->current)
+    switch_bank (vm, bank);
+}
+
+void reset_banks (struct vm8051 *vm)
+{
+  if (!vm->banks)
+    return;
+  if (vm->banks->sfr)
+    switch_bank (vm, vm->banks->select (vm) % vm->banks->nbanks);
+  else
+    switch_bank (vm, 0);
+}
+
+/* switch to bank if there is such a bank, return 0 if not */
+int load_banks (struct vm8051 *vm, unsigned int bank)
+{
+  if (!vm->banks)
+    return bank == 0;
+  if (bank >= vm->banks->nbanks)
+    return 0;
+  if (bank != vm->banks->current)
+    switch_bank (vm, bank);
+  return 1;
+}
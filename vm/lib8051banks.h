@@ -0,0 +1,46 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051BANKS_H
+#define LIB8051BANKS_H
+
+#include <stdint.h>
+
+struct vm8051;
+struct predecode8051;
+
+/* Banked code memory: each bank is a whole 64 KiB view of the code, the
+   common area repeated in every bank, so that switching banks only
+   switches the _code and predecode pointers of the vm.  The views are
+   consecutive in memory, as are their predecoded tables, and belong to
+   the caller. */
+
+extern void add_banks (struct vm8051 *vm, unsigned int nbanks,
+                       const uint8_t *code,
+                       struct predecode8051 *predecode);
+extern void select_bank (struct vm8051 *vm, uint8_t sfr,
+                         unsigned int (*select) (struct vm8051 *vm));
+extern void switch_bank (struct vm8051 *vm, unsigned int bank);
+extern unsigned int current_bank (struct vm8051 *vm);
+extern void free_banks (struct vm8051 *vm);
+
+/* used by the vm */
+extern void notify_banks (struct vm8051 *vm, uint8_t sfr);
+extern void reset_banks (struct vm8051 *vm);
+extern int load_banks (struct vm8051 *vm, unsigned int bank);
+
+#endif  /* LIB8051BANKS_H */
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "lib8051.h"
@@ -25,77 +26,307 @@
 /* simulate global variables for a struct vm8051 *vm */
 #include "lib8051globals.h"
 
-/* 8051 coprocessors list */
+/* a coprocessor of a vm */
 struct copro8051
 {
-  unsigned int index;
+  const struct copro_type8051 *type;
   void *contents;
-  struct copro8051 *next;
+  struct event8051 trigger;     /* written to by the program */
+  struct event8051 wakeup;      /* asked to be woken up */
+  uint32_t sfrs[4];             /* SFR writes it is waiting for */
 };
 
-/* registers a coprocessor to the vm */
-void add_coprocessor (struct vm8051 *vm, void *contents, unsigned int index)
+/* coprocessors of a vm, in the order they were added */
+struct coprocessors8051
 {
   struct copro8051 *copros;
+  unsigned int ncopros;
+  unsigned int size;
+  uint8_t triggers[128];        /* number of coprocessors waiting for
+                                   each SFR write */
+};
 
-  copros = vm->coprocessors;
-  while (copros && copros->index != index)
-    copros = copros->next;
+/* what a checkpoint keeps of a coprocessor, followed by its contents
+   padded to 8 bytes */
+struct copro_state8051
+{
+  char name[16];
+  uint64_t size;
+};
 
+static struct coprocessors8051 *get_coprocessors (struct vm8051 *vm)
+{
+  struct coprocessors8051 *copros;
+
+  copros = vm->coprocessors;
   if (!copros)
     {
-      copros = malloc (sizeof (struct copro8051));
-      copros->index = index;
-      copros->contents = contents;
-      copros->next = vm->coprocessors;
+      copros = calloc (1, sizeof (struct coprocessors8051));
+      assert (copros != NULL);
       vm->coprocessors = copros;
     }
+  return copros;
 }
 
-/* this table will store all available operate functions */
-void (*operate_copro_table[8]) (struct vm8051 *, void *);
+/* call the operate function of a coprocessor which was triggered or woken
+   up, once even if both */
+static void fire_coprocessor (struct vm8051 *vm, struct event8051 *event)
+{
+  struct copro8051 *copro = event->data;
+  struct event8051 *other;
+
+  other = event == &copro->trigger ? &copro->wakeup : &copro->trigger;
+  if (other->prev && !BEFORE (cycles, other->cycle))
+    cancel8051 (vm, other);
 
-/* call the operate function of all available coprocessors */
-void operate_coprocessors (struct vm8051 *vm)
+  copro->type->operate (vm, copro->contents);
+}
+
+/* make room for one more coprocessor; the events live in the array, so
+   they are taken off the wheel while it moves */
+static void grow_coprocessors (struct vm8051 *vm,
+                               struct coprocessors8051 *copros)
 {
-  struct copro8051 *copros;
+  struct copro8051 *copro;
+  uint8_t *scheduled;
+  unsigned int i;
+
+  if (copros->ncopros < copros->size)
+    return;
+
+  scheduled = calloc (copros->ncopros + 1, 1);
+  assert (scheduled != NULL);
+  for (i = 0; i < copros->ncopros; i++)
+    {
+      copro = &copros->copros[i];
+      scheduled[i] = (copro->trigger.prev ? 1 : 0)
+        | (copro->wakeup.prev ? 2 : 0);
+      cancel8051 (vm, &copro->trigger);
+      cancel8051 (vm, &copro->wakeup);
+    }
+
+  copros->size = copros->size ? 2 * copros->size : 4;
+  copros->copros = realloc (copros->copros,
+                            copros->size * sizeof (struct copro8051));
+  assert (copros->copros != NULL);
+
+  for (i = 0; i < copros->ncopros; i++)
+    {
+      copro = &copros->copros[i];
+      copro->trigger.data = copro;
+      copro->wakeup.data = copro;
+      if (scheduled[i] & 1)
+        schedule8051 (vm, &copro->trigger, copro->trigger.cycle);
+      if (scheduled[i] & 2)
+        schedule8051 (vm, &copro->wakeup, copro->wakeup.cycle);
+    }
+  free (scheduled);
+}
+
+/* registers a coprocessor to the vm, which takes ownership of contents,
+   and returns its number */
+unsigned int add_coprocessor (struct vm8051 *vm,
+                              const struct copro_type8051 *type,
+                              void *contents)
+{
+  struct coprocessors8051 *copros;
+  struct copro8051 *copro;
+
+  assert (type->operate != NULL && type->print != NULL);
+  copros = get_coprocessors (vm);
+  grow_coprocessors (vm, copros);
+
+  copro = &copros->copros[copros->ncopros];
+  memset (copro, 0, sizeof (struct copro8051));
+  copro->type = type;
+  copro->contents = contents;
+  copro->trigger.fire = fire_coprocessor;
+  copro->trigger.data = copro;
+  copro->wakeup.fire = fire_coprocessor;
+  copro->wakeup.data = copro;
+  /* operate once to get in sync with the vm */
+  schedule8051 (vm, &copro->trigger, cycles);
+  return copros->ncopros++;
+}
+
+/* operate the coprocessor copro whenever the program writes to sfr */
+void add_coprocessor_trigger (struct vm8051 *vm, unsigned int copro,
+                              uint8_t sfr)
+{
+  struct coprocessors8051 *copros = vm->coprocessors;
+  uint32_t *sfrs;
+  uint32_t mask;
+
+  assert (copros != NULL && copro < copros->ncopros);
+  sfr ^= 0x80;
+  sfrs = copros->copros[copro].sfrs;
+  mask = (uint32_t) 1 << (sfr % 32);
+  if (!(sfrs[sfr / 32] & mask))
+    {
+      assert (copros->triggers[sfr] < UINT8_MAX);
+      sfrs[sfr / 32] |= mask;
+      copros->triggers[sfr]++;
+    }
+}
+
+/* operate the coprocessor copro once cycle is reached, unless it is
+   already to be operated earlier */
+void wake_coprocessor (struct vm8051 *vm, unsigned int copro, uint32_t cycle)
+{
+  struct coprocessors8051 *copros = vm->coprocessors;
+  struct event8051 *wakeup;
+
+  assert (copros != NULL && copro < copros->ncopros);
+  wakeup = &copros->copros[copro].wakeup;
+  if (!wakeup->prev || BEFORE (cycle, wakeup->cycle))
+    schedule8051 (vm, wakeup, cycle);
+}
+
+/* tell the coprocessors that the program wrote to sfr */
+void notify_coprocessors (struct vm8051 *vm, uint8_t sfr)
+{
+  struct coprocessors8051 *copros;
+  struct copro8051 *copro;
+  unsigned int i;
 
   copros = vm->coprocessors;
-  while (copros)
+  sfr ^= 0x80;
+  if (!copros || !copros->triggers[sfr])
+    return;
+  for (i = 0; i < copros->ncopros; i++)
     {
-      assert (operate_copro_table[copros->index] != NULL);
-      operate_copro_table[copros->index] (vm, copros->contents);
-      copros = copros->next;
+      copro = &copros->copros[i];
+      if (copro->sfrs[sfr / 32] & ((uint32_t) 1 << (sfr % 32)))
+        schedule8051 (vm, &copro->trigger, cycles);
     }
 }
 
-/* this table will store all available print functions */
-void (*print_copro_table[8]) (struct vm8051 *, void *);
+/* operate all the coprocessors at the next instruction boundary */
+void reset_coprocessors (struct vm8051 *vm)
+{
+  struct coprocessors8051 *copros;
+  unsigned int i;
 
-/* call the operate function of all available coprocessors */
+  copros = vm->coprocessors;
+  if (!copros)
+    return;
+  for (i = 0; i < copros->ncopros; i++)
+    schedule8051 (vm, &copros->copros[i].trigger, cycles);
+}
+
+/* call the print function of all the coprocessors */
 void print_coprocessors (struct vm8051 *vm)
 {
-  struct copro8051 *copros;
+  struct coprocessors8051 *copros;
+  struct copro8051 *copro;
+  unsigned int i;
 
   copros = vm->coprocessors;
-  while (copros)
+  if (!copros)
+    return;
+  for (i = 0; i < copros->ncopros; i++)
     {
-      assert (print_copro_table[copros->index] != NULL);
-      print_copro_table[copros->index] (vm, copros->contents);
-      copros = copros->next;
+      copro = &copros->copros[i];
+      copro->type->print (vm, copro->contents);
     }
 }
 
 void free_coprocessors (struct vm8051 *vm)
 {
-  struct copro8051 *copros;
+  struct coprocessors8051 *copros;
+  struct copro8051 *copro;
+  unsigned int i;
 
   copros = vm->coprocessors;
-  while (copros)
+  if (!copros)
+    return;
+  for (i = 0; i < copros->ncopros; i++)
     {
-      free (copros->contents);
-      copros = copros->next;
-      free (vm->coprocessors);
-      vm->coprocessors = copros;
+      copro = &copros->copros[i];
+      cancel8051 (vm, &copro->trigger);
+      cancel8051 (vm, &copro->wakeup);
+      free (copro->contents);
+    }
+  free (copros->copros);
+  free (copros);
+  vm->coprocessors = NULL;
+}
+
+/* the events of the coprocessors, for checkpoints; return how many */
+unsigned int coprocessor_events (struct vm8051 *vm,
+                                 struct event8051 **events)
+{
+  struct coprocessors8051 *copros = vm->coprocessors;
+  unsigned int i;
+
+  if (!copros)
+    return 0;
+  if (events)
+    for (i = 0; i < copros->ncopros; i++)
+      {
+        events[2 * i] = &copros->copros[i].trigger;
+        events[2 * i + 1] = &copros->copros[i].wakeup;
+      }
+  return 2 * copros->ncopros;
+}
+
+/* write the contents of the coprocessors to state if not NULL, return
+   their size, SIZE_MAX if one of them cannot be saved */
+size_t save_coprocessors (struct vm8051 *vm, uint8_t *state)
+{
+  struct coprocessors8051 *copros = vm->coprocessors;
+  struct copro_state8051 header;
+  struct copro8051 *copro;
+  size_t len = 0;
+  unsigned int i;
+
+  if (!copros)
+    return 0;
+  for (i = 0; i < copros->ncopros; i++)
+    {
+      copro = &copros->copros[i];
+      if (copro->type->size == 0)
+        return SIZE_MAX;
+      if (state)
+        {
+          memset (&header, 0, sizeof (header));
+          strncpy (header.name, copro->type->name,
+                   sizeof (header.name) - 1);
+          header.size = copro->type->size;
+          memcpy (state + len, &header, sizeof (header));
+          memset (state + len + sizeof (header), 0,
+                  (copro->type->size + 7) & ~(size_t) 7);
+          memcpy (state + len + sizeof (header), copro->contents,
+                  copro->type->size);
+        }
+      len += sizeof (header) + ((copro->type->size + 7) & ~(size_t) 7);
+    }
+  return len;
+}
+
+/* set the contents of the coprocessors back to the len bytes of state
+   saved by save_coprocessors, return 0 if they are not the same */
+int load_coprocessors (struct vm8051 *vm, const uint8_t *state, size_t len)
+{
+  struct coprocessors8051 *copros = vm->coprocessors;
+  struct copro_state8051 header;
+  struct copro8051 *copro;
+  size_t size, done = 0;
+  unsigned int i;
+
+  for (i = 0; copros && i < copros->ncopros; i++)
+    {
+      copro = &copros->copros[i];
+      size = (copro->type->size + 7) & ~(size_t) 7;
+      if (len - done < sizeof (header) + size)
+        return 0;
+      memcpy (&header, state + done, sizeof (header));
+      if (strncmp (header.name, copro->type->name, sizeof (header.name))
+          || header.size != copro->type->size)
+        return 0;
+      memcpy (copro->contents, state + done + sizeof (header),
+              copro->type->size);
+      done += sizeof (header) + size;
     }
+  return done == len;
 }
@@ -23,13 +23,33 @@
 
 #include "lib8051.h"
 
-extern void (*operate_copro_table[8]) (struct vm8051 *vm, void *copro);
-extern void (*print_copro_table[8]) (struct vm8051 *vm, void *copro);
-
-extern void add_coprocessor (struct vm8051 *vm,
-                             void *contents, unsigned int index);
-extern void operate_coprocessors (struct vm8051 *vm);
+/* a type of coprocessor, defined once as a constant by its module */
+struct copro_type8051
+{
+  const char *name;
+  void (*operate) (struct vm8051 *vm, void *copro);
+  void (*print) (struct vm8051 *vm, void *copro);
+  size_t size;                  /* of the contents, which checkpoints keep
+                                   as they are; 0 if they cannot */
+};
+
+extern unsigned int add_coprocessor (struct vm8051 *vm,
+                                     const struct copro_type8051 *type,
+                                     void *contents);
+extern void add_coprocessor_trigger (struct vm8051 *vm, unsigned int copro,
+                                     uint8_t sfr);
+extern void wake_coprocessor (struct vm8051 *vm, unsigned int copro,
+                              uint32_t cycle);
+extern void notify_coprocessors (struct vm8051 *vm, uint8_t sfr);
+extern void reset_coprocessors (struct vm8051 *vm);
 extern void print_coprocessors (struct vm8051 *vm);
 extern void free_coprocessors (struct vm8051 *vm);
 
+/* used by the vm */
+extern unsigned int coprocessor_events (struct vm8051 *vm,
+                                        struct event8051 **events);
+extern size_t save_coprocessors (struct vm8051 *vm, uint8_t *state);
+extern int load_coprocessors (struct vm8051 *vm, const uint8_t *state,
+                              size_t len);
+
 #endif  /* LIB8051COPROCESSORS_H */
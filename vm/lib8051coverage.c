@@ -0,0 +1,151 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051coverage.h"
+
+/* a coverage file is the magic number then the bits */
+#define COVERAGE_MAGIC "VM8051C1"
+
+/* start recording what the vm runs */
+void add_coverage (struct vm8051 *vm)
+{
+  assert (vm->coverage == NULL);
+  vm->coverage = calloc (1, sizeof (struct coverage8051));
+  assert (vm->coverage != NULL);
+}
+
+void clear_coverage (struct vm8051 *vm)
+{
+  if (vm->coverage)
+    memset (vm->coverage, 0, sizeof (struct coverage8051));
+}
+
+void free_coverage (struct vm8051 *vm)
+{
+  free (vm->coverage);
+  vm->coverage = NULL;
+}
+
+/* add what from covers to to */
+void merge_coverage (struct coverage8051 *to,
+                     const struct coverage8051 *from)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (to->bits); i++)
+    to->bits[i] |= from->bits[i];
+}
+
+/* whether opcode is a conditional branch, which may go either way */
+int is_branch8051 (uint8_t opcode)
+{
+  switch (opcode)
+    {
+    case 0x10:                  /* jbc */
+    case 0x20:                  /* jb */
+    case 0x30:                  /* jnb */
+    case 0x40:                  /* jc */
+    case 0x50:                  /* jnc */
+    case 0x60:                  /* jz */
+    case 0x70:                  /* jnz */
+    case 0xD5:                  /* djnz direct */
+      return 1;
+    }
+  /* cjne and djnz Rn */
+  return (opcode >= 0xB4 && opcode <= 0xBF) || (opcode & 0xF8) == 0xD8;
+}
+
+/* read the coverage saved in path, return 0 if it cannot be read or is
+   not a coverage */
+int read_coverage (struct coverage8051 *coverage, const char *path)
+{
+  FILE *stream;
+  char magic[8];
+  int ok;
+
+  stream = fopen (path, "rb");
+  if (stream == NULL)
+    return 0;
+  ok = fread (magic, 1, 8, stream) == 8
+    && memcmp (magic, COVERAGE_MAGIC, 8) == 0
+    && fread (coverage->bits, 1, sizeof (coverage->bits), stream)
+    == sizeof (coverage->bits)
+    && fgetc (stream) == EOF;
+  fclose (stream);
+  return ok;
+}
+
+/* save coverage to path, return 0 if it cannot be written */
+int write_coverage (const struct coverage8051 *coverage, const char *path)
+{
+  FILE *stream;
+  int ok;
+
+  stream = fopen (path, "wb");
+  if (stream == NULL)
+    return 0;
+  ok = fwrite (COVERAGE_MAGIC, 1, 8, stream) == 8
+    && fwrite (coverage->bits, 1, sizeof (coverage->bits), stream)
+    == sizeof (coverage->bits);
+  return fclose (stream) == 0 && ok;
+}
+
+/* add coverage to the one saved in path, which is created if there is
+   none; return 0 if path holds something else or cannot be written */
+int update_coverage (const struct coverage8051 *coverage, const char *path)
+{
+  struct coverage8051 saved;
+  FILE *stream;
+
+  memset (&saved, 0, sizeof (struct coverage8051));
+  stream = fopen (path, "rb");
+  if (stream)
+    {
+      fclose (stream);
+      if (!read_coverage (&saved, path))
+        return 0;
+    }
+  merge_coverage (&saved, coverage);
+  return write_coverage (&saved, path);
+}
+
+/* start counting the edges the vm runs */
+void add_edges (struct vm8051 *vm)
+{
+  assert (vm->edges == NULL);
+  vm->edges = calloc (1, sizeof (struct edges8051));
+  assert (vm->edges != NULL);
+}
+
+void clear_edges (struct vm8051 *vm)
+{
+  if (vm->edges)
+    memset (vm->edges, 0, sizeof (struct edges8051));
+}
+
+void free_edges (struct vm8051 *vm)
+{
+  free (vm->edges);
+  vm->edges = NULL;
+}
@@ -0,0 +1,73 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051COVERAGE_H
+#define LIB8051COVERAGE_H
+
+#include <stdint.h>
+
+struct vm8051;
+
+/* Coverage keeps two bits for each address of the code, set when an
+   instruction run from there went on to the next one and when it went
+   elsewhere, so that running an instruction costs a single bit set.  An
+   instruction was run if either bit is set, and a conditional branch was
+   taken both ways if both are; an interrupt between two instructions does
+   not count as going elsewhere.  The banks of banked code share their
+   addresses.  The coverages of several runs merge by OR. */
+struct coverage8051
+{
+  uint8_t bits[65536 / 4];
+};
+
+#define COVERAGE_NEXT 1         /* went on to the next instruction */
+#define COVERAGE_JUMP 2         /* went elsewhere */
+
+#define COVERAGE(coverage, address)                                     \
+  (((coverage)->bits[(uint16_t) (address) >> 2]                         \
+    >> (((address) & 3) * 2)) & 3)
+
+/* Edges count the pairs of instructions run one after the other, as AFL
+   does for the branches of the programs it fuzzes: the instruction run
+   from address after the one run from prev counts in
+   hits[address ^ (prev >> 1)], so that a pair counts apart from the same
+   pair the other way round and a loop apart from its way out.  The counts
+   wrap around, the loops fast-forwarded by sim8051 count once and a
+   superinstruction as its two instructions. */
+struct edges8051
+{
+  uint8_t hits[65536];
+  uint16_t prev;                /* the last address, shifted right */
+};
+
+extern void add_coverage (struct vm8051 *vm);
+extern void clear_coverage (struct vm8051 *vm);
+extern void free_coverage (struct vm8051 *vm);
+extern void merge_coverage (struct coverage8051 *to,
+                            const struct coverage8051 *from);
+extern int is_branch8051 (uint8_t opcode);
+extern int read_coverage (struct coverage8051 *coverage, const char *path);
+extern int write_coverage (const struct coverage8051 *coverage,
+                           const char *path);
+extern int update_coverage (const struct coverage8051 *coverage,
+                            const char *path);
+
+extern void add_edges (struct vm8051 *vm);
+extern void clear_edges (struct vm8051 *vm);
+extern void free_edges (struct vm8051 *vm);
+
+#endif  /* LIB8051COVERAGE_H */
@@ -74,6 +74,27 @@
 #define RI_MASK (0x01 << RI_POS)
 #define RI(vm) ((vm->SCON & RI_MASK) >> RI_POS)
 
+/* power control */
+#define IDL_POS 0
+#define IDL_MASK (0x01 << IDL_POS)
+#define IDL(vm) ((vm->PCON & IDL_MASK) >> IDL_POS)
+
+#define PD_POS 1
+#define PD_MASK (0x01 << PD_POS)
+#define PD(vm) ((vm->PCON & PD_MASK) >> PD_POS)
+
+#define GF0_POS 2
+#define GF0_MASK (0x01 << GF0_POS)
+#define GF0(vm) ((vm->PCON & GF0_MASK) >> GF0_POS)
+
+#define GF1_POS 3
+#define GF1_MASK (0x01 << GF1_POS)
+#define GF1(vm) ((vm->PCON & GF1_MASK) >> GF1_POS)
+
+#define SMOD_POS 7
+#define SMOD_MASK (0x01 << SMOD_POS)
+#define SMOD(vm) ((vm->PCON & SMOD_MASK) >> SMOD_POS)
+
 /* program status word */
 #define CY_POS 7
 #define CY_MASK (0x01 << CY_POS)
@@ -34,6 +34,11 @@
 #undef TF1
 #undef TI
 #undef RI
+#undef IDL
+#undef PD
+#undef GF0
+#undef GF1
+#undef SMOD
 
 #define cycles vm->cycles
 #define _data vm->_data
@@ -81,6 +86,13 @@
 #define PT0 ((IP & 0x02) >> 1)
 #define PX0 ((IP & 0x01) >> 0)
 
+/* PCON bits */
+#define SMOD ((PCON & SMOD_MASK) >> SMOD_POS)
+#define GF1 ((PCON & GF1_MASK) >> GF1_POS)
+#define GF0 ((PCON & GF0_MASK) >> GF0_POS)
+#define PD ((PCON & PD_MASK) >> PD_POS)
+#define IDL ((PCON & IDL_MASK) >> IDL_POS)
+
 /* PSW bits */
 #define CY ((PSW & CY_MASK) >> CY_POS)
 #define AC ((PSW & AC_MASK) >> AC_POS)
@@ -21,6 +21,12 @@
 /* simulate global variables for a struct vm8051 *vm */
 #include "lib8051globals.h"
 
+#ifndef PURE_8051
+extern void notify_coprocessors (struct vm8051 *vm, uint8_t sfr);
+#else
+#define notify_coprocessors(vm, sfr)
+#endif
+
 static void parity_check (struct vm8051 *vm)
 {
   uint8_t n;
@@ -62,16 +68,59 @@ static void SFR_check (struct vm8051 *vm, uint8_t direct)
       IP &= 0x1F;
       interrupts_blocked = 1;
     }
-  if (direct == 0x87)           /* PCON */
-    PCON &= 0x8F;
+  if (direct == 0x87)           /* PCON, SMOD changes the baud rate */
+    {
+      PCON &= 0x8F;
+      vm->sched.flags |= SCHED_TIMERS;
+    }
   if (direct == 0x99)           /* SBUF */
-    SCON |= TI_MASK;
+    transmit_uart (vm);
+  if (direct == 0x98)           /* SCON */
+    notify_uart (vm);
+  if (vm->banks)
+    notify_banks (vm, direct);
+  if (direct >= 0x89 && direct <= 0x8D) /* TMOD, TL0, TL1, TH0, TH1 */
+    vm->sched.flags |= SCHED_TIMERS;
+  if (direct == 0x88)           /* TCON */
+    vm->sched.flags |= SCHED_TIMERS | SCHED_INTERRUPTS;
+  if (direct == 0xA8 || direct == 0xB8 || direct == 0x98 || direct == 0x99
+      || direct == 0xB0)        /* IE, IP, SCON, SBUF, P3 */
+    vm->sched.flags |= SCHED_INTERRUPTS;
+  notify_coprocessors (vm, direct);
+}
+
+/* plain RAM pages directly, peripherals through read_xdata */
+static uint8_t get_xdata (struct vm8051 *vm, uint16_t address)
+{
+  const uint8_t *page = vm->xpages[address >> 8];
+
+  if (page)
+    return page[address & 0xFF];
+  return read_xdata (vm, address);
+}
+
+static void set_xdata (struct vm8051 *vm, uint16_t address, uint8_t value)
+{
+  uint8_t *page = vm->xpages[address >> 8];
+
+  if (page)
+    page[address & 0xFF] = value;
+  else
+    write_xdata (vm, address, value);
+}
+
+/* the timers count lazily, bring them up to date before they change */
+static void SFR_prepare (struct vm8051 *vm, uint8_t direct)
+{
+  if (direct >= 0x88 && direct <= 0x8D) /* TCON, TMOD, TL0, TL1, TH0, TH1 */
+    sync8051 (vm);
 }
 
 static void assign_direct (struct vm8051 *vm, uint8_t direct, uint8_t val)
 {
   if (direct & 0x80)
     {
+      SFR_prepare (vm, direct);
       _sfr[direct ^ 0x80] = val;
       SFR_check (vm, direct);
     }
@@ -81,6 +130,8 @@ static void assign_direct (struct vm8051 *vm, uint8_t direct, uint8_t val)
 
 static uint8_t get_direct (struct vm8051 *vm, uint8_t direct)
 {
+  if (direct >= 0x8A && direct <= 0x8D) /* TL0, TL1, TH0, TH1 */
+    sync8051 (vm);
   return ((direct & 0x80) ? _sfr[direct ^ 0x80] : _data[direct]);
 }
 
@@ -829,7 +880,7 @@ void inst_movc_PC (struct vm8051 *vm)
 void inst_movx_atRi (struct vm8051 *vm, unsigned char i)
 {
   assert (!(i & 0xFE));
-  A = _xdata[(P2 << 8) + regs[i]];
+  A = get_xdata (vm, (P2 << 8) + regs[i]);
   P0 = 0xFF;
   parity_check (vm);
   cycles += 2;
@@ -838,7 +889,7 @@ void inst_movx_atRi (struct vm8051 *vm, unsigned char i)
 /* movx A, @DPTR          1       2 */
 void inst_movx_atDPTR (struct vm8051 *vm)
 {
-  A = _xdata[DPTR];
+  A = get_xdata (vm, DPTR);
   P0 = 0xFF;
   parity_check (vm);
   cycles += 2;
@@ -849,14 +900,14 @@ void inst_movx_to_atRi (struct vm8051 *vm, unsigned char i)
 {
   assert (!(i & 0xFE));
   P0 = 0xFF;
-  _xdata[(P2 << 8) + regs[i]] = A;
+  set_xdata (vm, (P2 << 8) + regs[i], A);
   cycles += 2;
 }
 
 /* movx @DPTR, A          1       2 */
 void inst_movx_to_atDPTR (struct vm8051 *vm)
 {
-  _xdata[DPTR] = A;
+  set_xdata (vm, DPTR, A);
   P0 = 0xFF;
   cycles += 2;
 }
@@ -875,6 +926,7 @@ void inst_clr_bit (struct vm8051 *vm, uint8_t bit)
   assert (is_valid_bit (bit));
   if (bit & 0x80)
     {
+      SFR_prepare (vm, bit & 0xF8);
       _sfr[bit & 0x78] &= ~(1 << (bit & 0x07));
       SFR_check (vm, bit & 0xF8);
     }
@@ -897,6 +949,7 @@ void inst_setb_bit (struct vm8051 *vm, uint8_t bit)
   assert (is_valid_bit (bit));
   if (bit & 0x80)
     {
+      SFR_prepare (vm, bit & 0xF8);
       _sfr[bit & 0x78] |= 1 << (bit & 0x07);
       SFR_check (vm, bit & 0xF8);
     }
@@ -919,6 +972,7 @@ void inst_cpl_bit (struct vm8051 *vm, uint8_t bit)
   assert (is_valid_bit (bit));
   if (bit & 0x80)
     {
+      SFR_prepare (vm, bit & 0xF8);
       _sfr[bit & 0x78] ^= 1 << (bit & 0x07);
       SFR_check (vm, bit & 0xF8);
     }
@@ -992,6 +1046,7 @@ void inst_mov_to_bit (struct vm8051 *vm, uint8_t bit)
   assert (is_valid_bit (bit));
   if (bit & 0x80)
     {
+      SFR_prepare (vm, bit & 0xF8);
       _sfr[bit & 0x78] &= ~(1 << (bit & 0x07));
       _sfr[bit & 0x78] |= CY << (bit & 0x07);
       SFR_check (vm, bit & 0xF8);
@@ -1149,6 +1204,7 @@ void inst_jbc (struct vm8051 *vm, uint8_t bit, uint8_t rel)
     {
       if (_sfr[bit & 0x78] & (1 << (bit & 0x07)))
         {
+          SFR_prepare (vm, bit & 0xF8);
           _sfr[bit & 0x78] &= ~(1 << (bit & 0x07));
           SFR_check (vm, bit & 0xF8);
           PC += (int8_t) rel;
@@ -1313,6 +1369,7 @@ void inst_reti (struct vm8051 *vm)
   else
     interrupted = 0;
   interrupts_blocked = 1;
+  vm->sched.flags |= SCHED_INTERRUPTS;
   PC = _data[SP--] << 8;
   PC |= _data[SP--];
   cycles += 2;
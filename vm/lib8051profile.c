@@ -0,0 +1,302 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051profile.h"
+
+/* the deepest call stack followed */
+#define STACK_DEPTH 256
+
+/* a node of the call tree: a function called from a call stack */
+struct frame
+{
+  uint16_t function;
+  uint32_t parent;
+  uint32_t child;               /* the first one, 0 for none */
+  uint32_t sibling;             /* the next child of parent, 0 for none */
+  uint64_t calls;
+  uint64_t self;                /* cycles spent in its own code */
+};
+
+/* the root of the tree is frame 0, the code run before any call */
+struct calls8051
+{
+  struct frame *frames;
+  uint32_t nframes;
+  uint32_t size;
+  uint32_t stack[STACK_DEPTH];  /* the frames being run */
+  uint8_t sp[STACK_DEPTH];      /* SP before each of them was called */
+  unsigned int depth;
+};
+
+struct hot_spot
+{
+  uint64_t spent;
+  uint16_t address;
+};
+
+/* start the call tree again from the function at PC */
+static void clear_calls (struct vm8051 *vm)
+{
+  struct calls8051 *calls = vm->profile->calls;
+
+  memset (calls->frames, 0, sizeof (struct frame));
+  calls->frames[0].function = vm->PC;
+  calls->nframes = 1;
+  calls->stack[0] = 0;
+  calls->depth = 1;
+}
+
+/* start counting what the vm runs */
+void add_profile (struct vm8051 *vm)
+{
+  struct calls8051 *calls;
+
+  assert (vm->profile == NULL);
+  vm->profile = calloc (1, sizeof (struct profile8051));
+  assert (vm->profile != NULL);
+  calls = calloc (1, sizeof (struct calls8051));
+  assert (calls != NULL);
+  calls->size = 64;
+  calls->frames = malloc (calls->size * sizeof (struct frame));
+  assert (calls->frames != NULL);
+  vm->profile->calls = calls;
+  clear_calls (vm);
+}
+
+/* count again from zero */
+void clear_profile (struct vm8051 *vm)
+{
+  if (vm->profile == NULL)
+    return;
+  memset (vm->profile->insts, 0, sizeof (vm->profile->insts));
+  memset (vm->profile->spent, 0, sizeof (vm->profile->spent));
+  clear_calls (vm);
+}
+
+void free_profile (struct vm8051 *vm)
+{
+  if (vm->profile == NULL)
+    return;
+  free (vm->profile->calls->frames);
+  free (vm->profile->calls);
+  free (vm->profile);
+  vm->profile = NULL;
+}
+
+/* count insts instructions run from address in spent cycles */
+void count_profile (struct vm8051 *vm, uint16_t address, uint32_t insts,
+                    uint32_t spent)
+{
+  struct calls8051 *calls = vm->profile->calls;
+
+  vm->profile->insts[address] += insts;
+  vm->profile->spent[address] += spent;
+  calls->frames[calls->stack[calls->depth - 1]].self += spent;
+}
+
+/* follow a call to function, its return address just pushed */
+void call_profile (struct vm8051 *vm, uint16_t function)
+{
+  struct calls8051 *calls = vm->profile->calls;
+  uint32_t caller, frame;
+
+  if (calls->depth == STACK_DEPTH)
+    return;
+  caller = calls->stack[calls->depth - 1];
+  for (frame = calls->frames[caller].child; frame;
+       frame = calls->frames[frame].sibling)
+    if (calls->frames[frame].function == function)
+      break;
+  if (!frame)
+    {
+      if (calls->nframes == calls->size)
+        {
+          calls->size *= 2;
+          calls->frames = realloc (calls->frames,
+                                   calls->size * sizeof (struct frame));
+          assert (calls->frames != NULL);
+        }
+      frame = calls->nframes++;
+      memset (&calls->frames[frame], 0, sizeof (struct frame));
+      calls->frames[frame].function = function;
+      calls->frames[frame].parent = caller;
+      calls->frames[frame].sibling = calls->frames[caller].child;
+      calls->frames[caller].child = frame;
+    }
+  calls->frames[frame].calls++;
+  calls->stack[calls->depth] = frame;
+  calls->sp[calls->depth] = vm->SP - 2;
+  calls->depth++;
+}
+
+/* follow a return, which leaves the functions called with SP at its
+   stack pointer or above */
+void return_profile (struct vm8051 *vm)
+{
+  struct calls8051 *calls = vm->profile->calls;
+
+  while (calls->depth > 1 && calls->sp[calls->depth - 1] >= vm->SP)
+    calls->depth--;
+}
+
+static int compare_spots (const void *a, const void *b)
+{
+  const struct hot_spot *p = a;
+  const struct hot_spot *q = b;
+
+  if (p->spent != q->spent)
+    return p->spent < q->spent ? 1 : -1;
+  return p->address - q->address;
+}
+
+/* the addresses which took cycles, the n first ones in addresses from
+   the one which took the most; return how many there are */
+unsigned int hot_spots (struct vm8051 *vm, uint16_t *addresses,
+                        unsigned int n)
+{
+  struct profile8051 *profile = vm->profile;
+  struct hot_spot *spots;
+  unsigned int i, count = 0;
+  uint32_t address;
+
+  if (profile == NULL)
+    return 0;
+  spots = malloc (65536 * sizeof (struct hot_spot));
+  assert (spots != NULL);
+  for (address = 0; address < 65536; address++)
+    if (profile->spent[address])
+      {
+        spots[count].spent = profile->spent[address];
+        spots[count].address = address;
+        count++;
+      }
+  qsort (spots, count, sizeof (struct hot_spot), compare_spots);
+  for (i = 0; i < n && i < count; i++)
+    addresses[i] = spots[i].address;
+  free (spots);
+  return count;
+}
+
+static int compare_functions (const void *a, const void *b)
+{
+  const struct function8051 *p = a;
+  const struct function8051 *q = b;
+
+  if (p->inclusive != q->inclusive)
+    return p->inclusive < q->inclusive ? 1 : -1;
+  return p->address - q->address;
+}
+
+/* the functions which took cycles, the n first ones in functions from the
+   one which took the most with its callees; return how many there are */
+unsigned int hot_functions (struct vm8051 *vm,
+                            struct function8051 *functions, unsigned int n)
+{
+  struct calls8051 *calls;
+  struct function8051 *all;
+  uint64_t *total;
+  uint32_t frame, up;
+  unsigned int i, count = 0;
+
+  if (vm->profile == NULL)
+    return 0;
+  calls = vm->profile->calls;
+  all = calloc (65536, sizeof (struct function8051));
+  assert (all != NULL);
+  total = malloc (calls->nframes * sizeof (uint64_t));
+  assert (total != NULL);
+
+  /* the callees come after their callers */
+  for (frame = 0; frame < calls->nframes; frame++)
+    total[frame] = calls->frames[frame].self;
+  for (frame = calls->nframes - 1; frame > 0; frame--)
+    total[calls->frames[frame].parent] += total[frame];
+
+  for (frame = 0; frame < calls->nframes; frame++)
+    {
+      struct frame *f = &calls->frames[frame];
+      struct function8051 *function = &all[f->function];
+
+      function->calls += f->calls;
+      function->exclusive += f->self;
+      /* a recursive call is already in the inclusive cycles */
+      for (up = frame; up > 0; )
+        {
+          up = calls->frames[up].parent;
+          if (calls->frames[up].function == f->function)
+            break;
+        }
+      if (frame == 0 || calls->frames[up].function != f->function)
+        function->inclusive += total[frame];
+    }
+
+  for (i = 0; i < 65536; i++)
+    if (all[i].inclusive)
+      {
+        all[i].address = i;
+        all[count++] = all[i];
+      }
+  qsort (all, count, sizeof (struct function8051), compare_functions);
+  for (i = 0; i < n && i < count; i++)
+    functions[i] = all[i];
+  free (total);
+  free (all);
+  return count;
+}
+
+/* write the call stack of frame and its callees which took cycles, after
+   the len bytes of path */
+static void fold (const struct calls8051 *calls, uint32_t frame,
+                  FILE *stream, char *const *names, char *path, size_t len)
+{
+  const struct frame *f = &calls->frames[frame];
+  uint32_t child;
+
+  if (len > 0)
+    path[len++] = ';';
+  if (names && names[f->function])
+    len += sprintf (path + len, "%.63s", names[f->function]);
+  else
+    len += sprintf (path + len, "0x%04X", f->function);
+  if (f->self)
+    fprintf (stream, "%s %llu\n", path, (unsigned long long) f->self);
+  for (child = f->child; child; child = calls->frames[child].sibling)
+    fold (calls, child, stream, names, path, len);
+}
+
+/* write the cycles of each call stack as folded stacks, a line of the
+   functions from the outermost one separated by semicolons, then the
+   cycles; names gives the name of the functions at each address, NULL
+   for their address in hexadecimal */
+void write_folded (struct vm8051 *vm, FILE *stream, char *const *names)
+{
+  char *path;
+
+  if (vm->profile == NULL)
+    return;
+  path = malloc (STACK_DEPTH * 64 + 1);
+  assert (path != NULL);
+  fold (vm->profile->calls, 0, stream, names, path, 0);
+  free (path);
+}
@@ -0,0 +1,74 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051PROFILE_H
+#define LIB8051PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct vm8051;
+struct calls8051;
+
+/* A profile counts, for each address of the code, the instructions run
+   from there and the cycles they took.  The cycles of idle mode go to the
+   address the CPU waits at and those of the call to an interrupt vector
+   to the vector, with no instruction.  The loops fast-forwarded by
+   sim8051 and skip8051 count as if they had run, and the banks of banked
+   code share their addresses.  sim8051 runs no superinstruction while the
+   vm has a profile.
+
+   The cycles are also counted by call stack: a shadow stack follows the
+   calls, the interrupts and the returns, a return leaving the functions
+   whose stack pointer it goes back to or below, so that a ret used as a
+   jump or a stack reset does not mislead it for long.  A function is
+   known by the address called; the code run before any call is the
+   function where the profile started. */
+struct profile8051
+{
+  uint64_t insts[65536];        /* run from each address */
+  uint64_t spent[65536];        /* cycles spent there */
+  struct calls8051 *calls;      /* the call tree */
+};
+
+/* cycles spent in a function, wherever it was called from */
+struct function8051
+{
+  uint16_t address;
+  uint64_t calls;
+  uint64_t inclusive;           /* with the functions it calls */
+  uint64_t exclusive;           /* in its own code */
+};
+
+extern void add_profile (struct vm8051 *vm);
+extern void clear_profile (struct vm8051 *vm);
+extern void free_profile (struct vm8051 *vm);
+extern unsigned int hot_spots (struct vm8051 *vm, uint16_t *addresses,
+                               unsigned int n);
+extern unsigned int hot_functions (struct vm8051 *vm,
+                                   struct function8051 *functions,
+                                   unsigned int n);
+extern void write_folded (struct vm8051 *vm, FILE *stream,
+                          char *const *names);
+
+/* used by the vm */
+extern void count_profile (struct vm8051 *vm, uint16_t address,
+                           uint32_t insts, uint32_t spent);
+extern void call_profile (struct vm8051 *vm, uint16_t function);
+extern void return_profile (struct vm8051 *vm);
+
+#endif  /* LIB8051PROFILE_H */
@@ -0,0 +1,340 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051sched.h"
+
+/* An event lives at the level of the highest byte in which its cycle
+   differs from now, in the slot given by that byte of its cycle.  When
+   now enters the range of a slot, its events are moved down the wheel.
+   All the events of a slot of level 0 fire at the same cycle. */
+
+static unsigned int level_of (uint32_t now, uint32_t cycle)
+{
+  uint32_t diff = now ^ cycle;
+
+  if (diff < 0x100)
+    return 0;
+  if (diff < 0x10000)
+    return 1;
+  if (diff < 0x1000000)
+    return 2;
+  return 3;
+}
+
+/* put event first in its slot */
+static void insert_event (struct sched8051 *sched, struct event8051 *event)
+{
+  unsigned int level, slot;
+  struct event8051 **head;
+
+  level = event->slot / SCHED_SLOTS;
+  slot = event->slot % SCHED_SLOTS;
+  head = &sched->wheel[level][slot];
+
+  event->next = *head;
+  if (*head)
+    (*head)->prev = &event->next;
+  *head = event;
+  event->prev = head;
+  sched->used[level][slot / 32] |= (uint32_t) 1 << (slot % 32);
+  sched->changes++;
+}
+
+static void link_event (struct sched8051 *sched, struct event8051 *event)
+{
+  unsigned int level;
+
+  level = level_of (sched->now, event->cycle);
+  event->slot = level * SCHED_SLOTS + ((event->cycle >> (8 * level)) & 0xFF);
+  insert_event (sched, event);
+}
+
+static void unlink_event (struct sched8051 *sched, struct event8051 *event)
+{
+  unsigned int level, slot;
+
+  level = event->slot / SCHED_SLOTS;
+  slot = event->slot % SCHED_SLOTS;
+
+  *event->prev = event->next;
+  if (event->next)
+    event->next->prev = event->prev;
+  event->prev = NULL;
+  if (!sched->wheel[level][slot])
+    sched->used[level][slot / 32] &= ~((uint32_t) 1 << (slot % 32));
+  sched->changes++;
+}
+
+/* first used slot of level in [from, to), -1 if none */
+static int first_slot (struct sched8051 *sched, unsigned int level,
+                       unsigned int from, unsigned int to)
+{
+  uint32_t word;
+  unsigned int i;
+
+  for (i = from; i < to; i = (i | 31) + 1)
+    {
+      word = sched->used[level][i / 32] >> (i % 32);
+      if (word)
+        {
+          i += __builtin_ctz (word);
+          return i < to ? (int) i : -1;
+        }
+    }
+  return -1;
+}
+
+/* find the earliest event, looking up the wheel from now */
+static void update_next (struct sched8051 *sched)
+{
+  struct event8051 *event;
+  unsigned int level, digit;
+  int slot;
+
+  /* far enough not to be reached before the wheel is looked at again */
+  if (!sched->nevents)
+    {
+      sched->next = sched->now + INT32_MAX;
+      return;
+    }
+
+  slot = first_slot (sched, 0, sched->now & 0xFF, SCHED_SLOTS);
+  if (slot >= 0)
+    {
+      sched->next = (sched->now & ~0xFFu) | (uint32_t) slot;
+      return;
+    }
+  for (level = 1; level < SCHED_LEVELS; level++)
+    {
+      digit = (sched->now >> (8 * level)) & 0xFF;
+      slot = first_slot (sched, level, digit + 1, SCHED_SLOTS);
+      /* the top level wraps around */
+      if (slot < 0 && level == SCHED_LEVELS - 1)
+        slot = first_slot (sched, level, 0, digit);
+      if (slot < 0)
+        continue;
+      event = sched->wheel[level][slot];
+      sched->next = event->cycle;
+      for (event = event->next; event; event = event->next)
+        if (BEFORE (event->cycle, sched->next))
+          sched->next = event->cycle;
+      return;
+    }
+  assert (0);
+}
+
+/* move the wheel forward to cycle, which must not be past the earliest
+   event, and bring down the events of the slots now enters */
+static void set_now (struct sched8051 *sched, uint32_t cycle)
+{
+  struct event8051 *event;
+  uint32_t prev;
+  unsigned int level, slot;
+
+  prev = sched->now;
+  sched->now = cycle;
+  for (level = SCHED_LEVELS - 1; level > 0; level--)
+    {
+      if (!((prev ^ cycle) >> (8 * level)))
+        continue;
+      slot = (cycle >> (8 * level)) & 0xFF;
+      while ((event = sched->wheel[level][slot]))
+        {
+          unlink_event (sched, event);
+          link_event (sched, event);
+        }
+    }
+}
+
+/* fire event at cycle, or at the next instruction boundary if cycle is
+   already past; an event which is already scheduled is moved */
+void schedule8051 (struct vm8051 *vm, struct event8051 *event,
+                   uint32_t cycle)
+{
+  struct sched8051 *sched = &vm->sched;
+
+  assert (event->fire != NULL);
+  if (event->prev)
+    cancel8051 (vm, event);
+  /* an empty wheel can be moved freely */
+  if (!sched->nevents)
+    sched->now = vm->cycles;
+  if (BEFORE (cycle, sched->now))
+    cycle = sched->now;
+
+  event->cycle = cycle;
+  link_event (sched, event);
+  if (!sched->nevents++ || BEFORE (cycle, sched->next))
+    sched->next = cycle;
+}
+
+void cancel8051 (struct vm8051 *vm, struct event8051 *event)
+{
+  struct sched8051 *sched = &vm->sched;
+
+  if (!event->prev)
+    return;
+  unlink_event (sched, event);
+  sched->nevents--;
+  if (event->cycle == sched->next)
+    update_next (sched);
+}
+
+/* fire the events due at or before cycle, in order */
+void advance8051 (struct vm8051 *vm, uint32_t cycle)
+{
+  struct sched8051 *sched = &vm->sched;
+  struct event8051 *event;
+
+  while (sched->nevents && !BEFORE (cycle, sched->next))
+    {
+      set_now (sched, sched->next);
+      while ((event = sched->wheel[0][sched->now & 0xFF]))
+        {
+          unlink_event (sched, event);
+          sched->nevents--;
+          event->fire (vm, event);
+        }
+      update_next (sched);
+    }
+  if (!sched->nevents)
+    {
+      sched->now = cycle;
+      update_next (sched);
+    }
+  else if (BEFORE (sched->now, cycle))
+    set_now (sched, cycle);
+}
+
+/* unschedule all the events */
+void clear8051 (struct vm8051 *vm)
+{
+  struct sched8051 *sched = &vm->sched;
+  struct event8051 *event;
+  unsigned int level;
+  int slot;
+
+  for (level = 0; level < SCHED_LEVELS; level++)
+    for (slot = first_slot (sched, level, 0, SCHED_SLOTS); slot >= 0;
+         slot = first_slot (sched, level, slot + 1, SCHED_SLOTS))
+      while ((event = sched->wheel[level][slot]))
+        unlink_event (sched, event);
+  sched->nevents = 0;
+}
+
+/* shift the wheel and its events by shift cycles */
+void shift8051 (struct vm8051 *vm, uint32_t shift)
+{
+  struct sched8051 *sched = &vm->sched;
+  struct event8051 *events = NULL, *event;
+  unsigned int level, slot;
+
+  for (level = 0; level < SCHED_LEVELS; level++)
+    for (slot = 0; slot < SCHED_SLOTS; slot++)
+      while ((event = sched->wheel[level][slot]))
+        {
+          unlink_event (sched, event);
+          event->next = events;
+          events = event;
+        }
+
+  sched->now += shift;
+  sched->next += shift;
+  while (events)
+    {
+      event = events;
+      events = event->next;
+      event->cycle += shift;
+      link_event (sched, event);
+    }
+}
+
+/* number of cycles before the next event, UINT32_MAX if none */
+uint32_t next8051 (struct vm8051 *vm)
+{
+  if (!vm->sched.nevents)
+    return UINT32_MAX;
+  if (!BEFORE (vm->cycles, vm->sched.next))
+    return 0;
+  return vm->sched.next - vm->cycles;
+}
+
+/* end sim8051 at the current instruction boundary */
+void stop8051 (struct vm8051 *vm)
+{
+  vm->sched.stop = 1;
+}
+
+static void fire_breakpoint (struct vm8051 *vm, struct event8051 *event)
+{
+  (void) event;
+  stop8051 (vm);
+}
+
+/* stop sim8051 at the first instruction boundary at or after cycle */
+void break8051 (struct vm8051 *vm, uint32_t cycle)
+{
+  vm->sched.breakpoint.fire = fire_breakpoint;
+  schedule8051 (vm, &vm->sched.breakpoint, cycle);
+}
+
+/* the scheduled events slot after slot, in the order they fire within a
+   slot; at most size are stored, the number of events is returned */
+unsigned int list8051 (struct vm8051 *vm, struct event8051 **events,
+                       unsigned int size)
+{
+  struct sched8051 *sched = &vm->sched;
+  struct event8051 *event;
+  unsigned int level, slot, n = 0;
+
+  for (level = 0; level < SCHED_LEVELS; level++)
+    for (slot = 0; slot < SCHED_SLOTS; slot++)
+      for (event = sched->wheel[level][slot]; event; event = event->next)
+        {
+          if (n < size)
+            events[n] = event;
+          n++;
+        }
+  return n;
+}
+
+/* schedule again the events as list8051 gave them, with their cycle and
+   slot set back, the wheel being at now with its earliest event at next;
+   the other events are unscheduled */
+void relink8051 (struct vm8051 *vm, struct event8051 **events,
+                 unsigned int n, uint32_t now, uint32_t next)
+{
+  struct sched8051 *sched = &vm->sched;
+  unsigned int i;
+
+  clear8051 (vm);
+  sched->breakpoint.fire = fire_breakpoint;
+  for (i = n; i-- > 0; )
+    {
+      assert (events[i]->fire != NULL && events[i]->prev == NULL);
+      assert (events[i]->slot < SCHED_LEVELS * SCHED_SLOTS);
+      insert_event (sched, events[i]);
+    }
+  sched->now = now;
+  sched->next = next;
+  sched->nevents = n;
+}
@@ -0,0 +1,80 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051SCHED_H
+#define LIB8051SCHED_H
+
+#include <stdint.h>
+
+#define SCHED_LEVELS 4
+#define SCHED_SLOTS 256
+
+/* work to do at the next instruction boundary */
+#define SCHED_TIMERS     (1 << 0)       /* timers were reconfigured */
+#define SCHED_INTERRUPTS (1 << 1)       /* interrupt sources may have changed */
+#define SCHED_CODE       (1 << 2)       /* the code bank was switched */
+
+/* is cycle a before cycle b (cycles wrap around) */
+#define BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+struct vm8051;
+
+/* an event fires at the first instruction boundary at or after cycle;
+   it is owned by its registrant and must be unscheduled before release */
+struct event8051
+{
+  uint32_t cycle;
+  void (*fire) (struct vm8051 *vm, struct event8051 *event);
+  void *data;
+  unsigned int slot;
+  struct event8051 *next;
+  struct event8051 **prev;      /* NULL when not scheduled */
+};
+
+/* hierarchical timing wheel keyed by cycle, 8 bits of cycle per level */
+struct sched8051
+{
+  uint32_t now;                 /* cycle the wheel was advanced to */
+  uint32_t next;                /* cycle of the earliest event */
+  unsigned int nevents;
+  uint8_t flags;
+  uint8_t stop;                 /* set by an event to end sim8051 */
+  uint32_t timers;              /* cycle the timers were counted up to */
+  uint32_t overflows1;          /* Timer1 overflows, which clock the UART */
+  uint32_t changes;             /* events linked or unlinked so far */
+  struct event8051 overflow;    /* next timer overflow */
+  struct event8051 breakpoint;  /* breakpoint on cycle */
+  struct event8051 *wheel[SCHED_LEVELS][SCHED_SLOTS];
+  uint32_t used[SCHED_LEVELS][SCHED_SLOTS / 32];
+};
+
+extern void schedule8051 (struct vm8051 *vm, struct event8051 *event,
+                          uint32_t cycle);
+extern void cancel8051 (struct vm8051 *vm, struct event8051 *event);
+extern void advance8051 (struct vm8051 *vm, uint32_t cycle);
+extern void clear8051 (struct vm8051 *vm);
+extern void shift8051 (struct vm8051 *vm, uint32_t shift);
+extern uint32_t next8051 (struct vm8051 *vm);
+extern unsigned int list8051 (struct vm8051 *vm, struct event8051 **events,
+                              unsigned int size);
+extern void relink8051 (struct vm8051 *vm, struct event8051 **events,
+                        unsigned int n, uint32_t now, uint32_t next);
+
+extern void stop8051 (struct vm8051 *vm);
+extern void break8051 (struct vm8051 *vm, uint32_t cycle);
+
+#endif  /* LIB8051SCHED_H */
@@ -0,0 +1,859 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lib8051.h"
+#include "lib8051coprocessors.h"
+#include "lib8051state.h"
+
+#define CHECKPOINT_MAGIC "VM8051K1"
+#define CHECKPOINT_VERSION 2
+
+/* A file holds a chain of checkpoints, one after the other, each a
+   header and its sections in the byte order of the host.  The sections
+   are 8-byte aligned and the XDATA pages 256-byte aligned, so that
+   loading maps the file and copies them straight from it; the scheduled
+   events are then linked back in the wheel.  The table of a checkpoint
+   gives where each page is in the file: a page which has not changed
+   since the previous checkpoint is not stored again, the table points
+   to it in an earlier one. */
+
+struct checkpoint_section
+{
+  uint64_t offset;              /* from the start of the checkpoint */
+  uint64_t len;
+};
+
+struct checkpoint_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t size;                /* of this header */
+  uint64_t len;                 /* of the checkpoint, header included */
+  uint64_t elapsed;             /* cycles since the reset before the first
+                                   checkpoint of the file */
+  uint64_t code;                /* hash of the code of bank */
+  uint32_t bank;
+  uint32_t npages;              /* XDATA pages stored in this checkpoint */
+  struct checkpoint_section core;
+  struct checkpoint_section events;
+  struct checkpoint_section copros;
+  struct checkpoint_section uart;
+  struct checkpoint_section table; /* offset of each page in the file, 0
+                                      if it is all zero */
+  struct checkpoint_section pages;
+};
+
+struct checkpoint_core
+{
+  uint32_t cycles;
+  uint16_t PC;
+  uint8_t IR[4];
+  uint8_t interrupted;
+  uint8_t interrupts_blocked;
+  uint8_t data[256];
+  uint8_t sfr[128];
+  uint32_t timers;
+  uint32_t overflows1;
+  uint32_t now;
+  uint32_t next;
+  uint8_t flags;
+  uint8_t unused[7];
+};
+
+/* a scheduled event, in the order given by list8051 */
+struct checkpoint_event
+{
+  uint32_t id;                  /* index in the events of the vm */
+  uint32_t cycle;
+  uint32_t slot;
+  uint32_t unused;
+};
+
+/* the last checkpoint of a file, to build the next one on */
+struct checkpoint_base
+{
+  const uint8_t *file;
+  uint64_t offset;              /* where the next one goes */
+  uint64_t elapsed;
+  uint32_t cycles;
+  uint64_t table[256];
+};
+
+static uint64_t align (uint64_t offset, uint64_t to)
+{
+  return (offset + to - 1) & ~(to - 1);
+}
+
+/* 64-bit FNV-1a of the code the vm runs */
+static uint64_t hash_code (struct vm8051 *vm)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  uint32_t i;
+
+  for (i = 0; i < 65536; i++)
+    {
+      hash ^= vm->_code[i];
+      hash *= 0x100000001B3ULL;
+    }
+  return hash;
+}
+
+/* the events a checkpoint can name: those of the timers, the breakpoint,
+   the serial port and the coprocessors; return how many */
+static unsigned int vm_events (struct vm8051 *vm, struct event8051 **events)
+{
+  unsigned int n = 2;
+
+  if (events)
+    {
+      events[0] = &vm->sched.overflow;
+      events[1] = &vm->sched.breakpoint;
+    }
+  n += uart_events (vm, events ? events + n : NULL);
+  n += coprocessor_events (vm, events ? events + n : NULL);
+  return n;
+}
+
+static struct event8051 **alloc_events (unsigned int n)
+{
+  struct event8051 **events;
+
+  events = malloc ((n + 1) * sizeof (struct event8051 *));
+  assert (events != NULL);
+  return events;
+}
+
+static int is_zero (const uint8_t *page)
+{
+  unsigned int i;
+
+  for (i = 0; i < 256; i++)
+    if (page[i])
+      return 0;
+  return 1;
+}
+
+/* the checkpoint of vm to be written at base->offset, on top of base if
+   not NULL; NULL on error */
+static uint8_t *build_checkpoint (struct vm8051 *vm,
+                                  const struct checkpoint_base *base,
+                                  uint64_t offset, size_t *len, int *error)
+{
+  struct checkpoint_header header;
+  struct checkpoint_core core;
+  struct checkpoint_event saved;
+  struct event8051 **events, **scheduled;
+  unsigned int nevents, nscheduled, i, id, page;
+  uint64_t table[256];
+  const uint8_t *ram;
+  uint8_t *file;
+  size_t copros, uart;
+  uint64_t size;
+
+  copros = save_coprocessors (vm, NULL);
+  if (copros == SIZE_MAX)
+    {
+      *error = CHECKPOINT_ESTATE;
+      return NULL;
+    }
+  uart = save_uart (vm, NULL);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CHECKPOINT_MAGIC, 8);
+  header.version = CHECKPOINT_VERSION;
+  header.size = sizeof (header);
+  header.elapsed = vm->cycles;
+  if (base)
+    header.elapsed = base->elapsed + (uint32_t) (vm->cycles - base->cycles);
+  header.code = hash_code (vm);
+  header.bank = current_bank (vm);
+  nscheduled = list8051 (vm, NULL, 0);
+
+  size = align (sizeof (header), 8);
+  header.core.offset = size;
+  header.core.len = sizeof (core);
+  size = align (size + header.core.len, 8);
+  header.events.offset = size;
+  header.events.len = (uint64_t) nscheduled * sizeof (saved);
+  size = align (size + header.events.len, 8);
+  header.copros.offset = size;
+  header.copros.len = copros;
+  size = align (size + header.copros.len, 8);
+  header.uart.offset = size;
+  header.uart.len = uart;
+  size = align (size + header.uart.len, 8);
+  header.table.offset = size;
+  header.table.len = sizeof (table);
+  size = align (size + header.table.len, 256);
+  header.pages.offset = size;
+
+  /* the pages which are not in base are stored after the table */
+  for (page = 0; page < 256; page++)
+    {
+      ram = xdata_page (vm, page);
+      if (!ram || is_zero (ram))
+        table[page] = 0;
+      else if (base && base->table[page]
+               && memcmp (base->file + base->table[page], ram, 256) == 0)
+        table[page] = base->table[page];
+      else
+        table[page] = offset + header.pages.offset + 256 * header.npages++;
+    }
+  header.pages.len = (uint64_t) header.npages * 256;
+  header.len = header.pages.offset + header.pages.len;
+
+  file = calloc (1, header.len);
+  assert (file != NULL);
+  memcpy (file, &header, sizeof (header));
+
+  memset (&core, 0, sizeof (core));
+  core.cycles = vm->cycles;
+  core.PC = vm->PC;
+  memcpy (core.IR, vm->IR, 4);
+  core.interrupted = vm->interrupted;
+  core.interrupts_blocked = vm->interrupts_blocked;
+  memcpy (core.data, vm->_data, 256);
+  memcpy (core.sfr, vm->_sfr, 128);
+  core.timers = vm->sched.timers;
+  core.overflows1 = vm->sched.overflows1;
+  core.now = vm->sched.now;
+  core.next = vm->sched.next;
+  core.flags = vm->sched.flags;
+  memcpy (file + header.core.offset, &core, sizeof (core));
+
+  /* events are saved by their place among those of the vm */
+  nevents = vm_events (vm, NULL);
+  events = alloc_events (nevents);
+  vm_events (vm, events);
+  scheduled = alloc_events (nscheduled);
+  list8051 (vm, scheduled, nscheduled);
+  *error = CHECKPOINT_OK;
+  for (i = 0; i < nscheduled; i++)
+    {
+      for (id = 0; id < nevents && events[id] != scheduled[i]; id++)
+        continue;
+      /* scheduled by someone else */
+      if (id == nevents)
+        *error = CHECKPOINT_ESTATE;
+      memset (&saved, 0, sizeof (saved));
+      saved.id = id;
+      saved.cycle = scheduled[i]->cycle;
+      saved.slot = scheduled[i]->slot;
+      memcpy (file + header.events.offset + i * sizeof (saved), &saved,
+              sizeof (saved));
+    }
+  free (scheduled);
+  free (events);
+  if (*error != CHECKPOINT_OK)
+    {
+      free (file);
+      return NULL;
+    }
+
+  save_coprocessors (vm, file + header.copros.offset);
+  save_uart (vm, file + header.uart.offset);
+  memcpy (file + header.table.offset, table, sizeof (table));
+  for (page = 0; page < 256; page++)
+    if (table[page] && table[page] >= offset)
+      memcpy (file + (table[page] - offset), xdata_page (vm, page), 256);
+  *len = header.len;
+  return file;
+}
+
+static int in_checkpoint (const struct checkpoint_section *section,
+                          uint64_t len)
+{
+  return section->offset <= len && section->len <= len - section->offset;
+}
+
+/* read the header of the checkpoint at offset, return 0 if there is none
+   or it does not fit in the size bytes of file */
+static int read_header (const uint8_t *file, size_t size, uint64_t offset,
+                        struct checkpoint_header *header)
+{
+  if (offset > size || size - offset < sizeof (struct checkpoint_header))
+    return 0;
+  memcpy (header, file + offset, sizeof (struct checkpoint_header));
+  return memcmp (header->magic, CHECKPOINT_MAGIC, 8) == 0
+    && header->version == CHECKPOINT_VERSION
+    && header->size == sizeof (struct checkpoint_header)
+    && header->len <= size - offset
+    && in_checkpoint (&header->core, header->len)
+    && in_checkpoint (&header->events, header->len)
+    && in_checkpoint (&header->copros, header->len)
+    && in_checkpoint (&header->uart, header->len)
+    && in_checkpoint (&header->table, header->len)
+    && in_checkpoint (&header->pages, header->len)
+    && header->core.len == sizeof (struct checkpoint_core)
+    && header->events.len % sizeof (struct checkpoint_event) == 0
+    && header->table.len == 256 * sizeof (uint64_t)
+    && header->pages.len == (uint64_t) header->npages * 256;
+}
+
+/* the last checkpoint of the file taken at or before cycle, at *offset;
+   return 0 if there is none */
+static int find_checkpoint (const uint8_t *file, size_t size, uint64_t cycle,
+                            uint64_t *offset, struct checkpoint_header *last)
+{
+  struct checkpoint_header header;
+  uint64_t at = 0;
+  int found = 0;
+
+  while (read_header (file, size, at, &header))
+    {
+      if (header.elapsed > cycle)
+        break;
+      *offset = at;
+      *last = header;
+      found = 1;
+      at += header.len;
+    }
+  return found;
+}
+
+/* whether the entries of table are pages of the file before end */
+static int valid_table (const uint64_t *table, uint64_t end)
+{
+  unsigned int page;
+
+  for (page = 0; page < 256; page++)
+    if (table[page] && (table[page] > end || end - table[page] < 256))
+      return 0;
+  return 1;
+}
+
+/* load the checkpoint at offset in file */
+static int load_checkpoint (struct vm8051 *vm, const uint8_t *file,
+                            uint64_t offset,
+                            const struct checkpoint_header *header)
+{
+  const uint8_t *start = file + offset;
+  struct checkpoint_core core;
+  struct checkpoint_event saved;
+  struct event8051 **events, **scheduled;
+  unsigned int nevents, nscheduled, i, page;
+  uint64_t table[256];
+  uint8_t *seen;
+  int ret = CHECKPOINT_OK;
+
+  memcpy (table, start + header->table.offset, sizeof (table));
+  if (!valid_table (table, offset + header->len))
+    return CHECKPOINT_EFORMAT;
+
+  reset8051 (vm);
+  if (!load_banks (vm, header->bank))
+    return CHECKPOINT_ECONFIG;
+  if (hash_code (vm) != header->code)
+    return CHECKPOINT_ECODE;
+  if (!load_coprocessors (vm, start + header->copros.offset,
+                          header->copros.len)
+      || !load_uart (vm, start + header->uart.offset, header->uart.len))
+    return CHECKPOINT_ECONFIG;
+
+  memcpy (&core, start + header->core.offset, sizeof (core));
+  vm->cycles = core.cycles;
+  vm->PC = core.PC;
+  memcpy (vm->IR, core.IR, 4);
+  vm->interrupted = core.interrupted;
+  vm->interrupts_blocked = core.interrupts_blocked;
+  memcpy (vm->_data, core.data, 256);
+  memcpy (vm->_sfr, core.sfr, 128);
+  vm->sched.timers = core.timers;
+  vm->sched.overflows1 = core.overflows1;
+  vm->sched.flags = core.flags;
+
+  for (page = 0; page < 256; page++)
+    if (table[page])
+      memcpy (alloc_xdata_page (vm, page), file + table[page], 256);
+
+  nevents = vm_events (vm, NULL);
+  events = alloc_events (nevents);
+  vm_events (vm, events);
+  nscheduled = header->events.len / sizeof (saved);
+  scheduled = alloc_events (nscheduled);
+  seen = calloc (nevents + 1, 1);
+  assert (seen != NULL);
+  for (i = 0; i < nscheduled; i++)
+    {
+      memcpy (&saved, start + header->events.offset + i * sizeof (saved),
+              sizeof (saved));
+      if (saved.id >= nevents || seen[saved.id]
+          || saved.slot >= SCHED_LEVELS * SCHED_SLOTS)
+        {
+          ret = CHECKPOINT_ECONFIG;
+          break;
+        }
+      seen[saved.id] = 1;
+      scheduled[i] = events[saved.id];
+      scheduled[i]->cycle = saved.cycle;
+      scheduled[i]->slot = saved.slot;
+    }
+  /* the slots only hold what was saved, cancel what reset8051 scheduled */
+  if (ret == CHECKPOINT_OK)
+    relink8051 (vm, scheduled, nscheduled, core.now, core.next);
+  free (seen);
+  free (scheduled);
+  free (events);
+  return ret;
+}
+
+/* map the whole file at path, NULL if it cannot be */
+static const uint8_t *map_checkpoint (const char *path, size_t *size,
+                                      int *error)
+{
+  struct stat st;
+  void *file;
+  int fd;
+
+  *error = CHECKPOINT_EOPEN;
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) != 0)
+    {
+      close (fd);
+      return NULL;
+    }
+  if (!S_ISREG (st.st_mode) || st.st_size < (off_t) sizeof (struct
+                                                         checkpoint_header))
+    {
+      close (fd);
+      *error = CHECKPOINT_EFORMAT;
+      return NULL;
+    }
+  file = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (file == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+  *error = CHECKPOINT_OK;
+  return file;
+}
+
+/* write the len bytes of checkpoint at offset in path, through a
+   temporary file for a whole new file so that path is whole or not
+   there */
+static int write_checkpoint (const char *path, const uint8_t *checkpoint,
+                             size_t len, uint64_t offset)
+{
+  FILE *stream;
+  char *tmp = NULL;
+  int ok, error;
+
+  if (offset == 0)
+    {
+      tmp = malloc (strlen (path) + 32);
+      assert (tmp != NULL);
+      sprintf (tmp, "%s.%ld", path, (long) getpid ());
+      stream = fopen (tmp, "wb");
+    }
+  else
+    stream = fopen (path, "r+b");
+  if (stream == NULL)
+    {
+      free (tmp);
+      return CHECKPOINT_EOPEN;
+    }
+  ok = (offset == 0 || fseek (stream, offset, SEEK_SET) == 0)
+    && fwrite (checkpoint, 1, len, stream) == len;
+  ok = fclose (stream) == 0 && ok;
+  if (!tmp)
+    return ok ? CHECKPOINT_OK : CHECKPOINT_EOPEN;
+  if (ok && rename (tmp, path) == 0)
+    {
+      free (tmp);
+      return CHECKPOINT_OK;
+    }
+  error = errno;
+  remove (tmp);
+  free (tmp);
+  errno = error;
+  return CHECKPOINT_EOPEN;
+}
+
+/* save the state of vm at an instruction boundary, sim8051 not running
+   and the host not using the serial port, as the only checkpoint of
+   path */
+int save8051 (struct vm8051 *vm, const char *path)
+{
+  uint8_t *checkpoint;
+  size_t len;
+  int ret;
+
+  checkpoint = build_checkpoint (vm, NULL, 0, &len, &ret);
+  if (checkpoint == NULL)
+    return ret;
+  ret = write_checkpoint (path, checkpoint, len, 0);
+  free (checkpoint);
+  return ret;
+}
+
+/* the checkpoint of vm to add to the chain in the size bytes of file,
+   at *offset; NULL on error */
+static uint8_t *next_checkpoint (struct vm8051 *vm, const uint8_t *file,
+                                 size_t size, uint64_t *offset, size_t *len,
+                                 int *error)
+{
+  struct checkpoint_header header;
+  struct checkpoint_base base;
+
+  *offset = 0;
+  if (size == 0)
+    return build_checkpoint (vm, NULL, 0, len, error);
+  *error = CHECKPOINT_EFORMAT;
+  if (!find_checkpoint (file, size, UINT64_MAX, &base.offset, &header))
+    return NULL;
+  base.file = file;
+  memcpy (base.table, file + base.offset + header.table.offset,
+          sizeof (base.table));
+  if (!valid_table (base.table, base.offset + header.len))
+    return NULL;
+  base.elapsed = header.elapsed;
+  memcpy (&base.cycles, file + base.offset + header.core.offset,
+          sizeof (uint32_t));
+  base.offset += header.len;
+  *offset = base.offset;
+  *error = CHECKPOINT_ECODE;
+  /* the code can only be compared in the bank it was hashed in */
+  if (header.code != hash_code (vm) && header.bank == current_bank (vm))
+    return NULL;
+  return build_checkpoint (vm, &base, base.offset, len, error);
+}
+
+/* add a checkpoint of vm at the end of the chain in path, or start it;
+   only the XDATA pages which changed since the last checkpoint of the
+   chain are stored, its cycles are counted from there */
+int append8051 (struct vm8051 *vm, const char *path)
+{
+  const uint8_t *file;
+  uint8_t *checkpoint;
+  uint64_t offset;
+  size_t size, len;
+  int ret;
+
+  file = map_checkpoint (path, &size, &ret);
+  if (file == NULL && ret == CHECKPOINT_EOPEN && errno == ENOENT)
+    return save8051 (vm, path);
+  if (file == NULL)
+    return ret;
+  checkpoint = next_checkpoint (vm, file, size, &offset, &len, &ret);
+  munmap ((void *) file, size);
+  if (checkpoint == NULL)
+    return ret;
+  ret = write_checkpoint (path, checkpoint, len, offset);
+  free (checkpoint);
+  return ret;
+}
+
+/* set vm to the last checkpoint of path taken at or before cycle, counted
+   as in the chain; it is reset first */
+int rewind8051 (struct vm8051 *vm, const char *path, uint64_t cycle)
+{
+  struct checkpoint_header header;
+  const uint8_t *file;
+  uint64_t offset;
+  size_t size;
+  int ret;
+
+  file = map_checkpoint (path, &size, &ret);
+  if (file == NULL)
+    return ret;
+  if (find_checkpoint (file, size, cycle, &offset, &header))
+    ret = load_checkpoint (vm, file, offset, &header);
+  else if (read_header (file, size, 0, &header))
+    ret = CHECKPOINT_ECYCLE;
+  else
+    ret = CHECKPOINT_EFORMAT;
+  munmap ((void *) file, size);
+  return ret;
+}
+
+/* set vm to the last checkpoint of path; it is reset first */
+int load8051 (struct vm8051 *vm, const char *path)
+{
+  return rewind8051 (vm, path, UINT64_MAX);
+}
+
+/* add a checkpoint of vm at the end of chain, as append8051 does in a
+   file; cycle, if not NULL, is set to its cycle in the chain */
+int push8051 (struct vm8051 *vm, struct chain8051 *chain, uint64_t *cycle)
+{
+  struct checkpoint_header header;
+  uint8_t *checkpoint;
+  uint64_t offset;
+  size_t len;
+  int ret;
+
+  checkpoint = next_checkpoint (vm, chain->data, chain->len, &offset, &len,
+                                &ret);
+  if (checkpoint == NULL)
+    return ret;
+  if (offset + len > chain->size)
+    {
+      chain->size = chain->size ? 2 * chain->size : 65536;
+      if (chain->size < offset + len)
+        chain->size = offset + len;
+      chain->data = realloc (chain->data, chain->size);
+      assert (chain->data != NULL);
+    }
+  memcpy (chain->data + offset, checkpoint, len);
+  chain->len = offset + len;
+  memcpy (&header, checkpoint, sizeof (header));
+  if (cycle)
+    *cycle = header.elapsed;
+  free (checkpoint);
+  return CHECKPOINT_OK;
+}
+
+/* set vm to the last checkpoint of chain taken at or before *cycle, and
+   *cycle to when it was taken; it is reset first */
+int seek8051 (struct vm8051 *vm, const struct chain8051 *chain,
+              uint64_t *cycle)
+{
+  struct checkpoint_header header;
+  uint64_t offset;
+
+  if (chain->len == 0)
+    return CHECKPOINT_EFORMAT;
+  if (!find_checkpoint (chain->data, chain->len, *cycle, &offset, &header))
+    return CHECKPOINT_ECYCLE;
+  *cycle = header.elapsed;
+  return load_checkpoint (vm, chain->data, offset, &header);
+}
+
+/* drop the checkpoints of chain taken after cycle */
+void cut8051 (struct chain8051 *chain, uint64_t cycle)
+{
+  struct checkpoint_header header;
+  uint64_t offset;
+
+  if (chain->len == 0)
+    return;
+  if (!find_checkpoint (chain->data, chain->len, cycle, &offset, &header))
+    chain->len = 0;
+  else
+    chain->len = offset + header.len;
+}
+
+/* the cycles when the first n checkpoints of chain were taken, in at;
+   return how many checkpoints chain holds */
+size_t checkpoints8051 (const struct chain8051 *chain, uint64_t *at,
+                        size_t n)
+{
+  struct checkpoint_header header;
+  uint64_t offset = 0;
+  size_t count = 0;
+
+  while (read_header (chain->data, chain->len, offset, &header))
+    {
+      if (count < n)
+        at[count] = header.elapsed;
+      count++;
+      offset += header.len;
+    }
+  return count;
+}
+
+void free_chain8051 (struct chain8051 *chain)
+{
+  free (chain->data);
+  chain->data = NULL;
+  chain->len = 0;
+  chain->size = 0;
+}
+
+/* a state of a vm kept in memory, to set the same vm back to it */
+struct snapshot8051
+{
+  struct checkpoint_core core;
+  unsigned int bank;
+  struct event8051 **events;    /* scheduled, as list8051 gave them */
+  uint32_t *at;                 /* their cycle */
+  unsigned int *slots;
+  unsigned int nevents;
+  uint8_t *copros;
+  size_t copros_len;
+  uint8_t *uart;
+  size_t uart_len;
+  uint8_t *ram;                 /* the pages which are not all zero */
+  uint8_t *pages[256];          /* where each of them is, NULL for none */
+};
+
+/* take a snapshot of vm in *snapshot, to be freed with
+   free_snapshot8051 */
+int snapshot8051 (struct vm8051 *vm, struct snapshot8051 **snapshot)
+{
+  struct snapshot8051 *s;
+  unsigned int i, page, npages = 0;
+  const uint8_t *ram;
+  size_t copros;
+
+  copros = save_coprocessors (vm, NULL);
+  if (copros == SIZE_MAX)
+    return CHECKPOINT_ESTATE;
+  s = calloc (1, sizeof (struct snapshot8051));
+  assert (s != NULL);
+
+  s->core.cycles = vm->cycles;
+  s->core.PC = vm->PC;
+  memcpy (s->core.IR, vm->IR, 4);
+  s->core.interrupted = vm->interrupted;
+  s->core.interrupts_blocked = vm->interrupts_blocked;
+  memcpy (s->core.data, vm->_data, 256);
+  memcpy (s->core.sfr, vm->_sfr, 128);
+  s->core.timers = vm->sched.timers;
+  s->core.overflows1 = vm->sched.overflows1;
+  s->core.now = vm->sched.now;
+  s->core.next = vm->sched.next;
+  s->core.flags = vm->sched.flags;
+  s->bank = current_bank (vm);
+
+  s->nevents = list8051 (vm, NULL, 0);
+  s->events = alloc_events (s->nevents);
+  s->at = malloc ((s->nevents + 1) * sizeof (uint32_t));
+  s->slots = malloc ((s->nevents + 1) * sizeof (unsigned int));
+  assert (s->at != NULL && s->slots != NULL);
+  list8051 (vm, s->events, s->nevents);
+  for (i = 0; i < s->nevents; i++)
+    {
+      s->at[i] = s->events[i]->cycle;
+      s->slots[i] = s->events[i]->slot;
+    }
+
+  s->copros_len = copros;
+  s->copros = malloc (copros + 1);
+  assert (s->copros != NULL);
+  save_coprocessors (vm, s->copros);
+  s->uart_len = save_uart (vm, NULL);
+  s->uart = malloc (s->uart_len + 1);
+  assert (s->uart != NULL);
+  save_uart (vm, s->uart);
+
+  for (page = 0; page < 256; page++)
+    {
+      ram = xdata_page (vm, page);
+      if (ram && !is_zero (ram))
+        npages++;
+    }
+  s->ram = malloc (npages * 256 + 1);
+  assert (s->ram != NULL);
+  npages = 0;
+  for (page = 0; page < 256; page++)
+    {
+      ram = xdata_page (vm, page);
+      if (ram && !is_zero (ram))
+        {
+          s->pages[page] = s->ram + 256 * npages++;
+          memcpy (s->pages[page], ram, 256);
+        }
+    }
+
+  *snapshot = s;
+  return CHECKPOINT_OK;
+}
+
+/* set vm back to snapshot, taken of this vm; the code, the peripherals
+   and the coprocessors must not have been set up otherwise since */
+void restore8051 (struct vm8051 *vm, const struct snapshot8051 *snapshot)
+{
+  const struct checkpoint_core *core = &snapshot->core;
+  unsigned int i, page;
+  uint8_t *ram;
+  int ok;
+
+  ok = load_banks (vm, snapshot->bank)
+    && load_coprocessors (vm, snapshot->copros, snapshot->copros_len)
+    && load_uart (vm, snapshot->uart, snapshot->uart_len);
+  assert (ok);
+  (void) ok;
+
+  vm->cycles = core->cycles;
+  vm->PC = core->PC;
+  memcpy (vm->IR, core->IR, 4);
+  vm->interrupted = core->interrupted;
+  vm->interrupts_blocked = core->interrupts_blocked;
+  memcpy (vm->_data, core->data, 256);
+  memcpy (vm->_sfr, core->sfr, 128);
+  vm->sched.timers = core->timers;
+  vm->sched.overflows1 = core->overflows1;
+  vm->sched.flags = core->flags;
+  vm->sched.stop = 0;
+
+  /* the pages written since are zeroed, not freed */
+  for (page = 0; page < 256; page++)
+    if (snapshot->pages[page])
+      memcpy (alloc_xdata_page (vm, page), snapshot->pages[page], 256);
+    else if ((ram = xdata_page (vm, page)))
+      memset (ram, 0, 256);
+
+  /* the events are unlinked from their slot before they get the one they
+     had back */
+  clear8051 (vm);
+  for (i = 0; i < snapshot->nevents; i++)
+    {
+      snapshot->events[i]->cycle = snapshot->at[i];
+      snapshot->events[i]->slot = snapshot->slots[i];
+    }
+  relink8051 (vm, snapshot->events, snapshot->nevents, core->now,
+              core->next);
+}
+
+void free_snapshot8051 (struct snapshot8051 *snapshot)
+{
+  if (snapshot == NULL)
+    return;
+  free (snapshot->events);
+  free (snapshot->at);
+  free (snapshot->slots);
+  free (snapshot->copros);
+  free (snapshot->uart);
+  free (snapshot->ram);
+  free (snapshot);
+}
+
+const char *checkpoint_strerror (int error)
+{
+  switch (error)
+    {
+    case CHECKPOINT_OK:
+      return "no error";
+    case CHECKPOINT_EOPEN:
+      return strerror (errno);
+    case CHECKPOINT_EFORMAT:
+      return "not a checkpoint of this version";
+    case CHECKPOINT_ECODE:
+      return "checkpoint of another program";
+    case CHECKPOINT_ECONFIG:
+      return "checkpoint of a vm set up otherwise";
+    case CHECKPOINT_ESTATE:
+      return "state which cannot be saved";
+    case CHECKPOINT_ECYCLE:
+      return "no checkpoint that early";
+    }
+  return "unknown error";
+}
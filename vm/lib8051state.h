@@ -0,0 +1,84 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051STATE_H
+#define LIB8051STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct vm8051;
+struct snapshot8051;
+
+/* A checkpoint keeps the state of a vm in a file: the registers, the
+   internal memory and the SFRs, the XDATA pages which are not all zero,
+   the contents of the coprocessors, the bytes in the serial port and the
+   scheduled events.  The code, the XDATA peripherals and the host side of
+   the serial port are not kept: a checkpoint is loaded in a vm set up as
+   the one saved, with the same program, coprocessors and serial port, and
+   is refused otherwise.  After an error, load8051 leaves the vm to be
+   reset before it runs again.
+
+   A file can also hold a chain of checkpoints of a long run, each added
+   by append8051 at the end of the previous ones and storing only the
+   XDATA pages which changed since the last one; the cycles of a chain
+   count on from its first checkpoint, without wrapping around.  Any of
+   them is loaded with rewind8051 as fast as the first one.  A chain can
+   be kept in memory as well, laid out as in a file, starting from a
+   zeroed struct chain8051.
+
+   A snapshot keeps the same state in memory, to set the vm it was taken
+   of back to it as often as needed, much faster than loading a
+   checkpoint: nothing is checked or reset, the scheduled events are
+   linked back as they were, and the XDATA pages written since are
+   zeroed, which is cheapest with sparse XDATA. */
+
+/* errors of the functions below */
+#define CHECKPOINT_OK 0
+#define CHECKPOINT_EOPEN 1      /* see errno */
+#define CHECKPOINT_EFORMAT 2    /* not a checkpoint of this version */
+#define CHECKPOINT_ECODE 3      /* of another program */
+#define CHECKPOINT_ECONFIG 4    /* of a vm set up otherwise */
+#define CHECKPOINT_ESTATE 5     /* what is running cannot be saved */
+#define CHECKPOINT_ECYCLE 6     /* no checkpoint that early */
+
+struct chain8051
+{
+  uint8_t *data;
+  size_t len;                   /* of the checkpoints */
+  size_t size;                  /* of data */
+};
+
+extern int save8051 (struct vm8051 *vm, const char *path);
+extern int load8051 (struct vm8051 *vm, const char *path);
+extern int append8051 (struct vm8051 *vm, const char *path);
+extern int rewind8051 (struct vm8051 *vm, const char *path, uint64_t cycle);
+extern int push8051 (struct vm8051 *vm, struct chain8051 *chain,
+                     uint64_t *cycle);
+extern int seek8051 (struct vm8051 *vm, const struct chain8051 *chain,
+                     uint64_t *cycle);
+extern void cut8051 (struct chain8051 *chain, uint64_t cycle);
+extern size_t checkpoints8051 (const struct chain8051 *chain, uint64_t *at,
+                               size_t n);
+extern void free_chain8051 (struct chain8051 *chain);
+extern int snapshot8051 (struct vm8051 *vm, struct snapshot8051 **snapshot);
+extern void restore8051 (struct vm8051 *vm,
+                         const struct snapshot8051 *snapshot);
+extern void free_snapshot8051 (struct snapshot8051 *snapshot);
+extern const char *checkpoint_strerror (int error);
+
+#endif  /* LIB8051STATE_H */
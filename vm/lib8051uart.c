@@ -0,0 +1,605 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051uart.h"
+
+/* simulate global variables for a struct vm8051 *vm */
+#include "lib8051globals.h"
+
+/* ring of bytes with one producer and one consumer */
+struct ring8051
+{
+  uint8_t *data;
+  size_t mask;                  /* size - 1, size being a power of 2 */
+  size_t head;                  /* written by the producer only */
+  size_t tail;                  /* written by the consumer only */
+};
+
+/* a byte being shifted out or in */
+struct frame8051
+{
+  int busy;
+  int timer1;                   /* end counted in Timer1 overflows, else
+                                   in cycles */
+  uint32_t end;
+  uint8_t byte;
+  struct event8051 event;
+};
+
+struct uart8051
+{
+  struct ring8051 rx;           /* from the host to the vm */
+  struct ring8051 tx;           /* from the vm to the host */
+  int rx_fd;                    /* -1 if not bound */
+  int tx_fd;
+  struct frame8051 sending;
+  struct frame8051 receiving;
+  int held;                     /* byte sent, waiting for room in tx */
+  int pending;                  /* byte received, waiting for RI clear */
+  uint8_t received;             /* receive buffer, read through SBUF */
+  int watch;                    /* stop sim8051 after each byte sent */
+  struct event8051 event;
+};
+
+/* what a checkpoint keeps of a frame */
+struct frame_state8051
+{
+  uint32_t end;
+  uint8_t busy;
+  uint8_t timer1;
+  uint8_t byte;
+  uint8_t unused;
+};
+
+/* what a checkpoint keeps of the serial port, followed by the bytes
+   waiting in rx, then in tx */
+struct uart_state8051
+{
+  uint64_t rx;
+  uint64_t tx;
+  struct frame_state8051 sending;
+  struct frame_state8051 receiving;
+  uint8_t held;
+  uint8_t pending;
+  uint8_t received;
+  uint8_t unused[5];
+};
+
+static void init_ring (struct ring8051 *ring, size_t size)
+{
+  size_t n = 1;
+
+  while (n < size)
+    n <<= 1;
+  ring->data = malloc (n);
+  assert (ring->data != NULL);
+  ring->mask = n - 1;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/* contiguous room for the producer */
+static size_t ring_room (struct ring8051 *ring, uint8_t **start)
+{
+  size_t tail, room, end;
+
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  room = ring->mask + 1 - (ring->head - tail);
+  end = ring->mask + 1 - (ring->head & ring->mask);
+  *start = ring->data + (ring->head & ring->mask);
+  return room < end ? room : end;
+}
+
+static void ring_produce (struct ring8051 *ring, size_t n)
+{
+  __atomic_store_n (&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+/* contiguous bytes for the consumer */
+static size_t ring_used (struct ring8051 *ring, uint8_t **start)
+{
+  size_t head, used, end;
+
+  head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  used = head - ring->tail;
+  end = ring->mask + 1 - (ring->tail & ring->mask);
+  *start = ring->data + (ring->tail & ring->mask);
+  return used < end ? used : end;
+}
+
+static void ring_consume (struct ring8051 *ring, size_t n)
+{
+  __atomic_store_n (&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+}
+
+static size_t ring_push (struct ring8051 *ring, const uint8_t *data,
+                         size_t len)
+{
+  uint8_t *start;
+  size_t done = 0, n;
+
+  while (done < len && (n = ring_room (ring, &start)))
+    {
+      if (n > len - done)
+        n = len - done;
+      memcpy (start, data + done, n);
+      ring_produce (ring, n);
+      done += n;
+    }
+  return done;
+}
+
+static size_t ring_pop (struct ring8051 *ring, uint8_t *data, size_t len)
+{
+  uint8_t *start;
+  size_t done = 0, n;
+
+  while (done < len && (n = ring_used (ring, &start)))
+    {
+      if (n > len - done)
+        n = len - done;
+      memcpy (data + done, start, n);
+      ring_consume (ring, n);
+      done += n;
+    }
+  return done;
+}
+
+/* copy the bytes of the ring without consuming them, return how many */
+static size_t ring_peek (struct ring8051 *ring, uint8_t *data)
+{
+  size_t head, i, n;
+
+  head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  n = head - ring->tail;
+  if (data)
+    for (i = 0; i < n; i++)
+      data[i] = ring->data[(ring->tail + i) & ring->mask];
+  return n;
+}
+
+/* Frames are timed as on the chip: in mode 0 a bit lasts a cycle, in
+   mode 2 64 or 32 oscillator periods depending on SMOD, and in modes 1
+   and 3 32 or 16 Timer1 overflows.  TI is set at the start of the stop
+   bit, RI in its middle; length is in half bits. */
+
+static void schedule_frame (struct vm8051 *vm, struct frame8051 *frame)
+{
+  uint32_t wait;
+  int32_t left;
+
+  if (!frame->timer1)
+    {
+      schedule8051 (vm, &frame->event, frame->end);
+      return;
+    }
+  left = frame->end - vm->sched.overflows1;
+  wait = timer1_cycles (vm, left > 0 ? (uint32_t) left : 0);
+  /* Timer1 is stopped, look again later */
+  if (wait == UINT32_MAX)
+    wait = UART_POLL;
+  schedule8051 (vm, &frame->event, cycles + wait);
+}
+
+static void start_frame (struct vm8051 *vm, struct frame8051 *frame,
+                         uint32_t length)
+{
+  sync8051 (vm);
+  frame->busy = 1;
+  frame->timer1 = 0;
+  switch (SCON >> 6)
+    {
+    case 0:
+      frame->end = cycles + 8;
+      break;
+    case 2:
+      /* 12 oscillator periods per cycle, rounded up */
+      frame->end = cycles + (length * (32 >> SMOD) + 11) / 12;
+      break;
+    default:
+      frame->timer1 = 1;
+      frame->end = vm->sched.overflows1 + length * (16 >> SMOD);
+      break;
+    }
+  schedule_frame (vm, frame);
+}
+
+/* has the frame reached its end, else schedule it again */
+static int end_frame (struct vm8051 *vm, struct frame8051 *frame)
+{
+  if (frame->timer1 ? (int32_t) (vm->sched.overflows1 - frame->end) < 0
+      : BEFORE (cycles, frame->end))
+    {
+      schedule_frame (vm, frame);
+      return 0;
+    }
+  frame->busy = 0;
+  return 1;
+}
+
+/* start receiving the next byte from the host when the receiver is free,
+   and give the received byte to the program once RI is clear */
+static void receive (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+  uint8_t *start;
+
+  if (uart->pending && !RI)
+    {
+      uart->pending = 0;
+      uart->received = uart->receiving.byte;
+      SBUF = uart->received;
+      SCON |= RI_MASK;
+      vm->sched.flags |= SCHED_INTERRUPTS;
+    }
+  /* in mode 0, clearing RI starts the reception */
+  if (uart->receiving.busy || uart->pending || !REN
+      || (!(SCON >> 6) && RI) || !ring_used (&uart->rx, &start))
+    return;
+  uart->receiving.byte = *start;
+  ring_consume (&uart->rx, 1);
+  start_frame (vm, &uart->receiving, (SCON >> 6) == 1 ? 19 : 21);
+}
+
+/* hand the byte sent over to the host, TI is set once there is room for
+   it */
+static void send (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+
+  if (!uart->held)
+    return;
+  if (!ring_push (&uart->tx, &uart->sending.byte, 1))
+    {
+      if (uart->tx_fd < 0)
+        return;
+      pump_uart (vm);
+      if (!ring_push (&uart->tx, &uart->sending.byte, 1))
+        return;
+    }
+  uart->held = 0;
+  SCON |= TI_MASK;
+  vm->sched.flags |= SCHED_INTERRUPTS;
+  if (uart->watch)
+    stop8051 (vm);
+}
+
+/* look at the host side again later if the vm waits for it */
+static void poll_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+  uint8_t *start;
+
+  if (uart->event.prev)
+    return;
+  if (uart->held
+      || (REN && !uart->receiving.busy && !uart->pending)
+      || (uart->tx_fd >= 0 && ring_used (&uart->tx, &start)))
+    schedule8051 (vm, &uart->event, cycles + UART_POLL);
+}
+
+static void fire_uart (struct vm8051 *vm, struct event8051 *event)
+{
+  (void) event;
+  pump_uart (vm);
+  send (vm);
+  receive (vm);
+  poll_uart (vm);
+}
+
+static void fire_sending (struct vm8051 *vm, struct event8051 *event)
+{
+  (void) event;
+  if (!end_frame (vm, &vm->uart->sending))
+    return;
+  vm->uart->held = 1;
+  send (vm);
+  poll_uart (vm);
+}
+
+static void fire_receiving (struct vm8051 *vm, struct event8051 *event)
+{
+  (void) event;
+  if (!end_frame (vm, &vm->uart->receiving))
+    return;
+  vm->uart->pending = 1;
+  receive (vm);
+  poll_uart (vm);
+}
+
+/* give the vm a serial port whose rings hold size bytes each */
+void add_uart (struct vm8051 *vm, size_t size)
+{
+  struct uart8051 *uart;
+
+  assert (vm->uart == NULL && size > 0);
+  uart = calloc (1, sizeof (struct uart8051));
+  assert (uart != NULL);
+  init_ring (&uart->rx, size);
+  init_ring (&uart->tx, size);
+  uart->rx_fd = -1;
+  uart->tx_fd = -1;
+  uart->event.fire = fire_uart;
+  uart->sending.event.fire = fire_sending;
+  uart->receiving.event.fire = fire_receiving;
+  vm->uart = uart;
+}
+
+/* receive what is read from rx_fd and write what is transmitted to tx_fd,
+   -1 for none; they are made non-blocking */
+void bind_uart (struct vm8051 *vm, int rx_fd, int tx_fd)
+{
+  struct uart8051 *uart = vm->uart;
+
+  assert (uart != NULL);
+  if (rx_fd >= 0)
+    fcntl (rx_fd, F_SETFL, fcntl (rx_fd, F_GETFL) | O_NONBLOCK);
+  if (tx_fd >= 0)
+    fcntl (tx_fd, F_SETFL, fcntl (tx_fd, F_GETFL) | O_NONBLOCK);
+  uart->rx_fd = rx_fd;
+  uart->tx_fd = tx_fd;
+}
+
+/* if watch is nonzero, stop sim8051 as soon as a byte is transmitted, for
+   the host to look at the output at the cycle it came out */
+void watch_uart (struct vm8051 *vm, int watch)
+{
+  assert (vm->uart != NULL);
+  vm->uart->watch = watch;
+}
+
+/* queue len bytes to be received by the vm, return how many fit */
+size_t write_uart (struct vm8051 *vm, const uint8_t *data, size_t len)
+{
+  return ring_push (&vm->uart->rx, data, len);
+}
+
+/* take at most len bytes transmitted by the vm, return how many */
+size_t read_uart (struct vm8051 *vm, uint8_t *data, size_t len)
+{
+  return ring_pop (&vm->uart->tx, data, len);
+}
+
+/* whether the program took all the bytes written for it: none is left
+   in rx, on the line or in SBUF with RI set */
+int drained_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+  uint8_t *start;
+
+  return !ring_used (&uart->rx, &start) && !uart->receiving.busy
+    && !uart->pending && !RI;
+}
+
+/* move what the bound file descriptors can take without blocking, return
+   non-zero while transmitted bytes are left for tx_fd */
+int pump_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+  uint8_t *start;
+  ssize_t ret;
+  size_t n;
+
+  while (uart->rx_fd >= 0 && (n = ring_room (&uart->rx, &start)))
+    {
+      ret = read (uart->rx_fd, start, n);
+      if (ret > 0)
+        {
+          ring_produce (&uart->rx, ret);
+          continue;
+        }
+      /* end of file or error, nothing more will come */
+      if (ret == 0 || (errno != EAGAIN && errno != EINTR))
+        uart->rx_fd = -1;
+      break;
+    }
+
+  if (uart->tx_fd < 0)
+    return 0;
+  while ((n = ring_used (&uart->tx, &start)))
+    {
+      ret = write (uart->tx_fd, start, n);
+      if (ret > 0)
+        {
+          ring_consume (&uart->tx, ret);
+          continue;
+        }
+      if (ret < 0 && errno != EAGAIN && errno != EINTR)
+        uart->tx_fd = -1;
+      break;
+    }
+  return uart->tx_fd >= 0 && n > 0;
+}
+
+/* drop the bytes in both directions, the vm must not be running */
+void clear_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+
+  uart->rx.tail = uart->rx.head;
+  uart->tx.tail = uart->tx.head;
+}
+
+void free_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+
+  if (!uart)
+    return;
+  cancel8051 (vm, &uart->event);
+  cancel8051 (vm, &uart->sending.event);
+  cancel8051 (vm, &uart->receiving.event);
+  free (uart->rx.data);
+  free (uart->tx.data);
+  free (uart);
+  vm->uart = NULL;
+}
+
+/* the program wrote to SBUF, which still reads as the receive buffer;
+   a byte still being sent is lost */
+void transmit_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+
+  if (!uart)
+    {
+      SCON |= TI_MASK;
+      return;
+    }
+  uart->sending.byte = SBUF;
+  uart->held = 0;
+  SBUF = uart->received;
+  start_frame (vm, &uart->sending, (SCON >> 6) == 1 ? 18 : 20);
+}
+
+/* the vm is about to run, the host may have written meanwhile */
+void enter_uart (struct vm8051 *vm)
+{
+  if (!vm->uart)
+    return;
+  receive (vm);
+  poll_uart (vm);
+}
+
+/* the program wrote to SCON */
+void notify_uart (struct vm8051 *vm)
+{
+  if (vm->uart)
+    schedule8051 (vm, &vm->uart->event, cycles);
+}
+
+/* Timer1 or SMOD changed, the frames it clocks end at another cycle */
+void retime_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+
+  if (!uart)
+    return;
+  if (uart->sending.busy && uart->sending.timer1)
+    schedule_frame (vm, &uart->sending);
+  if (uart->receiving.busy && uart->receiving.timer1)
+    schedule_frame (vm, &uart->receiving);
+}
+
+/* the bytes on the line are lost, the rings are kept */
+void reset_uart (struct vm8051 *vm)
+{
+  struct uart8051 *uart = vm->uart;
+
+  if (!uart)
+    return;
+  uart->sending.busy = 0;
+  uart->receiving.busy = 0;
+  uart->held = 0;
+  uart->pending = 0;
+}
+
+static void save_frame (const struct frame8051 *frame,
+                        struct frame_state8051 *state)
+{
+  state->end = frame->end;
+  state->busy = frame->busy;
+  state->timer1 = frame->timer1;
+  state->byte = frame->byte;
+  state->unused = 0;
+}
+
+static void load_frame (struct frame8051 *frame,
+                        const struct frame_state8051 *state)
+{
+  frame->end = state->end;
+  frame->busy = state->busy;
+  frame->timer1 = state->timer1;
+  frame->byte = state->byte;
+}
+
+/* the events of the serial port, for checkpoints; return how many */
+unsigned int uart_events (struct vm8051 *vm, struct event8051 **events)
+{
+  struct uart8051 *uart = vm->uart;
+
+  if (!uart)
+    return 0;
+  if (events)
+    {
+      events[0] = &uart->event;
+      events[1] = &uart->sending.event;
+      events[2] = &uart->receiving.event;
+    }
+  return 3;
+}
+
+/* write the state of the serial port to state if not NULL, return its
+   size; the host must not use the rings meanwhile */
+size_t save_uart (struct vm8051 *vm, uint8_t *state)
+{
+  struct uart8051 *uart = vm->uart;
+  struct uart_state8051 header;
+
+  if (!uart)
+    return 0;
+  memset (&header, 0, sizeof (header));
+  header.rx = ring_peek (&uart->rx, NULL);
+  header.tx = ring_peek (&uart->tx, NULL);
+  if (state)
+    {
+      save_frame (&uart->sending, &header.sending);
+      save_frame (&uart->receiving, &header.receiving);
+      header.held = uart->held;
+      header.pending = uart->pending;
+      header.received = uart->received;
+      memcpy (state, &header, sizeof (header));
+      ring_peek (&uart->rx, state + sizeof (header));
+      ring_peek (&uart->tx, state + sizeof (header) + header.rx);
+    }
+  return sizeof (header) + header.rx + header.tx;
+}
+
+/* set the serial port back to the len bytes of state saved by save_uart,
+   its scheduled events aside; return 0 if they do not fit this vm */
+int load_uart (struct vm8051 *vm, const uint8_t *state, size_t len)
+{
+  struct uart8051 *uart = vm->uart;
+  struct uart_state8051 header;
+
+  if (!uart)
+    return len == 0;
+  if (len < sizeof (header))
+    return 0;
+  memcpy (&header, state, sizeof (header));
+  if (header.rx > uart->rx.mask + 1 || header.tx > uart->tx.mask + 1
+      || len != sizeof (header) + header.rx + header.tx)
+    return 0;
+  clear_uart (vm);
+  ring_push (&uart->rx, state + sizeof (header), header.rx);
+  ring_push (&uart->tx, state + sizeof (header) + header.rx, header.tx);
+  load_frame (&uart->sending, &header.sending);
+  load_frame (&uart->receiving, &header.receiving);
+  uart->held = header.held;
+  uart->pending = header.pending;
+  uart->received = header.received;
+  return 1;
+}
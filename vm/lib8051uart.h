@@ -0,0 +1,59 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051UART_H
+#define LIB8051UART_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* cycles between two looks at the host side when the vm waits for it */
+#define UART_POLL 1024
+
+struct vm8051;
+struct event8051;
+
+/* The bytes go through two rings, each with one producer and one
+   consumer: the host writes what the vm receives and reads what the vm
+   transmits, possibly from another thread than the one running the vm.
+   When file descriptors are bound, the vm thread moves the bytes between
+   them and the rings itself, and the host must not use write_uart and
+   read_uart on the bound direction. */
+
+extern void add_uart (struct vm8051 *vm, size_t size);
+extern void bind_uart (struct vm8051 *vm, int rx_fd, int tx_fd);
+extern void watch_uart (struct vm8051 *vm, int watch);
+extern size_t write_uart (struct vm8051 *vm, const uint8_t *data,
+                          size_t len);
+extern size_t read_uart (struct vm8051 *vm, uint8_t *data, size_t len);
+extern int drained_uart (struct vm8051 *vm);
+extern int pump_uart (struct vm8051 *vm);
+extern void clear_uart (struct vm8051 *vm);
+extern void free_uart (struct vm8051 *vm);
+
+/* used by the vm */
+extern void transmit_uart (struct vm8051 *vm);
+extern void enter_uart (struct vm8051 *vm);
+extern void notify_uart (struct vm8051 *vm);
+extern void retime_uart (struct vm8051 *vm);
+extern void reset_uart (struct vm8051 *vm);
+extern unsigned int uart_events (struct vm8051 *vm,
+                                 struct event8051 **events);
+extern size_t save_uart (struct vm8051 *vm, uint8_t *state);
+extern int load_uart (struct vm8051 *vm, const uint8_t *state, size_t len);
+
+#endif  /* LIB8051UART_H */
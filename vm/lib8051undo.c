@@ -0,0 +1,300 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051undo.h"
+
+/* simulate global variables for a struct vm8051 *vm */
+#include "lib8051globals.h"
+
+/* the SFRs which the instructions change without a side effect, and the
+   timers, which count at each instruction */
+static const uint8_t saved_sfrs[] =
+  { 0xE0, 0xF0, 0xD0, 0x81, 0x82, 0x83, 0x88, 0x8A, 0x8B, 0x8C, 0x8D };
+#define NSFRS (sizeof (saved_sfrs))
+
+#define UNDO_NONE  0
+#define UNDO_DATA  1
+#define UNDO_XDATA 2
+
+struct undo_write
+{
+  uint16_t address;
+  uint8_t space;
+  uint8_t value;
+};
+
+/* the state before an instruction, but the memory it does not write */
+struct undo8051
+{
+  uint32_t cycle;
+  uint32_t timers;
+  uint32_t overflows1;
+  uint32_t now;
+  uint32_t next;
+  uint32_t changes;             /* of the wheel, to see if it moved */
+  uint16_t pc;
+  uint8_t ir[4];
+  uint8_t isr;
+  uint8_t blocked;
+  uint8_t flags;
+  uint8_t scon;
+  uint8_t sfr[NSFRS];
+  struct undo_write writes[2];  /* a call pushes two bytes */
+};
+
+struct undolog8051
+{
+  struct undo8051 *records;
+  unsigned int size;
+  unsigned int last;            /* where the next record goes */
+  unsigned int count;
+};
+
+/* the instruction writes the byte of internal RAM at address */
+static int log_data (struct vm8051 *vm, struct undo8051 *record,
+                     unsigned int n, uint8_t address)
+{
+  record->writes[n].space = UNDO_DATA;
+  record->writes[n].address = address;
+  record->writes[n].value = _data[address];
+  return 1;
+}
+
+/* the SFRs which are not saved may reach the peripherals */
+static int log_direct (struct vm8051 *vm, struct undo8051 *record,
+                       unsigned int n, uint8_t direct)
+{
+  if (!(direct & 0x80))
+    return log_data (vm, record, n, direct);
+  if (vm->banks)
+    return 0;
+  return direct == 0xE0 || direct == 0xF0 || direct == 0xD0
+    || direct == 0x81 || direct == 0x82 || direct == 0x83;
+}
+
+static int log_bit (struct vm8051 *vm, struct undo8051 *record,
+                    unsigned int n, uint8_t bit)
+{
+  if (!(bit & 0x80))
+    return log_data (vm, record, n, 0x20 + (bit >> 3));
+  if (vm->banks)
+    return 0;
+  bit &= 0xF8;
+  return bit == 0xE0 || bit == 0xF0 || bit == 0xD0;
+}
+
+/* only the RAM pages are plain memory */
+static int log_xdata (struct vm8051 *vm, struct undo8051 *record,
+                      uint16_t address, int write)
+{
+  const uint8_t *page = vm->xpages[address >> 8];
+
+  if (!page)
+    return 0;
+  if (write)
+    {
+      record->writes[0].space = UNDO_XDATA;
+      record->writes[0].address = address;
+      record->writes[0].value = page[address & 0xFF];
+    }
+  return 1;
+}
+
+/* log the memory written by the instruction in IR, return 0 if it cannot
+   be undone */
+static int log_writes (struct vm8051 *vm, struct undo8051 *record)
+{
+  uint8_t opcode = IR[0];
+  uint8_t rn = (PSW & 0x18) | (opcode & 0x07);
+  uint8_t ri = _data[(PSW & 0x18) | (opcode & 0x01)];
+
+  if (PCON & (IDL_MASK | PD_MASK))
+    return 1;
+
+  /* acall, lcall */
+  if ((opcode & 0x1F) == 0x11 || opcode == 0x12)
+    return log_data (vm, record, 0, SP + 1)
+      && log_data (vm, record, 1, SP + 2);
+  /* the Rn and @Ri columns: inc, dec, mov #data, mov direct, xch, djnz,
+     xchd and mov A write their operand, mov direct, Rn writes direct */
+  if ((opcode & 0x0F) >= 0x06)
+    switch (opcode >> 4)
+      {
+      case 0x0: case 0x1: case 0x7: case 0xA: case 0xC: case 0xD: case 0xF:
+        if ((opcode & 0x0F) >= 0x08)
+          return log_data (vm, record, 0, rn);
+        return log_data (vm, record, 0, ri);
+      case 0x8:
+        return log_direct (vm, record, 0, IR[1]);
+      default:
+        return 1;
+      }
+
+  switch (opcode)
+    {
+    case 0x05:                  /* inc direct */
+    case 0x15:                  /* dec direct */
+    case 0x42:                  /* orl direct, A */
+    case 0x43:                  /* orl direct, #data */
+    case 0x52:                  /* anl direct, A */
+    case 0x53:                  /* anl direct, #data */
+    case 0x62:                  /* xrl direct, A */
+    case 0x63:                  /* xrl direct, #data */
+    case 0x75:                  /* mov direct, #data */
+    case 0xC5:                  /* xch A, direct */
+    case 0xD0:                  /* pop direct */
+    case 0xD5:                  /* djnz direct, rel */
+    case 0xF5:                  /* mov direct, A */
+      return log_direct (vm, record, 0, IR[1]);
+    case 0x85:                  /* mov direct, direct */
+      return log_direct (vm, record, 0, IR[2]);
+    case 0x10:                  /* jbc bit, rel */
+    case 0x92:                  /* mov bit, C */
+    case 0xB2:                  /* cpl bit */
+    case 0xC2:                  /* clr bit */
+    case 0xD2:                  /* setb bit */
+      return log_bit (vm, record, 0, IR[1]);
+    case 0xC0:                  /* push direct */
+      return log_data (vm, record, 0, SP + 1);
+    case 0xE0:                  /* movx A, @DPTR */
+      return log_xdata (vm, record, DPTR, 0);
+    case 0xE2:                  /* movx A, @Ri */
+    case 0xE3:
+      return log_xdata (vm, record, (P2 << 8) | ri, 0);
+    case 0xF0:                  /* movx @DPTR, A */
+      return log_xdata (vm, record, DPTR, 1);
+    case 0xF2:                  /* movx @Ri, A */
+    case 0xF3:
+      return log_xdata (vm, record, (P2 << 8) | ri, 1);
+    }
+  return 1;
+}
+
+struct undolog8051 *alloc_undo8051 (unsigned int size)
+{
+  struct undolog8051 *log;
+
+  assert (size > 0);
+  log = malloc (sizeof (struct undolog8051));
+  assert (log != NULL);
+  log->records = malloc (size * sizeof (struct undo8051));
+  assert (log->records != NULL);
+  log->size = size;
+  log->last = 0;
+  log->count = 0;
+  return log;
+}
+
+/* run the next instruction as fetch8051 and operate8051 do, and log how
+   to undo it */
+void record8051 (struct vm8051 *vm, struct undolog8051 *log)
+{
+  struct undo8051 *record = &log->records[log->last];
+  unsigned int i;
+  int undoable;
+
+  record->cycle = cycles;
+  record->timers = vm->sched.timers;
+  record->overflows1 = vm->sched.overflows1;
+  record->now = vm->sched.now;
+  record->next = vm->sched.next;
+  record->changes = vm->sched.changes;
+  record->pc = PC;
+  record->ir[0] = IR[0];
+  record->ir[1] = IR[1];
+  record->ir[2] = IR[2];
+  record->ir[3] = IR[3];
+  record->isr = interrupted;
+  record->blocked = interrupts_blocked;
+  record->flags = vm->sched.flags;
+  record->scon = SCON;
+  for (i = 0; i < NSFRS; i++)
+    record->sfr[i] = _sfr[saved_sfrs[i] ^ 0x80];
+  record->writes[0].space = UNDO_NONE;
+  record->writes[1].space = UNDO_NONE;
+
+  fetch8051 (vm);
+  undoable = log_writes (vm, record);
+  operate8051 (vm);
+
+  /* an event, an interrupt or the serial port went by */
+  if (!undoable || vm->sched.changes != record->changes
+      || (interrupted & ~record->isr) || SCON != record->scon)
+    {
+      log->count = 0;
+      return;
+    }
+  log->last = (log->last + 1) % log->size;
+  if (log->count < log->size)
+    log->count++;
+}
+
+/* set vm back to before the last instruction logged, return 0 if there
+   is none */
+int undo8051 (struct vm8051 *vm, struct undolog8051 *log)
+{
+  struct undo8051 *record;
+  struct undo_write *write;
+  unsigned int i;
+
+  if (!log->count)
+    return 0;
+  log->last = (log->last + log->size - 1) % log->size;
+  log->count--;
+  record = &log->records[log->last];
+
+  for (i = 2; i-- > 0; )
+    {
+      write = &record->writes[i];
+      if (write->space == UNDO_DATA)
+        _data[write->address] = write->value;
+      else if (write->space == UNDO_XDATA)
+        vm->xpages[write->address >> 8][write->address & 0xFF] = write->value;
+    }
+  for (i = 0; i < NSFRS; i++)
+    _sfr[saved_sfrs[i] ^ 0x80] = record->sfr[i];
+  cycles = record->cycle;
+  vm->sched.timers = record->timers;
+  vm->sched.overflows1 = record->overflows1;
+  vm->sched.now = record->now;
+  vm->sched.next = record->next;
+  vm->sched.flags = record->flags;
+  PC = record->pc;
+  IR[0] = record->ir[0];
+  IR[1] = record->ir[1];
+  IR[2] = record->ir[2];
+  IR[3] = record->ir[3];
+  interrupted = record->isr;
+  interrupts_blocked = record->blocked;
+  return 1;
+}
+
+void clear_undo8051 (struct undolog8051 *log)
+{
+  log->count = 0;
+}
+
+void free_undo8051 (struct undolog8051 *log)
+{
+  free (log->records);
+  free (log);
+}
@@ -0,0 +1,39 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051UNDO_H
+#define LIB8051UNDO_H
+
+struct vm8051;
+struct undolog8051;
+
+/* An undo log keeps how to undo the last instructions run with
+   record8051, at most size of them, to step back at once instead of
+   running the code again.  A record is the registers, the timers and the
+   old value of the bytes the instruction writes.  An instruction which
+   reaches further, such as an interrupt, an event of the scheduler, a
+   peripheral or an SFR other than A, B, PSW, SP and DPTR, cannot be
+   undone and empties the log; so must the host when it changes the state
+   of the vm itself. */
+
+extern struct undolog8051 *alloc_undo8051 (unsigned int size);
+extern void record8051 (struct vm8051 *vm, struct undolog8051 *log);
+extern int undo8051 (struct vm8051 *vm, struct undolog8051 *log);
+extern void clear_undo8051 (struct undolog8051 *log);
+extern void free_undo8051 (struct undolog8051 *log);
+
+#endif  /* LIB8051UNDO_H */
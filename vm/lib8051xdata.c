@@ -0,0 +1,197 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "lib8051.h"
+#include "lib8051xdata.h"
+
+/* simulate global variables for a struct vm8051 *vm */
+#include "lib8051globals.h"
+
+struct xdev8051
+{
+  xread8051 read;
+  xwrite8051 write;
+  void *data;
+  uint8_t *ram;                 /* of a sparse page while it is mapped */
+};
+
+struct xdata8051
+{
+  struct xdev8051 pages[256];
+};
+
+static int mapped (struct vm8051 *vm, unsigned int page)
+{
+  return vm->xdata
+    && (vm->xdata->pages[page].read || vm->xdata->pages[page].write);
+}
+
+/* where the RAM of a sparse page is kept: in xpages unless a peripheral
+   is there */
+static uint8_t **sparse_page (struct vm8051 *vm, unsigned int page)
+{
+  if (mapped (vm, page))
+    return &vm->xdata->pages[page].ram;
+  return &vm->xpages[page];
+}
+
+/* the RAM of page, NULL for a sparse page not written since reset */
+uint8_t *xdata_page (struct vm8051 *vm, unsigned int page)
+{
+  if (_xdata)
+    return _xdata + (page << 8);
+  return *sparse_page (vm, page);
+}
+
+/* the RAM of page, allocated on first write if sparse */
+uint8_t *alloc_xdata_page (struct vm8051 *vm, unsigned int page)
+{
+  uint8_t **ram;
+
+  if (_xdata)
+    return _xdata + (page << 8);
+  ram = sparse_page (vm, page);
+  if (*ram == NULL)
+    {
+      *ram = calloc (1, 256);
+      assert (*ram != NULL);
+    }
+  return *ram;
+}
+
+/* give page its RAM, unless a peripheral is there */
+static void map_page (struct vm8051 *vm, unsigned int page, uint8_t *ram)
+{
+  if (mapped (vm, page))
+    {
+      vm->xdata->pages[page].ram = ram;
+      vm->xpages[page] = NULL;
+    }
+  else
+    vm->xpages[page] = ram;
+}
+
+/* map npages pages from page to a peripheral */
+void map_xdata (struct vm8051 *vm, uint8_t page, unsigned int npages,
+                xread8051 read, xwrite8051 write, void *data)
+{
+  unsigned int i;
+  uint8_t *ram;
+
+  assert (page + npages <= 256);
+  if (!vm->xdata)
+    {
+      vm->xdata = calloc (1, sizeof (struct xdata8051));
+      assert (vm->xdata != NULL);
+    }
+  for (i = page; i < page + npages; i++)
+    {
+      ram = xdata_page (vm, i);
+      vm->xdata->pages[i].read = read;
+      vm->xdata->pages[i].write = write;
+      vm->xdata->pages[i].data = data;
+      map_page (vm, i, ram);
+    }
+}
+
+/* give npages pages from page back to the RAM */
+void unmap_xdata (struct vm8051 *vm, uint8_t page, unsigned int npages)
+{
+  map_xdata (vm, page, npages, NULL, NULL, NULL);
+}
+
+/* the peripherals and the sparse pages */
+void free_xdata (struct vm8051 *vm)
+{
+  unsigned int page;
+
+  for (page = 0; page < 256; page++)
+    {
+      if (!_xdata)
+        free (xdata_page (vm, page));
+      vm->xpages[page] = NULL;
+    }
+  free (vm->xdata);
+  vm->xdata = NULL;
+}
+
+/* the RAM at address, whatever is mapped there */
+uint8_t peek_xdata (struct vm8051 *vm, uint16_t address)
+{
+  const uint8_t *ram = xdata_page (vm, address >> 8);
+
+  return ram ? ram[address & 0xFF] : 0;
+}
+
+void poke_xdata (struct vm8051 *vm, uint16_t address, uint8_t value)
+{
+  alloc_xdata_page (vm, address >> 8)[address & 0xFF] = value;
+}
+
+uint8_t read_xdata (struct vm8051 *vm, uint16_t address)
+{
+  const struct xdev8051 *dev;
+
+  if (vm->xdata)
+    {
+      dev = &vm->xdata->pages[address >> 8];
+      if (dev->read)
+        return dev->read (vm, address, dev->data);
+    }
+  return peek_xdata (vm, address);
+}
+
+void write_xdata (struct vm8051 *vm, uint16_t address, uint8_t value)
+{
+  const struct xdev8051 *dev;
+
+  if (vm->xdata)
+    {
+      dev = &vm->xdata->pages[address >> 8];
+      if (dev->write)
+        {
+          dev->write (vm, address, value, dev->data);
+          return;
+        }
+    }
+  poke_xdata (vm, address, value);
+}
+
+/* clear the RAM, the sparse pages are given back */
+void reset_xdata (struct vm8051 *vm)
+{
+  unsigned int page;
+  uint32_t i;
+
+  if (_xdata)
+    for (i = 0; i < 65536; i++)
+      _xdata[i] = 0;
+  for (page = 0; page < 256; page++)
+    {
+      if (_xdata)
+        map_page (vm, page, _xdata + (page << 8));
+      else
+        {
+          free (xdata_page (vm, page));
+          map_page (vm, page, NULL);
+        }
+    }
+}
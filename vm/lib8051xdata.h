@@ -0,0 +1,55 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LIB8051XDATA_H
+#define LIB8051XDATA_H
+
+#include <stdint.h>
+
+struct vm8051;
+
+/* Peripherals mapped in XDATA by pages of 256 bytes.  MOVX reads and
+   writes the RAM of the other pages directly; in the pages of a
+   peripheral, they call read and write instead, or use the RAM for the
+   direction which is NULL.
+
+   The RAM is _xdata if the vm has one, otherwise it is sparse: a page is
+   allocated when first written and reads as 0 until then. */
+
+typedef uint8_t (*xread8051) (struct vm8051 *vm, uint16_t address,
+                              void *data);
+typedef void (*xwrite8051) (struct vm8051 *vm, uint16_t address,
+                            uint8_t value, void *data);
+
+extern void map_xdata (struct vm8051 *vm, uint8_t page, unsigned int npages,
+                       xread8051 read, xwrite8051 write, void *data);
+extern void unmap_xdata (struct vm8051 *vm, uint8_t page,
+                         unsigned int npages);
+extern void free_xdata (struct vm8051 *vm);
+
+/* the RAM, as MOVX sees it where no peripheral is mapped */
+extern uint8_t peek_xdata (struct vm8051 *vm, uint16_t address);
+extern void poke_xdata (struct vm8051 *vm, uint16_t address, uint8_t value);
+
+/* used by the vm, for the pages without RAM access */
+extern uint8_t read_xdata (struct vm8051 *vm, uint16_t address);
+extern void write_xdata (struct vm8051 *vm, uint16_t address, uint8_t value);
+extern void reset_xdata (struct vm8051 *vm);
+extern uint8_t *xdata_page (struct vm8051 *vm, unsigned int page);
+extern uint8_t *alloc_xdata_page (struct vm8051 *vm, unsigned int page);
+
+#endif  /* LIB8051XDATA_H */
@@ -0,0 +1,386 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Run the jobs of a manifest on a pool of threads, each job in its own
+   vm, and check their serial output.  The jobs running the same image
+   run directly on its loaded and predecoded code from the image cache. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vm/lib8051.h>
+#include <utils/libhexbin.h>
+#include <utils/libimagecache.h>
+#include <utils/libtools.h>
+
+struct job
+{
+  unsigned int line;
+  char *path;
+  const struct code_image *image;
+  char *input;                  /* NULL for none */
+  char *expected;               /* NULL for none */
+  uint32_t ncy;
+  int32_t address;              /* -1 for none */
+  char *pattern;                /* NULL for none */
+  uint8_t bank_sfr;             /* 0 for none */
+  char *checkpoint;             /* NULL to start from reset */
+
+  /* results */
+  const char *reason;
+  uint32_t first;               /* cycle it started at */
+  uint32_t cycles;
+  double seconds;
+  int passed;
+  char error[80];
+};
+
+static struct image_cache cache;
+static struct job *jobs = NULL;
+static unsigned int njobs = 0;
+static unsigned int next_job = 0;
+static uint64_t seed = 0;
+/* what the jobs ran, NULL if not recorded */
+static struct coverage8051 *coverage = NULL;
+static pthread_mutex_t coverage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the image at path, loaded once for all the jobs with the same
+   contents; NULL if invalid or empty */
+static const struct code_image *load_image (const char *path)
+{
+  const struct code_image *image;
+  int error;
+
+  error = get_image (&cache, path, &image);
+  if (error == HEX_EOPEN)
+    fprintf (stderr, "%s: %s\n", path, hex_strerror (error));
+  else if (error != HEX_OK)
+    fprintf (stderr, "%s:%u: %s\n", path, cache.line, hex_strerror (error));
+  else if (image->len == 0)
+    {
+      fprintf (stderr, "%s: empty program\n", path);
+      put_image (&cache, image);
+      image = NULL;
+    }
+  return image;
+}
+
+/* parse a line of the manifest into a new job, return 0 if invalid */
+static int parse_job (char *str, unsigned int line)
+{
+  struct job job;
+  char *field[3];
+  char *option;
+  int i;
+
+  memset (&job, 0, sizeof (struct job));
+  job.line = line;
+  job.ncy = 1000000000;
+  job.address = -1;
+  for (i = 0; i < 3; i++)
+    {
+      field[i] = strtok (i ? NULL : str, " \t\n");
+      if (field[i] == NULL)
+        return i == 0;          /* blank line */
+      if (field[0][0] == '#')
+        return 1;
+    }
+  while ((option = strtok (NULL, " \t\n")) != NULL)
+    {
+      char *value = strtok (NULL, " \t\n");
+
+      if (value == NULL || option[0] != '-' || strlen (option) != 2)
+        return 0;
+      if (option[1] == 'n')
+        job.ncy = strtoul (value, NULL, 0);
+      else if (option[1] == 'p')
+        job.address = strtoul (value, NULL, 16) & 0xFFFF;
+      else if (option[1] == 'e')
+        job.pattern = value;
+      else if (option[1] == 'b')
+        job.bank_sfr = strtoul (value, NULL, 16) | 0x80;
+      else if (option[1] == 'l')
+        job.checkpoint = value;
+      else
+        return 0;
+    }
+  job.image = load_image (field[0]);
+  if (job.image == NULL)
+    return 0;
+  job.path = strdup (field[0]);
+  if (job.pattern)
+    job.pattern = strdup (job.pattern);
+  if (job.checkpoint)
+    job.checkpoint = strdup (job.checkpoint);
+  if (strcmp (field[1], "-") != 0)
+    job.input = strdup (field[1]);
+  if (strcmp (field[2], "-") != 0)
+    job.expected = strdup (field[2]);
+
+  jobs = realloc (jobs, (njobs + 1) * sizeof (struct job));
+  assert (jobs != NULL);
+  jobs[njobs++] = job;
+  return 1;
+}
+
+/* run a job as vm8051 --run does */
+static void run_job (struct job *job)
+{
+  struct vm8051 *vm;
+  uint8_t *input = NULL, *expected = NULL, *output = NULL;
+  size_t input_len = 0, expected_len = 0, len = 0, size = 0, from, n;
+  double start;
+  int error;
+
+  job->reason = "cycles";
+  if (job->input
+      && (input = read_file (job->input, &input_len)) == NULL)
+    {
+      snprintf (job->error, sizeof (job->error), "cannot read %s",
+                job->input);
+      return;
+    }
+  if (job->expected
+      && (expected = read_file (job->expected, &expected_len)) == NULL)
+    {
+      snprintf (job->error, sizeof (job->error), "cannot read %s",
+                job->expected);
+      free (input);
+      return;
+    }
+
+  vm = new_vm_from_image (job->image, job->bank_sfr,
+                          input_len > 4096 ? input_len : 4096, seed);
+  if (coverage)
+    add_coverage (vm);
+  error = CHECKPOINT_OK;
+  if (job->checkpoint)
+    error = load8051 (vm, job->checkpoint);
+  if (error != CHECKPOINT_OK)
+    snprintf (job->error, sizeof (job->error), "%s: %s", job->checkpoint,
+              checkpoint_strerror (error));
+  if (input)
+    write_uart (vm, input, input_len);
+  watch_uart (vm, 1);
+
+  job->first = vm->cycles;
+  start = now ();
+  while (error == CHECKPOINT_OK && vm->cycles < job->ncy)
+    {
+      sim8051 (vm, job->address, job->ncy);
+      from = len;
+      do
+        {
+          if (len == size)
+            {
+              size = size ? 2 * size : 1024;
+              output = realloc (output, size);
+              assert (output != NULL);
+            }
+          n = read_uart (vm, output + len, size - len);
+          len += n;
+        }
+      while (n > 0);
+      if (job->pattern && len > from
+          && search (output, len, job->pattern, from))
+        {
+          job->reason = "pattern";
+          break;
+        }
+      if (vm->PC == job->address)
+        {
+          job->reason = "pc";
+          break;
+        }
+      if (PD (vm))
+        {
+          job->reason = "power-down";
+          break;
+        }
+    }
+  job->seconds = now () - start;
+  job->cycles = vm->cycles;
+
+  job->passed = 1;
+  if (error != CHECKPOINT_OK)
+    job->passed = 0;
+  else if ((job->address >= 0 || job->pattern)
+           && strcmp (job->reason, "pc") != 0
+           && strcmp (job->reason, "pattern") != 0)
+    {
+      job->passed = 0;
+      snprintf (job->error, sizeof (job->error), "stop not reached");
+    }
+  else if (expected
+           && (len != expected_len || memcmp (output, expected, len) != 0))
+    {
+      job->passed = 0;
+      snprintf (job->error, sizeof (job->error),
+                "unexpected output (%lu bytes)", (unsigned long) len);
+    }
+
+  if (coverage)
+    {
+      pthread_mutex_lock (&coverage_lock);
+      merge_coverage (coverage, vm->coverage);
+      pthread_mutex_unlock (&coverage_lock);
+    }
+  free_vm (vm);
+  free (input);
+  free (expected);
+  free (output);
+}
+
+static void *worker (void *arg)
+{
+  unsigned int i;
+
+  (void) arg;
+  while ((i = __atomic_fetch_add (&next_job, 1, __ATOMIC_RELAXED)) < njobs)
+    run_job (&jobs[i]);
+  return NULL;
+}
+
+static void print_jobs (double seconds)
+{
+  unsigned int i, failed = 0;
+  uint64_t total = 0;
+
+  printf ("result  line      cycles    time (s)   Mcyc/s  stop        "
+          "image\n");
+  for (i = 0; i < njobs; i++)
+    {
+      struct job *job = &jobs[i];
+
+      printf ("%-6s  %4u  %10u  %10.3f  %7.2f  %-10s  %s",
+              job->passed ? "PASS" : "FAIL", job->line, job->cycles,
+              job->seconds,
+              job->seconds > 0
+              ? (job->cycles - job->first) / job->seconds * 1e-6 : 0.0,
+              job->reason, job->path);
+      if (job->error[0])
+        printf ("  (%s)", job->error);
+      printf ("\n");
+      failed += !job->passed;
+      total += job->cycles - job->first;
+    }
+  printf ("\n%u passed, %u failed, %llu cycles in %.3f s (%.2f Mcyc/s)\n",
+          njobs - failed, failed, (unsigned long long) total, seconds,
+          seconds > 0 ? total / seconds * 1e-6 : 0.0);
+}
+
+int main (int argc, char *argv[])
+{
+  const char *name = argv[0];
+  unsigned int nthreads = 1;
+  const char *cache_dir = NULL;
+  const char *covered = NULL;
+  unsigned int i, line = 0;
+  pthread_t *threads;
+  char buffer[4096];
+  FILE *manifest;
+  double start;
+  int ret = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (sysconf (_SC_NPROCESSORS_ONLN) > 0)
+    nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  while (argc > 2 && argv[1][0] == '-')
+    {
+      if (strcmp (argv[1], "-j") == 0)
+        nthreads = strtoul (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-s") == 0)
+        seed = strtoull (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-c") == 0)
+        cache_dir = argv[2];
+      else if (strcmp (argv[1], "-v") == 0)
+        covered = argv[2];
+      else
+        break;
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc != 2 || nthreads == 0)
+    {
+      fprintf (stderr, "Usage: %s [-j threads] [-s seed] [-c cache] "
+               "[-v coverage] manifest\n", name);
+      return -1;
+    }
+  init_image_cache (&cache, cache_dir);
+
+  manifest = fopen (argv[1], "r");
+  if (manifest == NULL)
+    {
+      perror (argv[1]);
+      free_image_cache (&cache);
+      return -1;
+    }
+  while (fgets (buffer, sizeof (buffer), manifest) != NULL)
+    if (!parse_job (buffer, ++line))
+      {
+        fprintf (stderr, "%s:%u: invalid job\n", argv[1], line);
+        ret = -1;
+      }
+  fclose (manifest);
+
+  if (ret == 0)
+    {
+      if (nthreads > njobs)
+        nthreads = njobs ? njobs : 1;
+      threads = malloc (nthreads * sizeof (pthread_t));
+      assert (threads != NULL);
+      if (covered)
+        {
+          coverage = calloc (1, sizeof (struct coverage8051));
+          assert (coverage != NULL);
+        }
+      start = now ();
+      for (i = 0; i < nthreads; i++)
+        pthread_create (&threads[i], NULL, worker, NULL);
+      for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+      print_jobs (now () - start);
+      free (threads);
+      if (covered && !update_coverage (coverage, covered))
+        {
+          fprintf (stderr, "%s: cannot add the coverage\n", covered);
+          ret = -1;
+        }
+      free (coverage);
+      for (i = 0; i < njobs; i++)
+        if (!jobs[i].passed)
+          ret = 1;
+    }
+
+  for (i = 0; i < njobs; i++)
+    {
+      put_image (&cache, jobs[i].image);
+      free (jobs[i].path);
+      free (jobs[i].input);
+      free (jobs[i].expected);
+      free (jobs[i].pattern);
+      free (jobs[i].checkpoint);
+    }
+  free (jobs);
+  free_image_cache (&cache);
+  return ret;
+}
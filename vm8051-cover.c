@@ -0,0 +1,322 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Merge the coverages recorded by vm8051 --run -v and vm8051-batch -v and
+   report them for a program as an lcov tracefile or in JSON.  The
+   instructions of the program are found by following its code from reset,
+   the interrupt vectors and the instructions run. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vm/lib8051.h>
+#include <utils/libhexbin.h>
+#include <utils/libimagecache.h>
+
+#define FORMAT_LCOV 0
+#define FORMAT_JSON 1
+
+/* the addresses an instruction at address, decoded in inst, may go to
+   next, return how many */
+static unsigned int successors (const uint8_t *inst, uint16_t address,
+                                uint16_t *next)
+{
+  uint16_t after = address + inst[3];
+  uint8_t opcode = inst[0];
+
+  /* ajmp and acall stay in the 2 KiB page of the next instruction */
+  if ((opcode & 0x1F) == 0x01 || (opcode & 0x1F) == 0x11)
+    next[0] = (after & 0xF800) | ((opcode & 0xE0) << 3) | inst[1];
+  else if (opcode == 0x02 || opcode == 0x12)  /* ljmp, lcall */
+    next[0] = (inst[1] << 8) | inst[2];
+  else if (opcode == 0x80 || is_branch8051 (opcode))  /* sjmp, branches */
+    next[0] = after + (int8_t) inst[inst[3] - 1];
+  else if (opcode == 0x22 || opcode == 0x32 || opcode == 0x73)
+    return 0;                   /* ret, reti, jmp @A+DPTR */
+  else
+    {
+      next[0] = after;
+      return 1;
+    }
+  if ((opcode & 0x1F) == 0x01 || opcode == 0x02 || opcode == 0x80)
+    return 1;
+  next[1] = after;
+  return 2;
+}
+
+/* follow the code from address, marking in insts the instructions found
+   and in inside the first byte of each with 1, the others with 2 */
+static void follow (struct vm8051 *vm, const uint8_t *loaded, uint8_t *inside,
+                    uint16_t *todo, uint8_t *insts, uint16_t address)
+{
+  uint16_t next[2];
+  uint8_t inst[4];
+  unsigned int ntodo = 0, i, n;
+
+  if (!loaded[address] || (inside[address] & 1))
+    return;
+  inside[address] |= 1;
+  todo[ntodo++] = address;
+  while (ntodo > 0)
+    {
+      address = todo[--ntodo];
+      insts[address] = 1;
+      inst8051 (vm, inst, address);
+      for (i = 1; i < inst[3]; i++)
+        inside[(uint16_t) (address + i)] |= 2;
+      n = successors (inst, address, next);
+      for (i = 0; i < n; i++)
+        if (loaded[next[i]] && !(inside[next[i]] & 1))
+          {
+            inside[next[i]] |= 1;
+            todo[ntodo++] = next[i];
+          }
+    }
+}
+
+/* mark the instructions found by following the code of image, through
+   the jumps and the calls, from reset, the addresses covered and the
+   interrupt vectors left out which hold a jump or a reti; the data in the
+   code is not reached, nor the targets of jmp @A+DPTR never run */
+static void find_insts (const struct code_image *image,
+                        const struct coverage8051 *coverage, uint8_t *insts)
+{
+  struct vm8051 *vm;
+  uint8_t *loaded, *inside, opcode;
+  uint16_t *todo;
+  uint32_t address, start, end;
+  unsigned int bank;
+  size_t r;
+
+  vm = calloc (1, sizeof (struct vm8051));
+  assert (vm != NULL);
+  loaded = malloc (65536);
+  assert (loaded != NULL);
+  inside = malloc (65536);
+  assert (inside != NULL);
+  todo = malloc (65536 * sizeof (uint16_t));
+  assert (todo != NULL);
+  /* each bank has its own view of the code, with what bank 0 gives where
+     it has nothing */
+  for (bank = 0; bank < image->nbanks; bank++)
+    {
+      vm->_code = image->code + (size_t) bank * 65536;
+      memset (loaded, 0, 65536);
+      memset (inside, 0, 65536);
+      for (r = 0; r < image->nranges; r++)
+        {
+          start = image->ranges[r].address;
+          end = start + image->ranges[r].len;
+          if (start >> 16 != 0 && start >> 16 != bank)
+            continue;
+          for (address = start; address < end; address++)
+            loaded[address & 0xFFFF] = 1;
+        }
+
+      follow (vm, loaded, inside, todo, insts, 0);
+      for (address = 0; address < 65536; address++)
+        if (COVERAGE (coverage, address))
+          {
+            /* even out of the ranges */
+            insts[address] = 1;
+            follow (vm, loaded, inside, todo, insts, address);
+          }
+      for (address = 0x03; address <= 0x2B; address += 8)
+        {
+          opcode = vm->_code[address];
+          if (!inside[address] && (opcode == 0x02 || opcode == 0x80
+                                   || opcode == 0x32
+                                   || (opcode & 0x1F) == 0x01))
+            follow (vm, loaded, inside, todo, insts, address);
+        }
+    }
+  free (todo);
+  free (inside);
+  free (loaded);
+  free (vm);
+}
+
+/* the opcode at address, in the first view of the code */
+static uint8_t opcode_at (const struct code_image *image, uint16_t address)
+{
+  return image->code[address];
+}
+
+static void write_lcov (const char *path, const struct code_image *image,
+                        const struct coverage8051 *coverage,
+                        const uint8_t *insts)
+{
+  unsigned int lines = 0, hit = 0, branches = 0, taken = 0;
+  uint32_t address;
+  unsigned int bits;
+
+  printf ("TN:\nSF:%s\n", path);
+  /* the lines are the addresses plus one, as they count from 1 */
+  for (address = 0; address < 65536; address++)
+    {
+      if (!insts[address])
+        continue;
+      bits = COVERAGE (coverage, address);
+      printf ("DA:%u,%u\n", address + 1, bits ? 1 : 0);
+      lines++;
+      hit += bits != 0;
+      if (!is_branch8051 (opcode_at (image, address)))
+        continue;
+      if (bits)
+        printf ("BRDA:%u,0,0,%u\nBRDA:%u,0,1,%u\n",
+                address + 1, (bits & COVERAGE_JUMP) ? 1 : 0,
+                address + 1, (bits & COVERAGE_NEXT) ? 1 : 0);
+      else
+        printf ("BRDA:%u,0,0,-\nBRDA:%u,0,1,-\n", address + 1, address + 1);
+      branches += 2;
+      taken += !!(bits & COVERAGE_JUMP) + !!(bits & COVERAGE_NEXT);
+    }
+  printf ("BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n", branches, taken,
+          lines, hit);
+}
+
+static void write_string (const char *str)
+{
+  putchar ('"');
+  for (; *str; str++)
+    {
+      if (*str == '"' || *str == '\\')
+        putchar ('\\');
+      if ((unsigned char) *str < 0x20)
+        printf ("\\u%04X", (unsigned char) *str);
+      else
+        putchar (*str);
+    }
+  putchar ('"');
+}
+
+/* write the addresses of insts whose coverage bits are set or not, as a
+   JSON array */
+static void write_addresses (const struct coverage8051 *coverage,
+                             const uint8_t *insts, int set)
+{
+  uint32_t address;
+  const char *sep = "";
+
+  printf ("[");
+  for (address = 0; address < 65536; address++)
+    if (insts[address] && (COVERAGE (coverage, address) != 0) == set)
+      {
+        printf ("%s%u", sep, address);
+        sep = ", ";
+      }
+  printf ("]");
+}
+
+static void write_json (const char *path, const struct code_image *image,
+                        const struct coverage8051 *coverage,
+                        const uint8_t *insts)
+{
+  unsigned int n = 0, hit = 0;
+  uint32_t address;
+  unsigned int bits;
+  const char *sep = "";
+
+  for (address = 0; address < 65536; address++)
+    if (insts[address])
+      {
+        n++;
+        hit += COVERAGE (coverage, address) != 0;
+      }
+  printf ("{\n  \"file\": ");
+  write_string (path);
+  printf (",\n  \"instructions\": %u,\n  \"covered\": %u,\n", n, hit);
+  printf ("  \"executed\": ");
+  write_addresses (coverage, insts, 1);
+  printf (",\n  \"missed\": ");
+  write_addresses (coverage, insts, 0);
+  printf (",\n  \"branches\": [");
+  for (address = 0; address < 65536; address++)
+    if (insts[address] && is_branch8051 (opcode_at (image, address)))
+      {
+        bits = COVERAGE (coverage, address);
+        printf ("%s\n    {\"address\": %u, \"taken\": %s, "
+                "\"not_taken\": %s}", sep, address,
+                (bits & COVERAGE_JUMP) ? "true" : "false",
+                (bits & COVERAGE_NEXT) ? "true" : "false");
+        sep = ",";
+      }
+  printf ("\n  ]\n}\n");
+}
+
+int main (int argc, char *argv[])
+{
+  const char *name = argv[0];
+  int format = FORMAT_LCOV;
+  struct image_cache cache;
+  const struct code_image *image;
+  struct coverage8051 coverage, run;
+  uint8_t *insts;
+  int i, error, ret = 0;
+
+  if (argc > 3 && strcmp (argv[1], "-f") == 0)
+    {
+      if (strcmp (argv[2], "json") == 0)
+        format = FORMAT_JSON;
+      else if (strcmp (argv[2], "lcov") != 0)
+        format = -1;
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc < 3 || format < 0)
+    {
+      fprintf (stderr, "Usage: %s [-f lcov|json] input coverage...\n", name);
+      return -1;
+    }
+
+  memset (&coverage, 0, sizeof (struct coverage8051));
+  for (i = 2; i < argc; i++)
+    {
+      if (!read_coverage (&run, argv[i]))
+        {
+          fprintf (stderr, "%s: not a coverage\n", argv[i]);
+          return -1;
+        }
+      merge_coverage (&coverage, &run);
+    }
+
+  init_image_cache (&cache, NULL);
+  error = get_image (&cache, argv[1], &image);
+  if (error == HEX_EOPEN)
+    fprintf (stderr, "%s: %s\n", argv[1], hex_strerror (error));
+  else if (error != HEX_OK)
+    fprintf (stderr, "%s:%u: %s\n", argv[1], cache.line,
+             hex_strerror (error));
+  else
+    {
+      insts = calloc (65536, 1);
+      assert (insts != NULL);
+      find_insts (image, &coverage, insts);
+      if (format == FORMAT_LCOV)
+        write_lcov (argv[1], image, &coverage, insts);
+      else
+        write_json (argv[1], image, &coverage, insts);
+      free (insts);
+      put_image (&cache, image);
+    }
+  if (error != HEX_OK)
+    ret = -1;
+  free_image_cache (&cache);
+  return ret;
+}
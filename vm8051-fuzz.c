@@ -0,0 +1,651 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Fuzz what a program does with its serial input, on a pool of threads.
+   Each thread boots its own vm once and keeps a snapshot of it; every
+   input then starts from the snapshot, restored in memory, and is fed to
+   the serial port.  The inputs are mutations of those of the corpus, and
+   those which run edges, counted as AFL does, in numbers not seen before
+   join it. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vm/lib8051.h>
+#include <utils/libhexbin.h>
+#include <utils/libimagecache.h>
+#include <utils/libtools.h>
+
+/* how a run of an input ended */
+#define END_STOP 0              /* at its -p or -e stop, or powered down */
+#define END_CYCLES 1            /* out of cycles */
+#define END_CRASH 2             /* through a -x address */
+
+/* the cycles the boot may take to reach its -a address */
+#define BOOT_CYCLES 1000000000
+
+struct entry
+{
+  uint8_t *data;
+  size_t len;
+};
+
+/* a thread and its vm */
+struct fuzzer
+{
+  struct vm8051 *vm;
+  struct snapshot8051 *snapshot;
+  uint64_t random;
+  uint8_t *input;
+  size_t len;
+  uint8_t *output;
+  size_t size;                  /* of output */
+  uint8_t seen[65536];          /* the classes of edge counts it knows */
+  uint64_t execs;               /* not added to the total yet */
+};
+
+static const struct code_image *image;
+static uint8_t bank_sfr = 0;
+static const char *checkpoint = NULL;
+static int32_t ready = -1;
+static uint32_t ncy = 1000000;
+static int32_t stop_address = -1;
+static const char *pattern = NULL;
+static uint16_t *crashes = NULL;
+static unsigned int ncrashes = 0;
+static size_t max_len = 1024;
+static const char *prefix = "fuzz";
+static uint64_t seed = 0;
+static uint8_t classes[256];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* under lock */
+static struct entry *corpus = NULL;
+static unsigned int ncorpus = 0;
+static uint8_t seen[65536];
+static uint8_t crash_seen[65536];
+static uint8_t hang_seen[65536];
+static unsigned int ncrashed = 0;
+static unsigned int nhung = 0;
+
+static uint64_t execs = 0;
+static int done = 0;
+
+static int write_input (const char *kind, unsigned int n,
+                        const uint8_t *data, size_t len)
+{
+  FILE *stream;
+  char path[4096];
+  int ok;
+
+  snprintf (path, sizeof (path), "%s.%s.%06u", prefix, kind, n);
+  stream = fopen (path, "wb");
+  if (stream == NULL)
+    {
+      perror (path);
+      return 0;
+    }
+  ok = fwrite (data, 1, len, stream) == len;
+  if (fclose (stream) != 0 || !ok)
+    {
+      perror (path);
+      return 0;
+    }
+  return 1;
+}
+
+/* the buckets of AFL: 1, 2, 3, 4 to 7, 8 to 15, 16 to 31, 32 to 127 and
+   128 to 255 times */
+static void init_classes (void)
+{
+  unsigned int n;
+
+  classes[0] = 0;
+  for (n = 1; n < 256; n++)
+    if (n <= 2)
+      classes[n] = n;
+    else if (n == 3)
+      classes[n] = 4;
+    else if (n < 8)
+      classes[n] = 8;
+    else if (n < 16)
+      classes[n] = 16;
+    else if (n < 32)
+      classes[n] = 32;
+    else if (n < 128)
+      classes[n] = 64;
+    else
+      classes[n] = 128;
+}
+
+/* whether the 64 counts of hits from i are all zero, as most are */
+static int is_blank (const uint8_t *hits, unsigned int i)
+{
+  uint64_t word, any = 0;
+  unsigned int j;
+
+  for (j = i; j < i + 64; j += 8)
+    {
+      memcpy (&word, hits + j, 8);
+      any |= word;
+    }
+  return !any;
+}
+
+/* turn the counts of hits into their class, return whether one is not
+   in known */
+static int classify (uint8_t *hits, const uint8_t *known)
+{
+  unsigned int i, j;
+  int found = 0;
+
+  for (i = 0; i < 65536; i += 64)
+    if (!is_blank (hits, i))
+      for (j = i; j < i + 64; j++)
+        {
+          hits[j] = classes[hits[j]];
+          found |= (hits[j] & ~known[j]) != 0;
+        }
+  return found;
+}
+
+/* whether hits has a class not in known, which it is added to */
+static int merge_classes (const uint8_t *hits, uint8_t *known)
+{
+  unsigned int i, j;
+  int found = 0;
+
+  for (i = 0; i < 65536; i += 64)
+    if (!is_blank (hits, i))
+      for (j = i; j < i + 64; j++)
+        if (hits[j] & ~known[j])
+          {
+            known[j] |= hits[j];
+            found = 1;
+          }
+  return found;
+}
+
+static unsigned int count_edges (const uint8_t *known)
+{
+  unsigned int i, n = 0;
+
+  for (i = 0; i < 65536; i++)
+    n += known[i] != 0;
+  return n;
+}
+
+/* xorshift64 */
+static uint32_t next_random (struct fuzzer *f)
+{
+  f->random ^= f->random << 13;
+  f->random ^= f->random >> 7;
+  f->random ^= f->random << 17;
+  return f->random >> 32;
+}
+
+/* give f a vm set up as the jobs of vm8051-batch, booted up to the state
+   every input starts from; return 0 with the reason in error if it
+   cannot */
+static int boot (struct fuzzer *f, unsigned int index, char *error,
+                 size_t size)
+{
+  struct vm8051 *vm;
+  uint32_t limit;
+  int ret;
+
+  memset (f, 0, sizeof (struct fuzzer));
+  f->random = (seed + index) * 0x9E3779B97F4A7C15ULL + 1;
+  f->input = malloc (max_len + 1);
+  assert (f->input != NULL);
+
+  vm = new_vm_from_image (image, bank_sfr,
+                          max_len > 4096 ? max_len : 4096, seed);
+  f->vm = vm;
+  if (checkpoint && (ret = load8051 (vm, checkpoint)) != CHECKPOINT_OK)
+    {
+      snprintf (error, size, "%s: %s", checkpoint,
+                checkpoint_strerror (ret));
+      return 0;
+    }
+  watch_uart (vm, 1);
+
+  limit = vm->cycles + BOOT_CYCLES;
+  if (limit < vm->cycles)
+    limit = UINT32_MAX;
+  while (ready >= 0 && vm->PC != ready && vm->cycles < limit && !PD (vm))
+    {
+      sim8051 (vm, ready, limit);
+      while (read_uart (vm, f->input, max_len) > 0)
+        ;
+    }
+  if (ready >= 0 && vm->PC != ready)
+    {
+      snprintf (error, size, "boot did not reach 0x%04X", ready);
+      return 0;
+    }
+  if ((ret = snapshot8051 (vm, &f->snapshot)) != CHECKPOINT_OK)
+    {
+      snprintf (error, size, "%s", checkpoint_strerror (ret));
+      return 0;
+    }
+
+  add_edges (vm);
+  if (ncrashes)
+    add_coverage (vm);
+  return 1;
+}
+
+static void shut_down (struct fuzzer *f)
+{
+  struct vm8051 *vm = f->vm;
+
+  if (vm == NULL)
+    return;
+  free_snapshot8051 (f->snapshot);
+  free_vm (vm);
+  free (f->input);
+  free (f->output);
+  __atomic_fetch_add (&execs, f->execs, __ATOMIC_RELAXED);
+}
+
+/* run the input of f from the snapshot */
+static int run_input (struct fuzzer *f)
+{
+  struct vm8051 *vm = f->vm;
+  uint32_t limit;
+  size_t len = 0, from, n;
+  unsigned int i;
+  int end = END_CYCLES;
+
+  restore8051 (vm, f->snapshot);
+  clear_edges (vm);
+  write_uart (vm, f->input, f->len);
+  limit = vm->cycles + ncy;
+  if (limit < vm->cycles)
+    limit = UINT32_MAX;
+
+  while (vm->cycles < limit)
+    {
+      /* the stop only counts once the program took the whole input, which
+         is looked at every UART_POLL cycles until then */
+      if (drained_uart (vm))
+        sim8051 (vm, stop_address, limit);
+      else
+        sim8051 (vm, -1, limit - vm->cycles > UART_POLL
+                 ? vm->cycles + UART_POLL : limit);
+      from = len;
+      do
+        {
+          if (len == f->size)
+            {
+              f->size = f->size ? 2 * f->size : 1024;
+              f->output = realloc (f->output, f->size);
+              assert (f->output != NULL);
+            }
+          n = read_uart (vm, f->output + len, f->size - len);
+          len += n;
+        }
+      while (n > 0);
+      if ((pattern && len > from && search (f->output, len, pattern, from))
+          || (vm->PC == stop_address && drained_uart (vm)) || PD (vm))
+        {
+          end = END_STOP;
+          break;
+        }
+    }
+
+  /* the bits of the crash addresses are left clear for the next run */
+  for (i = 0; i < ncrashes; i++)
+    if (COVERAGE (vm->coverage, crashes[i]))
+      {
+        vm->coverage->bits[crashes[i] >> 2] &= ~(3 << (crashes[i] & 3) * 2);
+        end = END_CRASH;
+      }
+  f->execs++;
+  return end;
+}
+
+/* add an input to the corpus, under lock */
+static void add_entry (const uint8_t *data, size_t len)
+{
+  struct entry *entry;
+
+  corpus = realloc (corpus, (ncorpus + 1) * sizeof (struct entry));
+  assert (corpus != NULL);
+  entry = &corpus[ncorpus];
+  entry->data = malloc (len + 1);
+  assert (entry->data != NULL);
+  memcpy (entry->data, data, len);
+  entry->len = len;
+  write_input ("queue", ncorpus++, data, len);
+}
+
+/* keep the input of f if it ran something new */
+static void evaluate (struct fuzzer *f, int end)
+{
+  uint8_t *hits = f->vm->edges->hits;
+  int found;
+
+  found = classify (hits, f->seen);
+  if (end == END_CRASH)
+    {
+      pthread_mutex_lock (&lock);
+      if (merge_classes (hits, crash_seen))
+        write_input ("crash", ncrashed++, f->input, f->len);
+      pthread_mutex_unlock (&lock);
+      return;
+    }
+  /* out of cycles before the stop given */
+  if (end == END_CYCLES && (stop_address >= 0 || pattern))
+    {
+      pthread_mutex_lock (&lock);
+      if (merge_classes (hits, hang_seen))
+        write_input ("hang", nhung++, f->input, f->len);
+      pthread_mutex_unlock (&lock);
+      return;
+    }
+  if (!found)
+    return;
+
+  pthread_mutex_lock (&lock);
+  if (merge_classes (hits, seen))
+    add_entry (f->input, f->len);
+  memcpy (f->seen, seen, sizeof (seen));
+  pthread_mutex_unlock (&lock);
+}
+
+/* take an input of the corpus, or the end of one after the start of
+   another */
+static void pick (struct fuzzer *f)
+{
+  const struct entry *first, *second;
+  size_t cut;
+
+  pthread_mutex_lock (&lock);
+  first = &corpus[next_random (f) % ncorpus];
+  memcpy (f->input, first->data, first->len);
+  f->len = first->len;
+  if (ncorpus > 1 && next_random (f) % 8 == 0)
+    {
+      second = &corpus[next_random (f) % ncorpus];
+      cut = next_random (f) % (f->len + 1);
+      if (second->len > cut)
+        {
+          memcpy (f->input + cut, second->data + cut, second->len - cut);
+          f->len = second->len;
+        }
+    }
+  pthread_mutex_unlock (&lock);
+}
+
+/* stack a few random changes on the input of f */
+static void mutate (struct fuzzer *f)
+{
+  static const uint8_t interesting[] = {
+    0x00, 0x01, 0x10, 0x20, 0x40, 0x64, 0x7F, 0x80, 0xFF, '\r', '\n'
+  };
+  uint8_t *data = f->input;
+  unsigned int n, at, len;
+
+  for (n = 2 << next_random (f) % 4; n > 0; n--)
+    {
+      at = f->len ? next_random (f) % f->len : 0;
+      switch (f->len ? next_random (f) % 8 : 4)
+        {
+        case 0:
+          data[at] ^= 1 << next_random (f) % 8;
+          break;
+        case 1:
+          data[at] = next_random (f);
+          break;
+        case 2:
+          data[at] = interesting[next_random (f) % sizeof (interesting)];
+          break;
+        case 3:
+          len = 1 + next_random (f) % 35;
+          data[at] += next_random (f) % 2 ? len : -len;
+          break;
+        case 4:
+          /* insert a byte */
+          if (f->len == max_len)
+            break;
+          at = next_random (f) % (f->len + 1);
+          memmove (data + at + 1, data + at, f->len - at);
+          data[at] = next_random (f);
+          f->len++;
+          break;
+        case 5:
+          /* delete some bytes */
+          len = 1 + next_random (f) % (f->len - at);
+          memmove (data + at, data + at + len, f->len - at - len);
+          f->len -= len;
+          break;
+        case 6:
+          /* repeat some bytes */
+          len = 1 + next_random (f) % (f->len - at);
+          if (len > max_len - f->len)
+            len = max_len - f->len;
+          memmove (data + at + len, data + at, f->len - at);
+          f->len += len;
+          break;
+        case 7:
+          /* copy some bytes elsewhere */
+          len = 1 + next_random (f) % (f->len - at);
+          memmove (data + next_random (f) % (f->len - len + 1), data + at,
+                   len);
+          break;
+        }
+    }
+}
+
+static void *worker (void *arg)
+{
+  struct fuzzer *f = arg;
+
+  while (!__atomic_load_n (&done, __ATOMIC_RELAXED))
+    {
+      pick (f);
+      mutate (f);
+      evaluate (f, run_input (f));
+      if ((f->execs & 0x3FF) == 0)
+        {
+          __atomic_fetch_add (&execs, f->execs, __ATOMIC_RELAXED);
+          f->execs = 0;
+        }
+    }
+  return NULL;
+}
+
+static void print_status (double seconds)
+{
+  uint64_t n = __atomic_load_n (&execs, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock (&lock);
+  printf ("%8.0f s  %12llu runs  %10.0f runs/s  %6u inputs  %6u edges  "
+          "%4u crashes  %4u hangs\n", seconds, (unsigned long long) n,
+          seconds > 0 ? n / seconds : 0.0, ncorpus, count_edges (seen),
+          ncrashed, nhung);
+  pthread_mutex_unlock (&lock);
+  fflush (stdout);
+}
+
+int main (int argc, char *argv[])
+{
+  const char *name = argv[0];
+  unsigned int nthreads = 1;
+  const char *cache_dir = NULL;
+  double seconds = 60, start, last;
+  struct image_cache cache;
+  struct fuzzer *fuzzers;
+  pthread_t *threads;
+  char error[80];
+  uint8_t *data;
+  size_t len;
+  unsigned int i;
+  int ret = 0, ok;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (sysconf (_SC_NPROCESSORS_ONLN) > 0)
+    nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  while (argc > 2 && argv[1][0] == '-')
+    {
+      if (strcmp (argv[1], "-j") == 0)
+        nthreads = strtoul (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-s") == 0)
+        seed = strtoull (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-c") == 0)
+        cache_dir = argv[2];
+      else if (strcmp (argv[1], "-b") == 0)
+        bank_sfr = strtoul (argv[2], NULL, 16) | 0x80;
+      else if (strcmp (argv[1], "-l") == 0)
+        checkpoint = argv[2];
+      else if (strcmp (argv[1], "-a") == 0)
+        ready = strtoul (argv[2], NULL, 16) & 0xFFFF;
+      else if (strcmp (argv[1], "-n") == 0)
+        ncy = strtoul (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-p") == 0)
+        stop_address = strtoul (argv[2], NULL, 16) & 0xFFFF;
+      else if (strcmp (argv[1], "-e") == 0)
+        pattern = argv[2];
+      else if (strcmp (argv[1], "-x") == 0)
+        {
+          crashes = realloc (crashes, (ncrashes + 1) * sizeof (uint16_t));
+          assert (crashes != NULL);
+          crashes[ncrashes++] = strtoul (argv[2], NULL, 16);
+        }
+      else if (strcmp (argv[1], "-m") == 0)
+        max_len = strtoul (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-t") == 0)
+        seconds = strtod (argv[2], NULL);
+      else if (strcmp (argv[1], "-o") == 0)
+        prefix = argv[2];
+      else
+        break;
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc < 2 || argv[1][0] == '-' || nthreads == 0 || max_len == 0
+      || (pattern && !*pattern))
+    {
+      fprintf (stderr, "Usage: %s [-j threads] [-s seed] [-c cache] "
+               "[-b sfr] [-l checkpoint] [-a address] [-n cycles] "
+               "[-p address] [-e pattern] [-x address]... [-m length] "
+               "[-t seconds] [-o prefix] input [seed-input...]\n", name);
+      free (crashes);
+      return -1;
+    }
+
+  init_image_cache (&cache, cache_dir);
+  ret = get_image (&cache, argv[1], &image);
+  if (ret == HEX_EOPEN)
+    fprintf (stderr, "%s: %s\n", argv[1], hex_strerror (ret));
+  else if (ret != HEX_OK)
+    fprintf (stderr, "%s:%u: %s\n", argv[1], cache.line,
+             hex_strerror (ret));
+  else if (image->len == 0)
+    {
+      fprintf (stderr, "%s: empty program\n", argv[1]);
+      put_image (&cache, image);
+      ret = -1;
+    }
+  if (ret != HEX_OK)
+    {
+      free_image_cache (&cache);
+      free (crashes);
+      return -1;
+    }
+
+  init_classes ();
+  fuzzers = calloc (nthreads, sizeof (struct fuzzer));
+  assert (fuzzers != NULL);
+  threads = malloc (nthreads * sizeof (pthread_t));
+  assert (threads != NULL);
+  start = now ();
+
+  /* the seeds, or an empty input, run in the first vm */
+  ok = boot (&fuzzers[0], 0, error, sizeof (error));
+  if (!ok)
+    fprintf (stderr, "%s\n", error);
+  for (i = 2; ok && i < (unsigned int) argc; i++)
+    {
+      data = read_file (argv[i], &len);
+      if (data == NULL)
+        {
+          perror (argv[i]);
+          continue;
+        }
+      fuzzers[0].len = len < max_len ? len : max_len;
+      memcpy (fuzzers[0].input, data, fuzzers[0].len);
+      free (data);
+      evaluate (&fuzzers[0], run_input (&fuzzers[0]));
+    }
+  if (ok && ncorpus == 0)
+    {
+      fuzzers[0].len = 0;
+      evaluate (&fuzzers[0], run_input (&fuzzers[0]));
+    }
+  /* the mutations need an input to start from, even one which crashed */
+  if (ok && ncorpus == 0)
+    add_entry (NULL, 0);
+
+  for (i = 1; ok && i < nthreads; i++)
+    {
+      ok = boot (&fuzzers[i], i, error, sizeof (error));
+      if (!ok)
+        fprintf (stderr, "%s\n", error);
+    }
+
+  if (ok)
+    {
+      for (i = 0; i < nthreads; i++)
+        pthread_create (&threads[i], NULL, worker, &fuzzers[i]);
+      last = now ();
+      while (now () - start < seconds)
+        {
+          sleep (1);
+          if (now () - last >= 10 && now () - start < seconds)
+            {
+              last = now ();
+              print_status (last - start);
+            }
+        }
+      __atomic_store_n (&done, 1, __ATOMIC_RELAXED);
+      for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+    }
+  for (i = 0; i < nthreads; i++)
+    shut_down (&fuzzers[i]);
+  if (ok)
+    print_status (now () - start);
+
+  ret = !ok ? -1 : (ncrashed || nhung) ? 1 : 0;
+  put_image (&cache, image);
+  free_image_cache (&cache);
+  for (i = 0; i < ncorpus; i++)
+    free (corpus[i].data);
+  free (corpus);
+  free (crashes);
+  free (threads);
+  free (fuzzers);
+  return ret;
+}
@@ -0,0 +1,200 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Run a program and count the pairs of opcodes executed one after the
+   other, the second falling through from the first, to choose the
+   superinstructions of predecode8051. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vm/lib8051.h>
+#include <print/lib8051print.h>
+#include <utils/libhexbin.h>
+#include <utils/libimagecache.h>
+#include <utils/libtools.h>
+
+#include <vm/lib8051globals.h>
+
+struct pair
+{
+  uint64_t count;
+  uint8_t first[4];             /* an instance of each instruction */
+  uint8_t second[4];
+  uint16_t address;
+};
+
+static struct pair pairs[256][256];
+
+static int compare_pairs (const void *a, const void *b)
+{
+  const struct pair *p = *(const struct pair * const *) a;
+  const struct pair *q = *(const struct pair * const *) b;
+
+  if (p->count != q->count)
+    return p->count < q->count ? 1 : -1;
+  if (p->first[0] != q->first[0])
+    return p->first[0] - q->first[0];
+  return p->second[0] - q->second[0];
+}
+
+/* mnemonic of inst without the padding */
+static void sprint_inst (char *str, uint8_t *inst, uint16_t address)
+{
+  size_t len;
+
+  sprint_op (str, inst, address);
+  len = strlen (str);
+  while (len > 0 && str[len - 1] == ' ')
+    str[--len] = '\0';
+}
+
+/* step the program for ncy cycles */
+static uint64_t mine_pairs (struct vm8051 *vm, uint32_t ncy)
+{
+  uint8_t prev[4], output[256];
+  uint16_t address, expected = 0;
+  uint32_t steps = 0;
+  int chained = 0;
+  uint64_t total = 0;
+  struct pair *pair;
+
+  while (cycles < ncy && !(PCON & PD_MASK))
+    {
+      if (PCON & IDL_MASK)
+        {
+          operate8051 (vm);
+          chained = 0;
+          continue;
+        }
+      address = PC;
+      fetch8051 (vm);
+      /* nothing came in between: no jump, no interrupt */
+      if (chained && address == expected)
+        {
+          pair = &pairs[prev[0]][IR[0]];
+          if (!pair->count++)
+            {
+              memcpy (pair->first, prev, 4);
+              memcpy (pair->second, IR, 4);
+              pair->address = address - prev[3];
+            }
+          total++;
+        }
+      memcpy (prev, IR, 4);
+      expected = PC;
+      chained = 1;
+      operate8051 (vm);
+      /* drop the serial output before it fills the port, a byte per
+         instruction at most */
+      if ((++steps & 0xFF) == 0)
+        while (read_uart (vm, output, sizeof (output)) > 0)
+          ;
+    }
+  return total;
+}
+
+static void print_pairs (uint64_t total, unsigned int top)
+{
+  struct pair **sorted;
+  char first[80], second[80];
+  unsigned int i, j, n = 0;
+  uint64_t fused = 0;
+
+  sorted = malloc (256 * 256 * sizeof (struct pair *));
+  assert (sorted != NULL);
+  for (i = 0; i < 256; i++)
+    for (j = 0; j < 256; j++)
+      if (pairs[i][j].count)
+        {
+          sorted[n++] = &pairs[i][j];
+          if (fuse8051 (i, j))
+            fused += pairs[i][j].count;
+        }
+  qsort (sorted, n, sizeof (struct pair *), compare_pairs);
+
+  printf ("%llu pairs, %u distinct, %.2f%% fused\n\n",
+          (unsigned long long) total, n,
+          total ? 100.0 * fused / total : 0.0);
+  printf ("     count       %%  opcodes  example\n");
+  for (i = 0; i < n && i < top; i++)
+    {
+      sprint_inst (first, sorted[i]->first, sorted[i]->address);
+      sprint_inst (second, sorted[i]->second,
+                   sorted[i]->address + sorted[i]->first[3]);
+      printf ("%10llu  %5.2f%%  %02X %02X    %s; %s%s\n",
+              (unsigned long long) sorted[i]->count,
+              100.0 * sorted[i]->count / total,
+              sorted[i]->first[0], sorted[i]->second[0], first, second,
+              fuse8051 (sorted[i]->first[0], sorted[i]->second[0])
+              ? "  (fused)" : "");
+    }
+  free (sorted);
+}
+
+int main (int argc, char *argv[])
+{
+  const char *name = argv[0];
+  uint32_t ncy = 10000000;
+  unsigned int top = 30;
+  struct vm8051 *vm;
+  struct image_cache cache;
+  const struct code_image *image;
+  int error, ret = 0;
+
+  while (argc > 2 && argv[1][0] == '-')
+    {
+      if (strcmp (argv[1], "-n") == 0)
+        ncy = strtoul (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-k") == 0)
+        top = strtoul (argv[2], NULL, 0);
+      else
+        break;
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: %s [-n cycles] [-k count] input\n", name);
+      return -1;
+    }
+  init_image_cache (&cache, NULL);
+  error = get_image (&cache, argv[1], &image);
+  if (error == HEX_OK && image->len > 0)
+    {
+      vm = new_vm_from_image (image, 0, 1 << 16, 0);
+      print_pairs (mine_pairs (vm, ncy), top);
+      free_vm (vm);
+    }
+  else
+    {
+      if (error == HEX_EOPEN)
+        fprintf (stderr, "%s: %s\n", argv[1], hex_strerror (error));
+      else if (error != HEX_OK)
+        fprintf (stderr, "%s:%u: %s\n", argv[1], cache.line,
+                 hex_strerror (error));
+      else
+        fprintf (stderr, "%s: empty program\n", argv[1]);
+      ret = -1;
+    }
+  if (image)
+    put_image (&cache, image);
+  free_image_cache (&cache);
+  return ret;
+}
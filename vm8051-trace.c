@@ -0,0 +1,330 @@
+/* Copyright (C) 2014 Luk Bettale
+
+   This file is part of VM8051.
+
+   VM8051 is free software: you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation, either version 3 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with VM8051.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Regenerate the detailed trace of segments of a run recorded as a chain
+   of checkpoints by vm8051 --run -k, on a pool of threads.  Each segment
+   starts from the last checkpoint before it in its own vm and goes to its
+   own file, so that the files put end to end give the trace of the whole
+   run. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vm/lib8051.h>
+#include <print/lib8051print.h>
+#include <utils/libhexbin.h>
+#include <utils/libimagecache.h>
+#include <utils/libtools.h>
+
+#define FORMAT_INST 0           /* a line per instruction */
+#define FORMAT_LEAK 1           /* a byte per instruction */
+
+struct segment
+{
+  uint64_t from;                /* cycles of the chain */
+  uint64_t to;
+  char *path;
+
+  /* results */
+  uint64_t insts;
+  double seconds;
+  char error[80];
+};
+
+static const struct code_image *image;
+static uint8_t bank_sfr = 0;
+static struct chain8051 chain;
+static int format = FORMAT_INST;
+static struct segment *segments = NULL;
+static unsigned int nsegments = 0;
+static unsigned int next_segment = 0;
+
+static void add_segment (uint64_t from, uint64_t to, const char *prefix)
+{
+  struct segment segment;
+  char path[4096];
+
+  memset (&segment, 0, sizeof (struct segment));
+  segment.from = from;
+  segment.to = to;
+  /* the names sort as the segments */
+  snprintf (path, sizeof (path), "%s.%016llu", prefix,
+            (unsigned long long) from);
+  segment.path = strdup (path);
+  segments = realloc (segments, (nsegments + 1) * sizeof (struct segment));
+  assert (segments != NULL);
+  segments[nsegments++] = segment;
+}
+
+static unsigned int hamming_weight (uint8_t byte)
+{
+  unsigned int weight = 0;
+
+  for (; byte; byte >>= 1)
+    weight += byte & 1;
+  return weight;
+}
+
+/* trace the instruction vm just ran from address, started at cycle */
+static void trace_inst (struct vm8051 *vm, FILE *stream, uint64_t cycle,
+                        uint16_t address)
+{
+  char op[80];
+
+  if (format == FORMAT_LEAK)
+    {
+      putc (hamming_weight (vm->A), stream);
+      return;
+    }
+  sprint_op (op, vm->IR, address);
+  fprintf (stream, "%llu %04X %s A=%02X PSW=%02X SP=%02X DPTR=%02X%02X\n",
+           (unsigned long long) cycle, address, op, vm->A, vm->PSW,
+           vm->SP, vm->DPH, vm->DPL);
+}
+
+/* run a segment from the last checkpoint before it */
+static void run_segment (struct segment *segment)
+{
+  struct vm8051 *vm;
+  uint64_t cycle = segment->from;
+  uint32_t first, steps = 0;
+  uint16_t address;
+  uint8_t output[256];
+  FILE *stream;
+  double start;
+  int error;
+
+  stream = fopen (segment->path, "wb");
+  if (stream == NULL)
+    {
+      snprintf (segment->error, sizeof (segment->error),
+                "cannot write %s", segment->path);
+      return;
+    }
+
+  vm = new_vm_from_image (image, bank_sfr, 1 << 16, 0);
+  error = seek8051 (vm, &chain, &cycle);
+  if (error != CHECKPOINT_OK)
+    snprintf (segment->error, sizeof (segment->error), "%s",
+              checkpoint_strerror (error));
+
+  first = vm->cycles;
+  start = now ();
+  while (error == CHECKPOINT_OK && !PD (vm))
+    {
+      uint64_t at = cycle + (uint32_t) (vm->cycles - first);
+
+      if (at >= segment->to)
+        break;
+      if (IDL (vm))
+        {
+          operate8051 (vm);
+          continue;
+        }
+      address = vm->PC;
+      fetch8051 (vm);
+      operate8051 (vm);
+      if (at >= segment->from)
+        {
+          trace_inst (vm, stream, at, address);
+          segment->insts++;
+        }
+      /* drop the serial output before it fills the port, a byte per
+         instruction at most */
+      if ((++steps & 0xFF) == 0)
+        while (read_uart (vm, output, sizeof (output)) > 0)
+          ;
+    }
+  segment->seconds = now () - start;
+
+  if (fclose (stream) != 0 && !segment->error[0])
+    snprintf (segment->error, sizeof (segment->error),
+              "cannot write %s", segment->path);
+
+  free_vm (vm);
+}
+
+static void *worker (void *arg)
+{
+  unsigned int i;
+
+  (void) arg;
+  while ((i = __atomic_fetch_add (&next_segment, 1, __ATOMIC_RELAXED))
+         < nsegments)
+    run_segment (&segments[i]);
+  return NULL;
+}
+
+static int print_segments (double seconds)
+{
+  unsigned int i, failed = 0;
+  uint64_t total = 0;
+
+  printf ("            from              to    instructions    time (s)  "
+          "file\n");
+  for (i = 0; i < nsegments; i++)
+    {
+      struct segment *segment = &segments[i];
+
+      printf ("%16llu  %14llu  %14llu  %10.3f  %s",
+              (unsigned long long) segment->from,
+              (unsigned long long) segment->to,
+              (unsigned long long) segment->insts, segment->seconds,
+              segment->path);
+      if (segment->error[0])
+        printf ("  (%s)", segment->error);
+      printf ("\n");
+      failed += segment->error[0] != '\0';
+      total += segment->insts;
+    }
+  printf ("\n%u segments, %u failed, %llu instructions in %.3f s\n",
+          nsegments, failed, (unsigned long long) total, seconds);
+  return failed;
+}
+
+int main (int argc, char *argv[])
+{
+  const char *name = argv[0];
+  unsigned int nthreads = 1;
+  const char *cache_dir = NULL;
+  const char *prefix = "trace";
+  struct image_cache cache;
+  unsigned int i;
+  pthread_t *threads;
+  uint64_t *at;
+  size_t n;
+  double start;
+  int error, ret = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (sysconf (_SC_NPROCESSORS_ONLN) > 0)
+    nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  while (argc > 3 && argv[1][0] == '-')
+    {
+      if (strcmp (argv[1], "-j") == 0)
+        nthreads = strtoul (argv[2], NULL, 0);
+      else if (strcmp (argv[1], "-c") == 0)
+        cache_dir = argv[2];
+      else if (strcmp (argv[1], "-b") == 0)
+        bank_sfr = strtoul (argv[2], NULL, 16) | 0x80;
+      else if (strcmp (argv[1], "-o") == 0)
+        prefix = argv[2];
+      else if (strcmp (argv[1], "-f") == 0 && strcmp (argv[2], "inst") == 0)
+        format = FORMAT_INST;
+      else if (strcmp (argv[1], "-f") == 0 && strcmp (argv[2], "leak") == 0)
+        format = FORMAT_LEAK;
+      else
+        break;
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc < 3 || argv[1][0] == '-' || nthreads == 0)
+    {
+      fprintf (stderr, "Usage: %s [-j threads] [-c cache] [-b sfr] "
+               "[-f inst|leak] [-o prefix] input checkpoint "
+               "[from:to...]\n", name);
+      return -1;
+    }
+
+  chain.data = read_file (argv[2], &chain.len);
+  if (chain.data == NULL)
+    {
+      perror (argv[2]);
+      return -1;
+    }
+  chain.size = chain.len;
+  n = checkpoints8051 (&chain, NULL, 0);
+  if (n == 0)
+    {
+      fprintf (stderr, "%s: %s\n", argv[2],
+               checkpoint_strerror (CHECKPOINT_EFORMAT));
+      free_chain8051 (&chain);
+      return -1;
+    }
+
+  /* each segment between two checkpoints by default */
+  if (argc == 3)
+    {
+      at = malloc (n * sizeof (uint64_t));
+      assert (at != NULL);
+      checkpoints8051 (&chain, at, n);
+      for (i = 0; i + 1 < n; i++)
+        if (at[i + 1] > at[i])
+          add_segment (at[i], at[i + 1], prefix);
+      free (at);
+    }
+  for (i = 3; i < (unsigned int) argc; i++)
+    {
+      char *end;
+      uint64_t from, to;
+
+      from = strtoull (argv[i], &end, 0);
+      if (*end != ':')
+        break;
+      to = strtoull (end + 1, &end, 0);
+      if (*end != '\0' || to <= from)
+        break;
+      add_segment (from, to, prefix);
+    }
+  if (i < (unsigned int) argc)
+    {
+      fprintf (stderr, "%s: invalid segment\n", argv[i]);
+      ret = -1;
+    }
+
+  init_image_cache (&cache, cache_dir);
+  error = get_image (&cache, argv[1], &image);
+  if (error == HEX_EOPEN)
+    fprintf (stderr, "%s: %s\n", argv[1], hex_strerror (error));
+  else if (error != HEX_OK)
+    fprintf (stderr, "%s:%u: %s\n", argv[1], cache.line,
+             hex_strerror (error));
+  else if (image->len == 0)
+    fprintf (stderr, "%s: empty program\n", argv[1]);
+  if (error != HEX_OK || image->len == 0)
+    ret = -1;
+
+  if (ret == 0)
+    {
+      if (nthreads > nsegments)
+        nthreads = nsegments ? nsegments : 1;
+      threads = malloc (nthreads * sizeof (pthread_t));
+      assert (threads != NULL);
+      start = now ();
+      for (i = 0; i < nthreads; i++)
+        pthread_create (&threads[i], NULL, worker, NULL);
+      for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+      if (print_segments (now () - start))
+        ret = 1;
+      free (threads);
+    }
+
+  if (error == HEX_OK)
+    put_image (&cache, image);
+  for (i = 0; i < nsegments; i++)
+    free (segments[i].path);
+  free (segments);
+  free_chain8051 (&chain);
+  free_image_cache (&cache);
+  return ret;
+}
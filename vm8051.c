@@ -21,23 +21,28 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <vm/lib8051.h>
 #include <vm/lib8051coprocessors.h>
 #include <copros/copro_RNG.h>
 #include <print/lib8051print.h>
 #include <utils/libhexbin.h>
+#include <utils/libimagecache.h>
 
 /* simulate global variables for a struct vm8051 *vm */
 #include <vm/lib8051globals.h>
 
-unsigned int inbuf_idx = 0;
-unsigned int inbuf_len = 0;
-char inbuf[1024];
-unsigned int outbuf_len = 0;
-char outbuf[1024];
+/* what the vm transmitted since the last clear */
+uint8_t *outbuf = NULL;
+size_t outbuf_len = 0;
+size_t outbuf_size = 0;
 int hex_mode = 0;
 
+/* names of the code addresses, NULL if none were given */
+char **symbols = NULL;
+
 /* convert hexadecimal char to int */
 static int dhx (char c)
 {
@@ -60,39 +65,56 @@ static char hxd (int i)
   return 'G';
 }
 
-static void read_inbuf (char *buffer)
+/* send buffer to the serial port, return 0 if it did not fit */
+static int read_inbuf (struct vm8051 *vm, char *buffer)
 {
-  unsigned int i;
+  uint8_t data[1024];
+  size_t i, len;
+
+  len = strlen (buffer);
   if (!hex_mode)
     {
-      for (i = 0; i < strlen (buffer); i++)
-        inbuf[i] = buffer[i];
+      for (i = 0; i < len && i < sizeof (data); i++)
+        data[i] = buffer[i];
     }
   else
     {
-      for (i = 0; i < (strlen (buffer) >> 1); i++)
-        inbuf[i] = (dhx (buffer[i << 1]) << 4) | dhx (buffer[(i << 1) + 1]);
+      for (i = 0; i < (len >> 1) && i < sizeof (data); i++)
+        data[i] = (dhx (buffer[i << 1]) << 4) | dhx (buffer[(i << 1) + 1]);
     }
-  inbuf_len += i;
+  return write_uart (vm, data, i) == i;
 }
 
-static void write_outbuf (char *buffer)
+/* collect what the vm transmitted */
+static void read_outbuf (struct vm8051 *vm)
 {
-  unsigned int i;
-  if (!hex_mode)
-    {
-      for (i = 0; i < outbuf_len; i++)
-        buffer[i] = outbuf[i];
-    }
-  else
+  size_t n;
+
+  do
     {
-      for (i = 0; i < outbuf_len << 1; i += 2)
+      if (outbuf_len == outbuf_size)
         {
-          buffer[i] = hxd ((outbuf[i >> 1] >> 4) & 0xF);
-          buffer[i+1] = hxd (outbuf[i >> 1] & 0xF);
+          outbuf_size = outbuf_size ? 2 * outbuf_size : 1024;
+          outbuf = realloc (outbuf, outbuf_size);
+          assert (outbuf != NULL);
         }
+      n = read_uart (vm, outbuf + outbuf_len, outbuf_size - outbuf_len);
+      outbuf_len += n;
+    }
+  while (n > 0);
+}
+
+static void print_outbuf (void)
+{
+  size_t i;
+
+  for (i = 0; i < outbuf_len; i++)
+    {
+      if (!hex_mode)
+        printf ("%c", outbuf[i]);
+      else
+        printf ("%c%c", hxd ((outbuf[i] >> 4) & 0xF), hxd (outbuf[i] & 0xF));
     }
-  buffer[i] = 0;
 }
 
 static void dump8051_data (struct vm8051 *vm)
@@ -129,7 +151,7 @@ static void dump8051_xdata (struct vm8051 *vm, unsigned int page)
     {
       if ((i & 0x0F) == 0x00)
         printf ("0x%04X: ", i);
-      printf ("%02X ", _xdata[i]);
+      printf ("%02X ", peek_xdata (vm, i));
       if ((i & 0x0F) == 0x0F)
         printf ("\n");
     }
@@ -138,7 +160,6 @@ static void dump8051_xdata (struct vm8051 *vm, unsigned int page)
 static void dump8051 (struct vm8051 *vm, int minimal)
 {
   uint8_t next_IR[4];
-  char iobuf[512];
 
   printf ("Regs");
   if (!minimal)
@@ -257,6 +278,12 @@ static void dump8051 (struct vm8051 *vm, int minimal)
   printf ("Sys");
   if (interrupted)
     printf (" (interrupted, %d)", interrupted & HIGH ? 1 : 0);
+  if (vm->banks)
+    printf (" (bank %u)", current_bank (vm));
+  if (PD)
+    printf (" (power-down)");
+  else if (IDL)
+    printf (" (idle)");
   printf ("\n");
   printf ("A    : 0x%02X    %x%x%x%x%x%x%x%xb", A,
           (A&0x80)>>7, (A&0x40)>>6, (A&0x20)>>5, (A&0x10)>>4,
@@ -296,10 +323,10 @@ static void dump8051 (struct vm8051 *vm, int minimal)
               PT1?"PT1":"   ", PX1?"PX1":"   ",
               PT0?"PT0":"   ", PX0?"PX0":"   ");
       printf ("PCON : 0x%02X   %s %s %s %s %s %s %s %s\n", PCON,
-              PCON&0x80?"SMOD":"    ", PCON&0x40?" # ":"   ",
+              SMOD?"SMOD":"    ", PCON&0x40?" # ":"   ",
               PCON&0x20?" # ":"   ", PCON&0x10?" # ":"   ",
-              PCON&0x08?" # ":"   ", PCON&0x04?" # ":"   ",
-              PCON&0x02?" # ":"   ", PCON&0x01?" # ":"   ");
+              GF1?"GF1":"   ", GF0?"GF0":"   ",
+              PD?" PD":"   ", IDL?"IDL":"   ");
       printf ("TCON : 0x%02X    %s %s %s %s %s %s %s %s\n", TCON,
               TF1?"TF1":"   ", TR1?"TR1":"   ",
               TF0?"TF0":"   ", TR0?"TR0":"   ",
@@ -366,9 +393,8 @@ static void dump8051 (struct vm8051 *vm, int minimal)
 #endif
   printf ("----------------------------------------"
           "----------------------------------------\n");
-  write_outbuf (iobuf);
-  for (unsigned int i = 0; i < strlen (iobuf); i++)
-    printf ("%c", iobuf[i]);
+  read_outbuf (vm);
+  print_outbuf ();
   printf ("\n");
   printf ("----------------------------------------"
           "----------------------------------------\n");
@@ -397,27 +423,277 @@ static int array_remove (int len, unsigned int *array, unsigned int elt)
   return -1;
 }
 
-static void wrap_operate8051 (struct vm8051 *vm)
+/* the last instructions run, to step back at once */
+#define UNDO_RECORDS 65536
+static struct undolog8051 *undo = NULL;
+
+/* fast-forward delay and idle loops, unless the loop crosses a
+   breakpoint; what it skips cannot be undone */
+static void wrap_skip8051 (struct vm8051 *vm, unsigned int address,
+                           unsigned int ncy, unsigned int *breakpoints)
 {
-  int prev_TI;
+  uint8_t opcode = _code[PC];
+  uint32_t changes = vm->sched.changes;
+
+  if (array_contains (256, breakpoints, (uint16_t) (PC - 2)))
+    return;
+  /* only loops can be skipped, as in sim8051 */
+  if (!(PCON & IDL_MASK) && opcode != 0x80 && opcode != 0xD5
+      && (opcode & 0xF8) != 0xD8 && opcode != 0x30)
+    return;
+  if (skip8051 (vm, address, ncy) || vm->sched.changes != changes)
+    clear_undo8051 (undo);
+}
+
+/* The interactive mode keeps the past states in a chain of checkpoints,
+   one every HISTORY_PERIOD cycles and one after each command changing
+   the state, counted in cycles since the last reset.  The vm runs the
+   same way from a checkpoint until the next change, so any past state is
+   found by loading the last checkpoint before it and running the code
+   again; the output transmitted until then is cut back as well. */
+#define HISTORY_PERIOD 1000000
+
+struct history_mark
+{
+  uint64_t cycle;
+  size_t outbuf_len;
+};
+
+static struct chain8051 history;
+static struct history_mark *marks = NULL;
+static size_t nmarks = 0;
+static size_t marks_size = 0;
+static uint64_t history_cycle;  /* history time at the cycles below */
+static uint32_t history_cycles;
+static int history_off = 0;     /* the state could not be saved */
 
-  if (REN && !RI && inbuf_idx < inbuf_len)
+/* the current time in the history */
+static uint64_t history_now (struct vm8051 *vm)
+{
+  return history_cycle + (int32_t) (cycles - history_cycles);
+}
+
+/* add a checkpoint of the current state to the history */
+static void history_push (struct vm8051 *vm)
+{
+  uint64_t cycle;
+
+  read_outbuf (vm);
+  if (push8051 (vm, &history, &cycle) != CHECKPOINT_OK)
     {
-      SBUF = inbuf[inbuf_idx++];
-      SCON |= RI_MASK;
-      if (inbuf_idx == inbuf_len)
+      history_off = 1;
+      return;
+    }
+  if (nmarks == marks_size)
+    {
+      marks_size = marks_size ? 2 * marks_size : 64;
+      marks = realloc (marks, marks_size * sizeof (struct history_mark));
+      assert (marks != NULL);
+    }
+  marks[nmarks].cycle = cycle;
+  marks[nmarks].outbuf_len = outbuf_len;
+  nmarks++;
+  history_cycle = cycle;
+  history_cycles = cycles;
+}
+
+/* start the history again from the current state */
+static void history_clear (struct vm8051 *vm)
+{
+  free_chain8051 (&history);
+  clear_undo8051 (undo);
+  nmarks = 0;
+  history_off = 0;
+  history_push (vm);
+}
+
+/* the state was changed at cycle of the history: what came after it
+   does not happen any more */
+static void history_change (struct vm8051 *vm, uint64_t cycle)
+{
+  if (history_off)
+    return;
+  cut8051 (&history, cycle);
+  while (nmarks > 0 && marks[nmarks - 1].cycle > cycle)
+    nmarks--;
+  history_push (vm);
+}
+
+/* take a checkpoint if the last one is HISTORY_PERIOD cycles away */
+static void history_tick (struct vm8051 *vm)
+{
+  if (!history_off
+      && history_now (vm) >= marks[nmarks - 1].cycle + HISTORY_PERIOD)
+    history_push (vm);
+}
+
+/* load the last checkpoint of the history at or before cycle */
+static void history_load (struct vm8051 *vm, uint64_t cycle)
+{
+  size_t i;
+
+  seek8051 (vm, &history, &cycle);
+  clear_undo8051 (undo);
+  for (i = nmarks; i > 1 && marks[i - 1].cycle > cycle; i--)
+    continue;
+  outbuf_len = marks[i - 1].outbuf_len;
+  history_cycle = cycle;
+  history_cycles = cycles;
+}
+
+/* go to cycle of the history, which is an instruction boundary */
+static void history_seek (struct vm8051 *vm, uint64_t cycle)
+{
+  history_load (vm, cycle);
+  while (history_now (vm) < cycle && !PD)
+    {
+      fetch8051 (vm);
+      operate8051 (vm);
+    }
+}
+
+/* go back to the last instruction before the current one, or the last
+   one at a breakpoint if breakpoints is not NULL; return 0 if there is
+   none in the history, going to its start */
+static int history_back (struct vm8051 *vm, unsigned int *breakpoints)
+{
+  struct profile8051 *profile = vm->profile;
+  uint64_t end = history_now (vm);
+  uint64_t now, found = 0;
+  int any;
+
+  /* what runs again was already profiled */
+  vm->profile = NULL;
+  while (end > marks[0].cycle)
+    {
+      /* run again from the checkpoint before end to find the last
+         instruction before it */
+      history_load (vm, end - 1);
+      any = 0;
+      while ((now = history_now (vm)) < end && !PD)
+        {
+          if (!breakpoints || array_contains (256, breakpoints, PC))
+            {
+              found = now;
+              any = 1;
+            }
+          fetch8051 (vm);
+          operate8051 (vm);
+        }
+      if (any)
         {
-          inbuf_idx = 0;
-          inbuf_len = 0;
-          inbuf[0] = 0;
+          history_seek (vm, found);
+          vm->profile = profile;
+          return 1;
         }
+      end = history_cycle;
     }
+  history_seek (vm, marks[0].cycle);
+  vm->profile = profile;
+  return 0;
+}
+
+/* read the names of the code addresses from path, a line for each with
+   the address in hexadecimal then the name; return 0 if it cannot be
+   read */
+static int read_symbols (const char *path)
+{
+  FILE *stream;
+  char line[256];
+  char name[64];
+  unsigned int address;
+
+  stream = fopen (path, "r");
+  if (stream == NULL)
+    return 0;
+  symbols = calloc (65536, sizeof (char *));
+  assert (symbols != NULL);
+  while (fgets (line, sizeof (line), stream) != NULL)
+    if (sscanf (line, "%x %63s", &address, name) == 2 && address < 65536)
+      {
+        free (symbols[address]);
+        symbols[address] = malloc (strlen (name) + 1);
+        assert (symbols[address] != NULL);
+        strcpy (symbols[address], name);
+      }
+  fclose (stream);
+  return 1;
+}
 
-  prev_TI = TI;
-  operate8051 (vm);
+static void free_symbols (void)
+{
+  unsigned int address;
 
-  if (prev_TI == 0 && TI == 1)
-    outbuf[outbuf_len++] = SBUF;
+  if (symbols == NULL)
+    return;
+  for (address = 0; address < 65536; address++)
+    free (symbols[address]);
+  free (symbols);
+  symbols = NULL;
+}
+
+/* print the n addresses and the n functions which took the most cycles to
+   stream, all of them if n is 0 */
+static void print_profile (struct vm8051 *vm, FILE *stream, unsigned int n)
+{
+  struct function8051 *functions;
+  uint16_t *addresses;
+  uint64_t total = 0;
+  unsigned int i, count, max = n;
+  uint32_t address;
+  uint8_t inst[4];
+  char op[80];
+  size_t len;
+
+  addresses = malloc (65536 * sizeof (uint16_t));
+  assert (addresses != NULL);
+  for (address = 0; address < 65536; address++)
+    total += vm->profile->spent[address];
+  count = hot_spots (vm, addresses, 65536);
+  if (n == 0 || n > count)
+    n = count;
+  fprintf (stream, "      cycles        %%  instructions  address  "
+           "instruction\n");
+  for (i = 0; i < n; i++)
+    {
+      address = addresses[i];
+      inst8051 (vm, inst, address);
+      sprint_op (op, inst, address);
+      len = strlen (op);
+      while (len > 0 && op[len - 1] == ' ')
+        op[--len] = '\0';
+      fprintf (stream, "%12llu  %6.2f%%  %12llu  %04X     %s\n",
+               (unsigned long long) vm->profile->spent[address],
+               100.0 * vm->profile->spent[address] / total,
+               (unsigned long long) vm->profile->insts[address],
+               (unsigned int) address, op);
+    }
+  fprintf (stream, "%llu cycles at %u addresses\n",
+           (unsigned long long) total, count);
+  free (addresses);
+
+  functions = malloc (65536 * sizeof (struct function8051));
+  assert (functions != NULL);
+  count = hot_functions (vm, functions, 65536);
+  n = max;
+  if (n == 0 || n > count)
+    n = count;
+  fprintf (stream, "\n   inclusive        %%     exclusive         calls  "
+           "function\n");
+  for (i = 0; i < n; i++)
+    {
+      fprintf (stream, "%12llu  %6.2f%%  %12llu  %12llu  ",
+               (unsigned long long) functions[i].inclusive,
+               100.0 * functions[i].inclusive / total,
+               (unsigned long long) functions[i].exclusive,
+               (unsigned long long) functions[i].calls);
+      if (symbols && symbols[functions[i].address])
+        fprintf (stream, "%s\n", symbols[functions[i].address]);
+      else
+        fprintf (stream, "%04X\n", functions[i].address);
+    }
+  fprintf (stream, "%u functions\n", count);
+  free (functions);
 }
 
 static void run8051 (struct vm8051 *vm, int minimal)
@@ -429,13 +705,16 @@ static void run8051 (struct vm8051 *vm, int minimal)
   unsigned int nbp = 0;
   int command = 0;
   int end = 0;
-  char iobuf[512];
+  int error;
+  char iobuf[1025];
 
   for (i = 0; i < 256; i++)
     {
       ind_stack[i] = i;
       breakpoints[i] = -1;
     }
+  undo = alloc_undo8051 (UNDO_RECORDS);
+  history_clear (vm);
 
   while (!end)
     {
@@ -446,8 +725,11 @@ static void run8051 (struct vm8051 *vm, int minimal)
       unsigned int ncy = 0;
       char opcode[6];
       uint8_t next_IR[4];
+      uint64_t before = history_now (vm);
+      int changed = 0;
 
-      if (command != 'i' && command != 'x' && command != 'f')
+      if (command != 'i' && command != 'x' && command != 'f'
+          && command != 'o')
         {
           dump8051 (vm, minimal);
         }
@@ -460,8 +742,8 @@ static void run8051 (struct vm8051 *vm, int minimal)
         case 's':
         case '\n':
           /* step instruction */
-          fetch8051 (vm);
-          wrap_operate8051 (vm);
+          record8051 (vm, undo);
+          history_tick (vm);
           break;
         case EOF:
           printf ("\n");
@@ -474,15 +756,51 @@ static void run8051 (struct vm8051 *vm, int minimal)
           break;
         case 'r':
           /* reset VM */
-          inbuf_idx = 0;
-          inbuf_len = 0;
+          clear_uart (vm);
           outbuf_len = 0;
           reset8051 (vm);
+          history_clear (vm);
+          clear_profile (vm);
           sprintf (info, "vm reset");
           break;
+        case 'S':
+          /* save a checkpoint */
+          ret = scanf (" %1024[^\n]", iobuf);
+          if (ret != 1)
+            {
+              sprintf (info, "%c: file name required", command);
+              break;
+            }
+          error = save8051 (vm, iobuf);
+          if (error != CHECKPOINT_OK)
+            sprintf (info, "%c: %.60s", command, checkpoint_strerror (error));
+          else
+            sprintf (info, "checkpoint saved at cycle %u", cycles);
+          break;
+        case 'L':
+          /* load a checkpoint */
+          ret = scanf (" %1024[^\n]", iobuf);
+          if (ret != 1)
+            {
+              sprintf (info, "%c: file name required", command);
+              break;
+            }
+          outbuf_len = 0;
+          error = load8051 (vm, iobuf);
+          if (error != CHECKPOINT_OK)
+            {
+              reset8051 (vm);
+              sprintf (info, "%c: %.50s, vm reset", command,
+                       checkpoint_strerror (error));
+            }
+          else
+            sprintf (info, "checkpoint loaded at cycle %u", cycles);
+          history_clear (vm);
+          break;
         case 'z':
           /* reset states to zero */
           cycles = 0;
+          history_clear (vm);
           break;
         case 'b':
           /* add breakpoint */
@@ -522,11 +840,13 @@ static void run8051 (struct vm8051 *vm, int minimal)
               break;
             }
           PC = (uint16_t) address;
+          changed = 1;
           sprintf (info, "PC set to 0x%04X", address);
           break;
         case 'k':
           /* skip instruction */
           fetch8051 (vm);
+          changed = 1;
           sprintf (info, "instruction skipped");
           break;
         case 'n':
@@ -534,12 +854,16 @@ static void run8051 (struct vm8051 *vm, int minimal)
           address = PC + inst8051 (vm, next_IR, PC);
           do
             {
-              fetch8051 (vm);
-              wrap_operate8051 (vm);
+              wrap_skip8051 (vm, address, -1, breakpoints);
+              record8051 (vm, undo);
+              history_tick (vm);
             }
-          while (PC != address && !array_contains (256, breakpoints, PC));
+          while (PC != address && !array_contains (256, breakpoints, PC)
+                 && !PD);
           if (PC == address)
             sprintf (info, "next line");
+          else if (PD)
+            sprintf (info, "power-down");
           else
             sprintf (info, "breakpoint reached: 0x%04X", PC);
           break;
@@ -556,12 +880,16 @@ static void run8051 (struct vm8051 *vm, int minimal)
           /* continue execution */
           do
             {
-              fetch8051 (vm);
-              wrap_operate8051 (vm);
+              wrap_skip8051 (vm, address, -1, breakpoints);
+              record8051 (vm, undo);
+              history_tick (vm);
             }
-          while (PC != address && !array_contains (256, breakpoints, PC));
+          while (PC != address && !array_contains (256, breakpoints, PC)
+                 && !PD);
           if (PC == address)
             sprintf (info, "run to 0x%04X", address);
+          else if (PD)
+            sprintf (info, "power-down");
           else
             sprintf (info, "breakpoint reached: 0x%04X", PC);
           break;
@@ -577,11 +905,15 @@ static void run8051 (struct vm8051 *vm, int minimal)
           ncy += cycles;
           do
             {
-              fetch8051 (vm);
-              wrap_operate8051 (vm);
+              wrap_skip8051 (vm, address, ncy, breakpoints);
+              record8051 (vm, undo);
+              history_tick (vm);
             }
-          while (cycles < ncy && !array_contains (256, breakpoints, PC));
-          if (cycles < ncy)
+          while (cycles < ncy && !array_contains (256, breakpoints, PC)
+                 && !PD);
+          if (PD)
+            sprintf (info, "power-down");
+          else if (cycles < ncy)
             sprintf (info, "breakpoint reached: 0x%04X", PC);
           break;
         case 'e':
@@ -599,7 +931,8 @@ static void run8051 (struct vm8051 *vm, int minimal)
           IR[3] = strlen (opcode) >> 1;
           sprintf (info, "instruction injected: ");
           sprint_op (info + strlen (info), IR, PC-IR[3]);
-          wrap_operate8051 (vm);
+          operate8051 (vm);
+          changed = 1;
           break;
         case 'h':
           /* switch i/o to hex mode or ascii mode */
@@ -609,12 +942,17 @@ static void run8051 (struct vm8051 *vm, int minimal)
         case '?':
           /* send data (serial port) */
           scanf ("%1024[^\n]", iobuf);
-          read_inbuf (iobuf);
-          sprintf (info, "string bufferized");
+          changed = 1;
+          if (read_inbuf (vm, iobuf))
+            sprintf (info, "string bufferized");
+          else
+            sprintf (info, "string truncated, serial buffer full");
           break;
         case '!':
           /* flush received data */
           outbuf_len = 0;
+          for (i = 0; i < (int) nmarks; i++)
+            marks[i].outbuf_len = 0;
           sprintf (info, "received data cleared");
           break;
         case 'P':
@@ -631,6 +969,7 @@ static void run8051 (struct vm8051 *vm, int minimal)
               break;
             }
           _sfr[address << 4] = value;
+          changed = 1;
           sprintf (info, "Port P%d affected to 0x%02X",
                    address, _sfr[address << 4]);
           break;
@@ -649,6 +988,7 @@ static void run8051 (struct vm8051 *vm, int minimal)
               break;
             }
           regs[address] = value;
+          changed = 1;
           sprintf (info, "Register R%d affected to 0x%02X",
                    address, regs[address]);
           break;
@@ -682,6 +1022,7 @@ static void run8051 (struct vm8051 *vm, int minimal)
                        command, address);
               break;
             }
+          changed = 1;
           if (c == 'i')
             {
               _data[address] = value;
@@ -691,14 +1032,18 @@ static void run8051 (struct vm8051 *vm, int minimal)
           if (c == 'f')
             {
               _sfr[address ^ 0x80] = value;
+              notify_banks (vm, address);
+#ifndef PURE_8051
+              notify_coprocessors (vm, address);
+#endif
               sprintf (info, "value at idata address 0x%02X set to 0x%02X",
                        address, _sfr[address ^ 0x80]);
             }
           if (c == 'x')
             {
-              _xdata[address] = value;
+              poke_xdata (vm, address, value);
               sprintf (info, "value at xdata address 0x%04X set to 0x%02X",
-                       address, _xdata[address]);
+                       address, peek_xdata (vm, address));
             }
           break;
         case 'B':
@@ -736,6 +1081,7 @@ static void run8051 (struct vm8051 *vm, int minimal)
               sprintf (info, "%c: invalid bit position %d", command, value);
               break;
             }
+          changed = 1;
           if (c == 'i')
             {
               sprintf (info, "Bit %d at idata address 0x%02X flipped "
@@ -751,14 +1097,19 @@ static void run8051 (struct vm8051 *vm, int minimal)
                        _sfr[address ^ 0x80],
                        _sfr[address ^ 0x80] ^ (1 << value));
               _sfr[address ^ 0x80] ^= (1 << value);
+              notify_banks (vm, address);
+#ifndef PURE_8051
+              notify_coprocessors (vm, address);
+#endif
             }
           if (c == 'x')
             {
               sprintf (info, "Bit %d at xdata address 0x%02X flipped "
                        "0x%02X => 0x%02X", value, address,
-                       _xdata[address],
-                       _xdata[address] ^ (1 << value));
-              _xdata[address] ^= (1 << value);
+                       peek_xdata (vm, address),
+                       peek_xdata (vm, address) ^ (1 << value));
+              poke_xdata (vm, address, peek_xdata (vm, address)
+                          ^ (1 << value));
             }
           break;
         case 'i':
@@ -786,59 +1137,441 @@ static void run8051 (struct vm8051 *vm, int minimal)
             }
           dump8051_xdata (vm, ncy);
           break;
+        case 'o':
+          /* print the hot spots of the code */
+          printf ("\n");
+          print_profile (vm, stdout, 20);
+          break;
+        case 'O':
+          /* profile from now on */
+          clear_profile (vm);
+          sprintf (info, "profile cleared");
+          break;
+        case 'u':
+          /* step back one instruction */
+          if (undo8051 (vm, undo))
+            {
+              sprintf (info, "stepped back to cycle %u", cycles);
+              break;
+            }
+          if (history_off)
+            {
+              sprintf (info, "%c: no history", command);
+              break;
+            }
+          if (history_back (vm, NULL))
+            sprintf (info, "stepped back to cycle %u", cycles);
+          else
+            sprintf (info, "start of history");
+          break;
+        case 'C':
+          /* continue backward */
+          if (history_off)
+            {
+              sprintf (info, "%c: no history", command);
+              break;
+            }
+          if (history_back (vm, breakpoints))
+            sprintf (info, "breakpoint reached backward: 0x%04X", PC);
+          else
+            sprintf (info, "start of history");
+          break;
         default:
           sprintf (info, "invalid command");
         }
+      if (changed)
+        {
+          clear_undo8051 (undo);
+          history_change (vm, before);
+        }
       if (command != '\n' && command != EOF)
         while (fgetc (stdin) != '\n');
       if (end)
         break;
     }
   dump8051 (vm, minimal);
+  free_chain8051 (&history);
+  free (marks);
+  free_undo8051 (undo);
+}
+
+/* whether the output got pattern, looking only at what came after from */
+static int search_outbuf (const char *pattern, size_t from)
+{
+  size_t i, len = strlen (pattern);
+
+  if (len == 0)
+    return 1;
+  from = from >= len ? from - len + 1 : 0;
+  for (i = from; i + len <= outbuf_len; i++)
+    if (memcmp (outbuf + i, pattern, len) == 0)
+      return 1;
+  return 0;
+}
+
+static void print_hex (const uint8_t *data, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    printf ("%c%c", hxd ((data[i] >> 4) & 0xF), hxd (data[i] & 0xF));
+  printf ("\n");
+}
+
+/* print the final state as key=value lines */
+static void print_state (struct vm8051 *vm, const char *reason, int serial)
+{
+  int i;
+
+  printf ("stop=%s\n", reason);
+  printf ("cycles=%u\n", cycles);
+  printf ("pc=0x%04X\n", PC);
+  printf ("a=0x%02X\n", A);
+  printf ("b=0x%02X\n", B);
+  printf ("psw=0x%02X\n", PSW);
+  printf ("sp=0x%02X\n", SP);
+  printf ("dptr=0x%04X\n", DPTR);
+  for (i = 0; i < 8; i++)
+    printf ("r%d=0x%02X\n", i, regs[i]);
+  printf ("idata=");
+  print_hex (_data, 256);
+  printf ("sfr=");
+  print_hex (_sfr, 128);
+  printf ("serial_length=%lu\n", (unsigned long) outbuf_len);
+  if (serial)
+    {
+      printf ("serial=");
+      print_hex (outbuf, outbuf_len);
+    }
+}
+
+/* more than sim8051 runs past the cycles it is given */
+#define WRAP_MARGIN 64
+
+/* run without interaction for ncy cycles, until address (-1 for none) or
+   pattern (NULL for none) in the output, adding a checkpoint to chain
+   each period cycles if not 0; return 1 if the run ended, by running out
+   of cycles or powering down, before reaching what was asked */
+static int run_headless (struct vm8051 *vm, uint64_t ncy, int32_t address,
+                         const char *pattern, FILE *output,
+                         uint32_t period, const char *chain)
+{
+  const char *reason = "cycles";
+  uint64_t ran = 0, next = UINT64_MAX, left;
+  uint32_t from_cycle, until;
+  size_t from;
+  int error;
+
+  /* stop at each byte transmitted to look for the pattern and keep the
+     ring from filling up */
+  watch_uart (vm, 1);
+  while (ran < ncy)
+    {
+      if (period)
+        next = (ran / period + 1) * period;
+      left = (next < ncy ? next : ncy) - ran;
+      from_cycle = cycles;
+      /* sim8051 cannot stop after the cycles wrap around: step across */
+      if (cycles > UINT32_MAX - WRAP_MARGIN)
+        {
+          fetch8051 (vm);
+          operate8051 (vm);
+        }
+      else
+        {
+          until = left < UINT32_MAX - WRAP_MARGIN - cycles
+            ? cycles + (uint32_t) left : UINT32_MAX - WRAP_MARGIN;
+          sim8051 (vm, address, until);
+        }
+      ran += (uint32_t) (cycles - from_cycle);
+      from = outbuf_len;
+      read_outbuf (vm);
+      if (pattern && outbuf_len > from && search_outbuf (pattern, from))
+        {
+          reason = "pattern";
+          break;
+        }
+      if (PC == address)
+        {
+          reason = "pc";
+          break;
+        }
+      if (PD)
+        {
+          reason = "power-down";
+          break;
+        }
+      if (ran >= next && ran < ncy
+          && (error = append8051 (vm, chain)) != CHECKPOINT_OK)
+        {
+          fprintf (stderr, "%s: %s\n", chain, checkpoint_strerror (error));
+          period = 0;
+          next = UINT64_MAX;
+        }
+    }
+  watch_uart (vm, 0);
+
+  if (output)
+    fwrite (outbuf, 1, outbuf_len, output);
+  print_state (vm, reason, output == NULL);
+  return (address >= 0 || pattern) && strcmp (reason, "pc") != 0
+    && strcmp (reason, "pattern") != 0;
 }
 
 int main (int argc, char *argv[])
 {
+  const char *name = argv[0];
   int minimal = 0;
+  int headless = 0;
+  uint64_t seed = time (NULL);
+  uint64_t ncy = 1000000000;
+  int32_t address = -1;
+  const char *pattern = NULL;
+  const char *input = NULL;
+  const char *output = NULL;
+  const char *cache_dir = NULL;
+  uint8_t bank_sfr = 0;
+  const char *checkpoint = NULL;
+  const char *save = NULL;
+  const char *report = NULL;
+  const char *folded = NULL;
+  const char *names = NULL;
+  const char *covered = NULL;
+  uint64_t rewind = UINT64_MAX;
+  uint32_t period = 0;
+  int rx_fd = -1;
+  FILE *serial = NULL;
+  FILE *profile = NULL;
+  FILE *stacks = NULL;
+  int ret = 0;
+  int error;
   struct vm8051 *vm;
-  FILE *program;
+  struct image_cache cache;
+  const struct code_image *image;
 
-  if (argc > 1)
+  while (argc > 1)
     {
       if (strcmp (argv[1], "-m") == 0)
+        minimal = 1;
+      else if (strcmp (argv[1], "--run") == 0)
+        headless = 1;
+      else if (argc > 2 && argv[1][0] == '-' && argv[1][1] != '\0'
+               && strchr ("snpeiocblwtkfgyv", argv[1][1]) && argv[1][2] == '\0')
         {
-          minimal = 1;
+          switch (argv[1][1])
+            {
+            case 's':
+              seed = strtoull (argv[2], NULL, 0);
+              break;
+            case 'n':
+              ncy = strtoull (argv[2], NULL, 0);
+              break;
+            case 'p':
+              address = strtoul (argv[2], NULL, 16) & 0xFFFF;
+              break;
+            case 'e':
+              pattern = argv[2];
+              break;
+            case 'i':
+              input = argv[2];
+              break;
+            case 'o':
+              output = argv[2];
+              break;
+            case 'c':
+              cache_dir = argv[2];
+              break;
+            case 'b':
+              bank_sfr = strtoul (argv[2], NULL, 16) | 0x80;
+              break;
+            case 'l':
+              checkpoint = argv[2];
+              break;
+            case 'w':
+              save = argv[2];
+              break;
+            case 't':
+              rewind = strtoull (argv[2], NULL, 0);
+              break;
+            case 'k':
+              period = strtoul (argv[2], NULL, 0);
+              break;
+            case 'f':
+              report = argv[2];
+              break;
+            case 'g':
+              folded = argv[2];
+              break;
+            case 'y':
+              names = argv[2];
+              break;
+            case 'v':
+              covered = argv[2];
+              break;
+            }
           argc--;
           argv++;
         }
+      else
+        break;
+      argc--;
+      argv++;
     }
-  if (argc < 2)
+  if (argc < 2 || (!headless && (address >= 0 || pattern || input
+                                 || output || save || period || report
+                                 || folded || covered))
+      || (period && !save))
     {
-      fprintf (stderr, "Usage: %s [-m] input\n", argv[0]);
+      fprintf (stderr, "Usage: %s [-m] [-s seed] [-c cache] [-b sfr] "
+               "[-l checkpoint [-t cycle]] [-y symbols] input\n"
+               "       %s --run [-s seed] [-c cache] [-b sfr] "
+               "[-l checkpoint [-t cycle]] [-n cycles] [-p address] "
+               "[-e pattern] [-i serial-input] [-o serial-output] "
+               "[-w checkpoint [-k period]] [-f profile] [-g stacks] "
+               "[-y symbols] [-v coverage] input\n", name, name);
       return -1;
     }
-  vm = malloc (sizeof (struct vm8051));
+  if (input && (rx_fd = open (input, O_RDONLY)) < 0)
+    {
+      perror (input);
+      return -1;
+    }
+  if (output && (serial = fopen (output, "wb")) == NULL)
+    {
+      perror (output);
+      return -1;
+    }
+  if (report && (profile = fopen (report, "w")) == NULL)
+    {
+      perror (report);
+      return -1;
+    }
+  if (folded && (stacks = fopen (folded, "w")) == NULL)
+    {
+      perror (folded);
+      return -1;
+    }
+  if (names && !read_symbols (names))
+    {
+      perror (names);
+      return -1;
+    }
+  vm = calloc (1, sizeof (struct vm8051));
   assert (vm != NULL);
   vm->coprocessors = NULL;
+  _xdata = calloc (1, 65536);
+  assert (_xdata != NULL);
+  add_uart (vm, 1 << 16);
+  bind_uart (vm, rx_fd, -1);
+  /* the interactive mode always profiles */
+  if (!headless || profile || stacks)
+    add_profile (vm);
+  if (covered)
+    add_coverage (vm);
 
 #ifndef PURE_8051
-  add_copro_RNG (vm);
+  add_copro_RNG (vm, seed);
+#else
+  (void) seed;
 #endif
 
-  program = fopen (argv[1], "rb");
-  if (program != NULL && read_hex (_code, program) > 0)
+  init_image_cache (&cache, cache_dir);
+  error = get_image (&cache, argv[1], &image);
+  if (error == HEX_OK && image->len > 0)
     {
+      if (image->nbanks > 1)
+        {
+          add_banks (vm, image->nbanks, image->code, image->predecode);
+          if (bank_sfr)
+            select_bank (vm, bank_sfr, NULL);
+        }
+      else
+        {
+          _code = image->code;
+          vm->predecode = image->predecode;
+        }
       reset8051 (vm);
-      run8051 (vm, minimal);
-      fclose (program);
+      if (checkpoint && (error = rewind8051 (vm, checkpoint, rewind))
+          != CHECKPOINT_OK)
+        {
+          fprintf (stderr, "%s: %s\n", checkpoint,
+                   checkpoint_strerror (error));
+          ret = -1;
+        }
+      /* a chain goes on from the checkpoint it was loaded at the end of,
+         and starts again with the state run from otherwise */
+      else if (period && (!checkpoint || rewind != UINT64_MAX
+                          || strcmp (checkpoint, save) != 0)
+               && (error = save8051 (vm, save)) != CHECKPOINT_OK)
+        {
+          fprintf (stderr, "%s: %s\n", save, checkpoint_strerror (error));
+          ret = -1;
+        }
+      else if (headless)
+        {
+          /* the calls are followed from where the run starts */
+          clear_profile (vm);
+          ret = run_headless (vm, ncy, address, pattern, serial, period,
+                              save);
+          if (profile)
+            print_profile (vm, profile, 0);
+          if (stacks)
+            write_folded (vm, stacks, symbols);
+          if (covered && !update_coverage (vm->coverage, covered))
+            {
+              fprintf (stderr, "%s: cannot add the coverage\n", covered);
+              ret = -1;
+            }
+          if (save && (error = period ? append8051 (vm, save)
+                       : save8051 (vm, save)) != CHECKPOINT_OK)
+            {
+              fprintf (stderr, "%s: %s\n", save,
+                       checkpoint_strerror (error));
+              ret = -1;
+            }
+        }
+      else
+        {
+          clear_profile (vm);
+          run8051 (vm, minimal);
+        }
     }
   else
-    fprintf (stderr, "%s: empty program\n", argv[1]);
+    {
+      if (error == HEX_EOPEN)
+        fprintf (stderr, "%s: %s\n", argv[1], hex_strerror (error));
+      else if (error != HEX_OK)
+        fprintf (stderr, "%s:%u: %s\n", argv[1], cache.line,
+                 hex_strerror (error));
+      else
+        fprintf (stderr, "%s: empty program\n", argv[1]);
+      if (headless)
+        ret = -1;
+    }
+  if (image)
+    put_image (&cache, image);
 
 #ifndef PURE_8051
   free_coprocessors (vm);
 #endif
 
+  free_uart (vm);
+  free_banks (vm);
+  free_xdata (vm);
+  free_profile (vm);
+  free_coverage (vm);
+  free (_xdata);
   free (vm);
-  return 0;
+  free_image_cache (&cache);
+  free (outbuf);
+  if (rx_fd >= 0)
+    close (rx_fd);
+  if (serial)
+    fclose (serial);
+  if (profile)
+    fclose (profile);
+  if (stacks)
+    fclose (stacks);
+  free_symbols ();
+  return ret;
 }